@@ -1,6 +1,7 @@
 // Live Chat Room - Multi-threaded TCP Client
 // Real-time chat with authentication and dual I/O threads
 
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -9,9 +10,17 @@
 #include <sys/socket.h>
 #include <arpa/inet.h>
 #include <netinet/in.h>
+#include <netdb.h>
+#include <sys/un.h>
+#include <sys/mman.h>
+#include <poll.h>
 #include <pthread.h>
 #include <signal.h>
 #include "protocol.h"
+#ifdef CHAT_TLS
+#include <openssl/err.h>
+#include <openssl/x509v3.h>
+#endif
 
 // ANSI color codes
 #define COLOR_RESET   "\033[0m"
@@ -25,20 +34,57 @@
 // Global state
 int global_sock = 0;
 volatile int keep_running = 1;
+int signal_fd = -1;                 // SIGINT/SIGTERM as events next to stdin
 char my_username[MAX_USERNAME];
+const char *server_host = "127.0.0.1";  // TCP server (-H), also the name TLS verifies
+
+// Bytes received but not yet displayed (partial line, or frames that arrived
+// together with the authentication response)
+char pending[BUFFER_SIZE];
+size_t pending_len = 0;
+
+// Shared-memory ring for broadcasts (negotiated with -m over the Unix socket)
+shm_ring_t *shm_ring = NULL;
+int shm_event_fd = -1;
+
+// Socket and ring threads both print frames
+pthread_mutex_t display_mutex = PTHREAD_MUTEX_INITIALIZER;
 
 // Signal handler
-void signal_handler(int sig);
+int read_input(char *buffer, int size);
 void display_welcome_banner(const char *username);
 void send_disconnect_message(const char *username);
 void *receive_thread(void *arg);
+void display_frame(const char *frame);
+int format_topic_command(char *buffer, const char *username, const char *input);
+size_t display_frames(char *buffer, size_t len);
+int connect_unix(const char *path);
+int connect_tcp(const char *host);
+int request_shm_ring(int sock);
+void *ring_thread(void *arg);
+#ifdef CHAT_TLS
+int tls_connect(int sock, const char *host, const char *ca_file);
+#endif
+
+// Read one line of user input, waiting on stdin and signal_fd together
+// Returns 0 with the line in buffer, or -1 on EOF or an interrupt signal
+int read_input(char *buffer, int size) {
+    struct pollfd sources[2] = {
+        { .fd = STDIN_FILENO, .events = POLLIN },
+        { .fd = signal_fd, .events = POLLIN },
+    };
+    while (poll(sources, 2, -1) < 0) {
+        if (errno != EINTR) return -1;
+    }
 
-void signal_handler(int sig) {
-    if (sig == SIGINT) {
+    if (sources[1].revents & POLLIN) {
+        next_signal(signal_fd);
         printf("\n%s[!] Caught interrupt signal, disconnecting...%s\n",
                COLOR_YELLOW, COLOR_RESET);
         keep_running = 0;
+        return -1;
     }
+    return fgets(buffer, size, stdin) != NULL ? 0 : -1;
 }
 
 // Display welcome banner after authentication
@@ -49,13 +95,21 @@ void display_welcome_banner(const char *username) {
     printf("%s╟────────────────────────────────────────╢%s\n", COLOR_CYAN, COLOR_RESET);
     printf("%s║%s  Username: %s%-27s%s%s║%s\n",
            COLOR_CYAN, COLOR_RESET, COLOR_GREEN, username, COLOR_RESET, COLOR_CYAN, COLOR_RESET);
-    printf("%s║%s  Server:   127.0.0.1:%-16d%s║%s\n",
-           COLOR_CYAN, COLOR_RESET, SERVER_PORT, COLOR_CYAN, COLOR_RESET);
+    char server[64];
+    snprintf(server, sizeof(server), "%s:%d", server_host, SERVER_PORT);
+    printf("%s║%s  Server:   %-26.26s%s║%s\n",
+           COLOR_CYAN, COLOR_RESET, server, COLOR_CYAN, COLOR_RESET);
     printf("%s╟────────────────────────────────────────╢%s\n", COLOR_CYAN, COLOR_RESET);
     printf("%s║%s  Commands:                             %s║%s\n",
            COLOR_CYAN, COLOR_RESET, COLOR_CYAN, COLOR_RESET);
     printf("%s║%s   - Type messages to chat              %s║%s\n",
            COLOR_CYAN, COLOR_RESET, COLOR_CYAN, COLOR_RESET);
+    printf("%s║%s   - /sub /unsub pattern (team.*)       %s║%s\n",
+           COLOR_CYAN, COLOR_RESET, COLOR_CYAN, COLOR_RESET);
+    printf("%s║%s   - /pub topic message                 %s║%s\n",
+           COLOR_CYAN, COLOR_RESET, COLOR_CYAN, COLOR_RESET);
+    printf("%s║%s   - /search words                      %s║%s\n",
+           COLOR_CYAN, COLOR_RESET, COLOR_CYAN, COLOR_RESET);
     printf("%s║%s   - 'quit' or Ctrl+D to exit           %s║%s\n",
            COLOR_CYAN, COLOR_RESET, COLOR_CYAN, COLOR_RESET);
     printf("%s╚════════════════════════════════════════╝%s\n", COLOR_CYAN, COLOR_RESET);
@@ -71,34 +125,53 @@ void send_disconnect_message(const char *username) {
     }
 }
 
-// Receive thread - listens for incoming messages from server
-void *receive_thread(void *arg) {
-    (void)arg;  // Unused parameter
+// Format a /sub, /unsub, /pub or /search command into its protocol frame
+// Returns 0 if formatted, -1 if the command is malformed, 1 if input is not a command
+int format_topic_command(char *buffer, const char *username, const char *input) {
+    if (strncmp(input, "/sub ", 5) == 0) {
+        if (!validate_topic(input + 5, 1)) return -1;
+        format_subscribe(buffer, input + 5);
+        return 0;
+    }
 
-    char buffer[BUFFER_SIZE];
+    if (strncmp(input, "/unsub ", 7) == 0) {
+        if (!validate_topic(input + 7, 1)) return -1;
+        format_unsubscribe(buffer, input + 7);
+        return 0;
+    }
 
-    while (keep_running) {
-        memset(buffer, 0, BUFFER_SIZE);
+    if (strncmp(input, "/pub ", 5) == 0) {
+        char topic[MAX_TOPIC];
+        const char *space = strchr(input + 5, ' ');
+        if (space == NULL || (size_t)(space - (input + 5)) >= MAX_TOPIC) return -1;
 
-        int valread = read(global_sock, buffer, BUFFER_SIZE - 1);
+        memcpy(topic, input + 5, (size_t)(space - (input + 5)));
+        topic[space - (input + 5)] = '\0';
+        if (!validate_topic(topic, 0) || !validate_message_content(space + 1)) return -1;
+        format_publish(buffer, topic, username, space + 1);
+        return 0;
+    }
 
-        if (valread <= 0) {
-            if (keep_running) {
-                printf("\n%s[!] Disconnected from server%s\n", COLOR_RED, COLOR_RESET);
-                keep_running = 0;
-            }
-            break;
-        }
+    if (strncmp(input, "/search ", 8) == 0) {
+        if (!validate_message_content(input + 8)) return -1;
+        format_search(buffer, DEFAULT_ROOM, input + 8);
+        return 0;
+    }
 
-        buffer[valread] = '\0';
+    return 1;
+}
+
+// Display one server frame (without its trailing newline)
+void display_frame(const char *frame) {
+    pthread_mutex_lock(&display_mutex);
 
-        // Parse message
-        message_t msg;
-        if (parse_message(buffer, &msg) == 0) {
-            // Move cursor to beginning of line and clear it
-            printf("\r\033[K");
+    // Move cursor to beginning of line and clear it
+    printf("\r\033[K");
 
-            if (strcmp(msg.type, MSG_TYPE_MESSAGE) == 0) {
+    message_t msg;
+    if (parse_message(frame, &msg) == 0) {
+        switch (msg.kind) {
+            case TYPE_MSG:
                 // Regular chat message
                 if (strcmp(msg.sender, my_username) == 0) {
                     // My own message (echo from server)
@@ -107,36 +180,319 @@ void *receive_thread(void *arg) {
                     // Message from another user
                     printf("%s[%s]%s %s\n", COLOR_CYAN, msg.sender, COLOR_RESET, msg.content);
                 }
-            } else if (strcmp(msg.type, MSG_TYPE_NOTIFY) == 0) {
+                break;
+            case TYPE_PUB:
+                // Message published to a subscribed topic
+                printf("%s[%s]%s %s: %s\n", COLOR_BLUE, msg.topic, COLOR_RESET, msg.sender, msg.content);
+                break;
+            case TYPE_RESULT:
+                // Search hit from the room's history
+                printf("%s[search]%s %s: %s\n", COLOR_YELLOW, COLOR_RESET, msg.sender, msg.content);
+                break;
+            case TYPE_NOTIFY:
                 // System notification
                 printf("%s[*] %s%s\n", COLOR_YELLOW, msg.content, COLOR_RESET);
-            } else if (strcmp(msg.type, MSG_TYPE_ERROR) == 0) {
+                break;
+            case TYPE_ERROR:
                 // Error message
                 printf("%s[ERROR] %s%s\n", COLOR_RED, msg.content, COLOR_RESET);
+                break;
+            default:
+                break;
+        }
+    } else {
+        // Couldn't parse, display raw message
+        printf("%s[Server] %s%s\n", COLOR_BLUE, frame, COLOR_RESET);
+    }
+
+    // Re-display prompt
+    printf("%s> %s", COLOR_GREEN, COLOR_RESET);
+    fflush(stdout);
+
+    pthread_mutex_unlock(&display_mutex);
+}
+
+// Display every complete line in buffer and keep the partial remainder
+// Returns the number of bytes left in buffer
+size_t display_frames(char *buffer, size_t len) {
+    char *newline;
+    while ((newline = memchr(buffer, '\n', len)) != NULL) {
+        *newline = '\0';
+        display_frame(buffer);
+
+        size_t consumed = (size_t)(newline - buffer) + 1;
+        len -= consumed;
+        memmove(buffer, buffer + consumed, len);
+    }
+    return len;
+}
+
+// Receive thread - listens for incoming messages from server
+// Several frames can arrive in one read, so display each complete line
+void *receive_thread(void *arg) {
+    (void)arg;  // Unused parameter
+
+    while (keep_running) {
+        pending_len = display_frames(pending, pending_len);
+
+        // A frame longer than the buffer can't be completed; drop it
+        if (pending_len == sizeof(pending) - 1) pending_len = 0;
+
+        int valread = read(global_sock, pending + pending_len,
+                           sizeof(pending) - 1 - pending_len);
+
+        if (valread <= 0) {
+            if (keep_running) {
+                printf("\n%s[!] Disconnected from server%s\n", COLOR_RED, COLOR_RESET);
+                keep_running = 0;
             }
+            break;
+        }
 
-            // Re-display prompt
-            printf("%s> %s", COLOR_GREEN, COLOR_RESET);
-            fflush(stdout);
-        } else {
-            // Couldn't parse, display raw message
-            printf("\r\033[K");
-            printf("%s[Server] %s%s", COLOR_BLUE, buffer, COLOR_RESET);
-            printf("%s> %s", COLOR_GREEN, COLOR_RESET);
-            fflush(stdout);
+        pending_len += (size_t)valread;
+    }
+
+    return NULL;
+}
+
+// Connect to the server's Unix-domain socket
+// The server listens with SOCK_SEQPACKET where supported, SOCK_STREAM otherwise
+int connect_unix(const char *path) {
+    struct sockaddr_un addr = {0};
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+
+    int types[2] = { SOCK_SEQPACKET, SOCK_STREAM };
+    for (int i = 0; i < 2; i++) {
+        int sock = socket(AF_UNIX, types[i], 0);
+        if (sock < 0) continue;
+        if (connect(sock, (struct sockaddr *)&addr, sizeof(addr)) == 0) return sock;
+        close(sock);
+    }
+
+    return -1;
+}
+
+// Ask the server for a shared-memory broadcast ring
+// Frames that arrive before SHM_OK are kept in pending for the receive thread
+int request_shm_ring(int sock) {
+    char request[BUFFER_SIZE];
+    format_frame(request, TYPE_SHM, NULL, NULL, NULL);
+    if (send(sock, request, strlen(request), 0) < 0) return -1;
+
+    while (pending_len < sizeof(pending) - 1) {
+        char control[CMSG_SPACE(sizeof(int) * 2)];
+        size_t before = pending_len;
+        struct iovec iov = { .iov_base = pending + before,
+                             .iov_len = sizeof(pending) - 1 - before };
+        struct msghdr msgh = {0};
+        msgh.msg_iov = &iov;
+        msgh.msg_iovlen = 1;
+        msgh.msg_control = control;
+        msgh.msg_controllen = sizeof(control);
+
+        ssize_t n = recvmsg(sock, &msgh, 0);
+        if (n <= 0) return -1;
+        pending_len += (size_t)n;
+        pending[pending_len] = '\0';
+
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msgh);
+        if (cmsg != NULL && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS &&
+            cmsg->cmsg_len == CMSG_LEN(sizeof(int) * 2)) {
+            int fds[2];
+            memcpy(fds, CMSG_DATA(cmsg), sizeof(fds));
+
+            // The fds ride on the SHM_OK frame, so it starts this chunk
+            size_t ok_len = strlen(SHM_OK) + 1;
+            if (strncmp(pending + before, SHM_OK "\n", ok_len) == 0) {
+                pending_len -= ok_len;
+                memmove(pending + before, pending + before + ok_len, pending_len - before);
+            }
+
+            shm_ring = mmap(NULL, sizeof(shm_ring_t), PROT_READ | PROT_WRITE,
+                            MAP_SHARED, fds[0], 0);
+            close(fds[0]);
+            if (shm_ring == MAP_FAILED) {
+                shm_ring = NULL;
+                close(fds[1]);
+                return -1;
+            }
+            shm_event_fd = fds[1];
+            return 0;
         }
+
+        // Refused - the ERROR frame stays in pending and is displayed
+        if (strstr(pending, "ERROR:") != NULL) return -1;
+    }
+
+    return -1;
+}
+
+#ifdef CHAT_TLS
+// Run the client side of the TLS handshake on a connected TCP socket
+// Verifies the server against ca_file when given, for host: an IP address
+// must be in the certificate's IP SANs, a name in its DNS names
+// Returns the fd to use or -1
+int tls_connect(int sock, const char *host, const char *ca_file) {
+    SSL_CTX *ctx = SSL_CTX_new(TLS_client_method());
+    if (ctx == NULL) {
+        close(sock);
+        return -1;
+    }
+    SSL_CTX_set_min_proto_version(ctx, TLS1_2_VERSION);
+    SSL_CTX_set_options(ctx, SSL_OP_ENABLE_KTLS);
+
+    if (ca_file != NULL) {
+        if (SSL_CTX_load_verify_locations(ctx, ca_file, NULL) != 1) {
+            ERR_print_errors_fp(stderr);
+            SSL_CTX_free(ctx);
+            close(sock);
+            return -1;
+        }
+        SSL_CTX_set_verify(ctx, SSL_VERIFY_PEER, NULL);
+    } else {
+        fprintf(stderr, "%sWarning: server certificate not verified (use -C)%s\n",
+                COLOR_YELLOW, COLOR_RESET);
+    }
+
+    SSL *ssl = SSL_new(ctx);
+    SSL_CTX_free(ctx);  // The session keeps its own reference
+
+    unsigned char addr[sizeof(struct in6_addr)];
+    int is_ip = inet_pton(AF_INET, host, addr) == 1 || inet_pton(AF_INET6, host, addr) == 1;
+    int checked = ssl != NULL &&
+                  (ca_file == NULL ||
+                   (is_ip ? X509_VERIFY_PARAM_set1_ip_asc(SSL_get0_param(ssl), host)
+                          : SSL_set1_host(ssl, host)) == 1) &&
+                  (is_ip || SSL_set_tlsext_host_name(ssl, host) == 1);  // SNI takes names only
+    if (!checked || SSL_set_fd(ssl, sock) != 1 || SSL_connect(ssl) != 1) {
+        ERR_print_errors_fp(stderr);
+        SSL_free(ssl);
+        close(sock);
+        return -1;
+    }
+
+    printf("%s✓ %s session (%s)%s\n", COLOR_GREEN, SSL_get_version(ssl),
+           tls_kernel_offloaded(ssl) ? "kTLS" : "user-space", COLOR_RESET);
+    return tls_finish(ssl, sock);
+}
+#endif
+
+// Connect over TCP to host (a name or an IPv4/IPv6 address) on SERVER_PORT
+// Returns the socket or -1
+int connect_tcp(const char *host) {
+    char port[16];
+    snprintf(port, sizeof(port), "%d", SERVER_PORT);
+
+    struct addrinfo hints = { .ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM };
+    struct addrinfo *addrs;
+    int error = getaddrinfo(host, port, &hints, &addrs);
+    if (error != 0) {
+        fprintf(stderr, "%s%s: %s%s\n", COLOR_RED, host, gai_strerror(error), COLOR_RESET);
+        return -1;
+    }
+
+    int sock = -1;
+    for (struct addrinfo *ai = addrs; ai != NULL && sock < 0; ai = ai->ai_next) {
+        sock = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+        if (sock >= 0 && connect(sock, ai->ai_addr, ai->ai_addrlen) != 0) {
+            close(sock);
+            sock = -1;
+        }
+    }
+    freeaddrinfo(addrs);
+    return sock;
+}
+
+// Ring thread - displays broadcasts written into the shared-memory ring
+void *ring_thread(void *arg) {
+    (void)arg;  // Unused parameter
+
+    char frames[BUFFER_SIZE];
+    size_t len = 0;
+
+    while (keep_running) {
+        size_t n = shm_ring_read(shm_ring, frames + len, sizeof(frames) - 1 - len);
+
+        if (n == 0) {
+            // Server detached the ring (e.g. hot upgrade); the socket carries on
+            if (__atomic_load_n(&shm_ring->closed, __ATOMIC_ACQUIRE) &&
+                __atomic_load_n(&shm_ring->head, __ATOMIC_ACQUIRE) == shm_ring->tail) {
+                break;
+            }
+
+            // Announce the sleep, then re-check so a concurrent write can't be missed
+            __atomic_store_n(&shm_ring->consumer_waiting, 1, __ATOMIC_SEQ_CST);
+            if (__atomic_load_n(&shm_ring->head, __ATOMIC_SEQ_CST) == shm_ring->tail &&
+                !__atomic_load_n(&shm_ring->closed, __ATOMIC_SEQ_CST)) {
+                uint64_t count;
+                if (read(shm_event_fd, &count, sizeof(count)) < 0) break;
+            }
+            __atomic_store_n(&shm_ring->consumer_waiting, 0, __ATOMIC_SEQ_CST);
+            continue;
+        }
+
+        len = display_frames(frames, len + n);
+
+        // A frame longer than the buffer can't be completed; drop it
+        if (len == sizeof(frames) - 1) len = 0;
     }
 
     return NULL;
 }
 
 // Main client function
-int main() {
+int main(int argc, char *argv[]) {
     int sock = 0;
-    struct sockaddr_in serv_addr;
     char username[MAX_USERNAME] = {0};
 
-    signal(SIGINT, signal_handler);
+    // Usage: client [-m] [-t [-C ca.pem]] [-H host] [socket_path]
+    // (-m: shared-memory ring, Unix socket only; -t: TLS and -H: server host, TCP only)
+    int use_shm = 0;
+    int use_tls = 0;
+    const char *ca_file = NULL;
+    int opt_char;
+    while ((opt_char = getopt(argc, argv, "mtC:H:")) != -1) {
+        if (opt_char == 'm') {
+            use_shm = 1;
+        } else if (opt_char == 't') {
+            use_tls = 1;
+        } else if (opt_char == 'C') {
+            ca_file = optarg;
+        } else if (opt_char == 'H') {
+            server_host = optarg;
+        } else {
+            fprintf(stderr, "Usage: %s [-m] [-t [-C ca.pem]] [-H host] [socket_path]\n", argv[0]);
+            return -1;
+        }
+    }
+    const char *socket_path = optind < argc ? argv[optind] : NULL;
+    if (use_shm && socket_path == NULL) {
+        fprintf(stderr, "%s-m requires a Unix socket path%s\n", COLOR_RED, COLOR_RESET);
+        return -1;
+    }
+    if (use_tls && socket_path != NULL) {
+        fprintf(stderr, "%s-t applies to TCP connections only%s\n", COLOR_RED, COLOR_RESET);
+        return -1;
+    }
+#ifndef CHAT_TLS
+    if (use_tls) {
+        fprintf(stderr, "%sTLS support not compiled in (rebuild with -DCHAT_TLS -lssl -lcrypto)%s\n",
+                COLOR_RED, COLOR_RESET);
+        return -1;
+    }
+    (void)ca_file;
+#endif
+
+    // Ctrl+C becomes an event read next to stdin rather than a handler that
+    // races the I/O threads; stdin is unbuffered so poll() sees every line
+    static const int handled_signals[] = { SIGINT, SIGTERM };
+    signal_fd = open_signal_fd(handled_signals, 2);
+    if (signal_fd < 0) {
+        perror("Signal setup failed");
+        return -1;
+    }
+    setvbuf(stdin, NULL, _IONBF, 0);
 
     // Display header
     printf("\n");
@@ -149,8 +505,10 @@ int main() {
     printf("Enter your username: ");
     fflush(stdout);
 
-    if (fgets(username, MAX_USERNAME, stdin) == NULL) {
-        fprintf(stderr, "%sFailed to read username%s\n", COLOR_RED, COLOR_RESET);
+    if (read_input(username, MAX_USERNAME) != 0) {
+        if (keep_running) {
+            fprintf(stderr, "%sFailed to read username%s\n", COLOR_RED, COLOR_RESET);
+        }
         return -1;
     }
 
@@ -174,33 +532,31 @@ int main() {
 
     printf("%sUsername: %s%s\n", COLOR_GREEN, username, COLOR_RESET);
 
-    // Create socket
-    if ((sock = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
-        perror("Socket creation error");
-        return -1;
-    }
-
-    // Set up server address
-    serv_addr.sin_family = AF_INET;
-    serv_addr.sin_port = htons(SERVER_PORT);
-
-    // Convert IPv4 address from text to binary form
-    if (inet_pton(AF_INET, "127.0.0.1", &serv_addr.sin_addr) <= 0) {
-        fprintf(stderr, "%sInvalid address / Address not supported%s\n",
-                COLOR_RED, COLOR_RESET);
-        close(sock);
-        return -1;
-    }
-
-    // Connect to server
-    printf("%sConnecting to server at 127.0.0.1:%d...%s\n",
-           COLOR_YELLOW, SERVER_PORT, COLOR_RESET);
+    if (socket_path != NULL) {
+        // Same-host server: connect over its Unix-domain socket
+        printf("%sConnecting to server at %s...%s\n", COLOR_YELLOW, socket_path, COLOR_RESET);
+        if ((sock = connect_unix(socket_path)) < 0) {
+            fprintf(stderr, "%sConnection Failed%s\n", COLOR_RED, COLOR_RESET);
+            fprintf(stderr, "Make sure the server is listening on %s (-s)\n", socket_path);
+            return -1;
+        }
+    } else {
+        // Connect to server
+        printf("%sConnecting to server at %s:%d...%s\n",
+               COLOR_YELLOW, server_host, SERVER_PORT, COLOR_RESET);
+
+        if ((sock = connect_tcp(server_host)) < 0) {
+            fprintf(stderr, "%sConnection Failed%s\n", COLOR_RED, COLOR_RESET);
+            fprintf(stderr, "Make sure the server is running on port %d\n", SERVER_PORT);
+            return -1;
+        }
 
-    if (connect(sock, (struct sockaddr *)&serv_addr, sizeof(serv_addr)) < 0) {
-        fprintf(stderr, "%sConnection Failed%s\n", COLOR_RED, COLOR_RESET);
-        fprintf(stderr, "Make sure the server is running on port %d\n", SERVER_PORT);
-        close(sock);
-        return -1;
+#ifdef CHAT_TLS
+        if (use_tls && (sock = tls_connect(sock, server_host, ca_file)) < 0) {
+            fprintf(stderr, "%sTLS handshake failed%s\n", COLOR_RED, COLOR_RESET);
+            return -1;
+        }
+#endif
     }
 
     printf("%s✓ Connected to server%s\n", COLOR_GREEN, COLOR_RESET);
@@ -228,10 +584,13 @@ int main() {
     }
     auth_response[valread] = '\0';
 
-    // Extract first line only (in case multiple messages arrive together)
+    // Extract first line only; anything after it (e.g. scrollback) is kept
+    // for the receive thread
     char *newline = strchr(auth_response, '\n');
     if (newline != NULL) {
         *newline = '\0';
+        pending_len = (size_t)(valread - (newline + 1 - auth_response));
+        memcpy(pending, newline + 1, pending_len);
     }
 
     // Check authentication result
@@ -245,6 +604,20 @@ int main() {
         return -1;
     }
 
+    // Co-located clients can take broadcasts over shared memory instead
+    pthread_t ring_tid;
+    int ring_started = 0;
+    if (use_shm) {
+        if (request_shm_ring(sock) == 0 &&
+            pthread_create(&ring_tid, NULL, ring_thread, NULL) == 0) {
+            ring_started = 1;
+            printf("%s✓ Receiving over shared memory%s\n", COLOR_GREEN, COLOR_RESET);
+        } else {
+            fprintf(stderr, "%sShared memory unavailable, using the socket%s\n",
+                    COLOR_YELLOW, COLOR_RESET);
+        }
+    }
+
     // Start receive thread
     global_sock = sock;
 
@@ -264,8 +637,8 @@ int main() {
         fflush(stdout);
 
         // Read user input
-        if (fgets(input, MAX_MESSAGE, stdin) == NULL) {
-            // EOF (Ctrl+D) or error
+        if (read_input(input, MAX_MESSAGE) != 0) {
+            // EOF (Ctrl+D), Ctrl+C or error
             if (keep_running) {
                 printf("\n%sDisconnecting...%s\n", COLOR_YELLOW, COLOR_RESET);
             }
@@ -292,15 +665,27 @@ int main() {
             break;
         }
 
-        // Validate message content
-        if (!validate_message_content(input)) {
-            fprintf(stderr, "%sMessage too long! Maximum %d characters.%s\n",
-                    COLOR_RED, MAX_MESSAGE - 1, COLOR_RESET);
+        // Topic commands, anything else is a chat message
+        int command = format_topic_command(formatted_msg, username, input);
+        if (command < 0) {
+            fprintf(stderr, "%sUsage: /sub pattern | /unsub pattern | /pub topic message | /search words%s\n",
+                    COLOR_RED, COLOR_RESET);
             continue;
         }
 
-        // Format and send message
-        format_chat_message(formatted_msg, username, input);
+        if (command > 0) {
+            // Validate message content
+            if (!validate_message_content(input)) {
+                fprintf(stderr, "%sMessage too long! Maximum %d characters.%s\n",
+                        COLOR_RED, MAX_MESSAGE - 1, COLOR_RESET);
+                continue;
+            }
+
+            // Format chat message
+            format_chat_message(formatted_msg, username, input);
+        }
+
+        // Send message
         if (send(sock, formatted_msg, strlen(formatted_msg), 0) < 0) {
             if (keep_running) {
                 fprintf(stderr, "%sSend failed%s\n", COLOR_RED, COLOR_RESET);
@@ -321,6 +706,10 @@ int main() {
     // Cancel and join receive thread
     pthread_cancel(recv_tid);
     pthread_join(recv_tid, NULL);
+    if (ring_started) {
+        pthread_cancel(ring_tid);
+        pthread_join(ring_tid, NULL);
+    }
 
     // Close socket
     close(sock);
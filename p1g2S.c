@@ -1,84 +1,864 @@
 // Live Chat Room - Multi-threaded TCP Server
 // Handles client authentication, message queueing, and real-time broadcasting
 
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <errno.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <time.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
+#include <netdb.h>
+#include <poll.h>
 #include <pthread.h>
 #include <signal.h>
+#include <sys/ioctl.h>
+#ifdef __linux__
+#include <sys/eventfd.h>
+#include <sched.h>
+#include <linux/errqueue.h>
+#include <linux/sockios.h>
+#endif
 #include "protocol.h"
+#ifdef CHAT_TLS
+#include <openssl/err.h>
+#endif
+
+// Platforms without MSG_MORE send each batched frame as it comes
+#ifndef MSG_MORE
+#define MSG_MORE 0
+#endif
+
+// Spin-wait hint: eases pipeline pressure and lets a sibling hyperthread run
+#if defined(__x86_64__) || defined(__i386__)
+#define cpu_relax() __builtin_ia32_pause()
+#elif defined(__aarch64__)
+#define cpu_relax() __asm__ __volatile__("yield")
+#else
+#define cpu_relax() ((void)0)
+#endif
 
 // Global state - client tracking
 client_info_t clients[MAX_CLIENTS];
 int client_count = 0;
 pthread_mutex_t clients_mutex = PTHREAD_MUTEX_INITIALIZER;
 
+// Global state - username intern table (protected by intern_mutex)
+// Each distinct name gets a small id, so the registry and the broadcast queue
+// carry 4 bytes instead of the name. Ids are refcounted by the client entry
+// and every queued message using them; an unused id is recycled
+typedef struct {
+    char name[MAX_USERNAME];
+    uint32_t hash;
+    int refs;                       // 0 = free slot
+    uint32_t next;                  // Next id in the bucket chain, or in the free list
+} interned_name_t;
+interned_name_t interned[MAX_INTERNED + 1];  // Id 0 is reserved for "none"
+uint32_t intern_buckets[INTERN_BUCKETS];
+uint32_t intern_free = 0;           // Head of the free-id list
+uint32_t intern_high = 0;           // Highest id handed out so far
+pthread_mutex_t intern_mutex = PTHREAD_MUTEX_INITIALIZER;
+
 // Global state - message queue
 message_queue_t msg_queue;
 pthread_mutex_t queue_mutex = PTHREAD_MUTEX_INITIALIZER;
 pthread_cond_t queue_cond = PTHREAD_COND_INITIALIZER;
+int broadcast_parked = 0;           // Broadcast thread waits on queue_cond (protected by queue_mutex)
+
+// Global state - gateway links (core side, protected by clients_mutex)
+// Each gateway multiplexes many users over one socket; broadcasts cross it once
+peer_info_t gateways[MAX_GATEWAYS];
+int gateway_count = 0;
+
+// Global state - gateway mode (edge side)
+// Local users are relayed over a single upstream link to the core server
+typedef struct {
+    int socket_fd;                  // Local user's socket
+    int channel;                    // Channel id on the upstream link
+    char username[MAX_USERNAME];    // Set once the user sent AUTH
+    int authenticated;              // Core answered AUTH_OK
+    int stalled;                    // Shut down for not keeping up
+} channel_info_t;
+channel_info_t channels[MAX_CLIENTS];
+int channel_count = 0;
+int next_channel = 1;
+pthread_mutex_t channels_mutex = PTHREAD_MUTEX_INITIALIZER;
+int upstream_fd = -1;
+pthread_mutex_t upstream_mutex = PTHREAD_MUTEX_INITIALIZER;
+int gateway_mode = 0;
+
+// Global state - federation peer links
+peer_info_t peers[MAX_PEERS];
+int peer_count = 0;
+pthread_mutex_t peers_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// Shared secret every PEER and GATEWAY hello must carry (read from -k);
+// without one the node refuses all server-to-server links
+char cluster_key[MAX_MESSAGE] = {0};
+
+// Consistent hash ring over this node and its peers (protected by peers_mutex)
+// Each node contributes RING_VNODES points; a room or topic is owned by the
+// node whose point follows its name's hash clockwise. Nodes exchange a digest
+// of the ids they are linked with, and peers join the ring only while every
+// one of them reports the same view as this node (a full mesh); otherwise
+// this node sequences everything itself and relays nothing, so two nodes
+// never both route a room to owners the other cannot reach
+typedef struct {
+    uint32_t hash;
+    int peer_index;                 // Index into peers[], -1 for this node
+} ring_point_t;
+ring_point_t hash_ring[(MAX_PEERS + 1) * RING_VNODES];
+int ring_size = 0;
+char room_owner[MAX_USERNAME] = {0};
+uint32_t view_digest = 0;           // Digest of this node's view, as sent in MESH
+int mesh_complete = 1;              // Every peer announced this node's view
+
+// Global state - scrollback history, journal and snapshots
+// Every broadcast message gets a sequence number, lands in the scrollback ring
+// and is appended to the journal; snapshots capture the ring periodically so a
+// restart only replays the journal written since the last snapshot
+typedef struct {
+    uint64_t seq;                   // Sequence number (also the journal record)
+    char sender[MAX_USERNAME];
+    char content[MAX_MESSAGE];
+} history_entry_t;
+
+typedef struct {
+    history_entry_t entries[HISTORY_SIZE];
+    int head;                       // Next write slot
+    int count;                      // Valid entries
+    uint64_t next_seq;              // Sequence number of the next message
+} history_t;
+
+#define SNAPSHOT_MAGIC   0x4c435331u  // "LCS1"
+#define SNAPSHOT_VERSION 1
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t entry_size;            // sizeof(history_entry_t) when written
+    uint32_t history_size;          // HISTORY_SIZE when written
+    uint64_t journal_offset;        // Journal length covered by this snapshot
+    history_t history;
+} snapshot_t;
+
+// A compacted journal starts with a header the size of one record, naming the
+// document number of the first record kept. Offsets in snapshots and document
+// numbers in the search index stay logical: they count every record ever written
+#define JOURNAL_MAGIC 0x314c4a434c4c4a4cull  // In place of a record's seq
+typedef struct {
+    uint64_t magic;
+    uint64_t first_doc;
+    char pad[sizeof(history_entry_t) - 2 * sizeof(uint64_t)];
+} journal_header_t;
+_Static_assert(sizeof(journal_header_t) == sizeof(history_entry_t),
+               "journal header must be one record long");
+
+history_t history = { .next_seq = 1 };
+int journal_fd = -1;
+uint64_t journal_offset = 0;        // Logical journal length on disk (journal thread)
+uint64_t journal_end = 0;           // journal_offset plus queued records (history_mutex)
+uint32_t journal_first_doc = 0;     // First record still in the file (index_mutex)
+off_t journal_data_start = 0;       // Bytes of header before it (index_mutex)
+pthread_mutex_t history_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// Global state - journal writer (protected by journal_mutex)
+// record_history only queues; the journal thread appends up to JOURNAL_BATCH
+// records with one write and indexes them, so the broadcast thread never
+// waits on the disk. A record that finds the ring full is left out of the
+// journal and counted; the scrollback ring, and so the next snapshot, still
+// holds it
+history_entry_t journal_queue[JOURNAL_QUEUE];
+int journal_queue_head = 0;         // Oldest queued record
+int journal_queued = 0;
+unsigned long long journal_dropped = 0;
+int journal_busy = 0;               // The thread holds a batch not yet on disk
+int journal_running = 1;
+uint32_t journal_compact_doc = 0;   // Compact up to this record (a snapshot covers it)
+pthread_t journal_tid;
+pthread_mutex_t journal_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t journal_cond = PTHREAD_COND_INITIALIZER;
+char data_dir[256] = {0};           // Persistence is off unless -D is given
+
+// Global state - full-text search over the journal (protected by index_mutex)
+// Documents are journal record numbers. Each term maps to the ascending list
+// of documents containing it, stored as LEB128 varint deltas, so appending a
+// new message only ever writes at the end of a list. At startup the existing
+// journal is indexed by a background thread while new messages go into a live
+// index; the two are merged when the background build finishes. Each journal
+// compaction rebuilds the index from the records it kept, so postings of
+// dropped records are freed instead of piling up
+typedef struct {
+    char term[MAX_TERM];            // Empty if the slot is free
+    uint8_t *postings;              // Varint deltas between successive documents
+    uint32_t bytes;
+    uint32_t capacity;
+    uint32_t count;                 // Documents in the list
+    uint32_t last_doc;
+} posting_list_t;
+
+typedef struct {
+    posting_list_t *slots;          // Open addressing, capacity is a power of two
+    uint32_t capacity;
+    uint32_t terms;
+    uint64_t posting_bytes;
+} term_index_t;
+
+term_index_t search_index = {0};
+uint32_t indexed_from_doc = 0;      // First document in search_index until the merge
+int index_ready = 0;                // The journal written before startup is merged in
+pthread_mutex_t index_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// Global state - content filter (loaded from -F, reloaded on SIGHUP)
+// Every pattern is compiled into one Aho-Corasick automaton, stored as a
+// complete DFA over the byte classes that occur in the patterns, so a message
+// costs one table lookup per byte however many patterns there are.
+// Readers never lock: a reload publishes the new automaton and frees the old
+// one once both reader counters have drained (two-phase, as in SRCU)
+typedef struct {
+    int pattern_count;
+    int state_count;
+    int class_count;
+    uint8_t class_of[256];          // Byte -> input class (case-folded), 0 if in no pattern
+    int32_t *next;                  // [state * class_count + class] -> next state
+    uint8_t *accepts;               // A pattern ends at this state or one of its suffixes
+} content_filter_t;
+content_filter_t *active_filter = NULL;
+unsigned filter_epoch = 0;          // Low bit selects the counter new readers use
+int filter_readers[2] = {0, 0};
+pthread_mutex_t filter_mutex = PTHREAD_MUTEX_INITIALIZER;  // Serializes reloads
+char filter_path[256] = {0};        // Filtering is off unless -F is given
+
+// Global state - topic subscriptions (protected by topics_mutex)
+// Patterns are stored as a trie of dot-separated segments. Each node keeps its
+// children in a hash table by segment, so matching a published topic costs
+// three lookups per level (the segment, * and #) however many siblings there
+// are. A subscribing client has one record listing its patterns; each match
+// pass stamps the records it collects, so a client with overlapping patterns
+// is collected once without comparing against earlier matches
+typedef struct {
+    int socket_fd;
+    int channel;                    // Gateway channel, 0 for a direct client
+} subscriber_t;
+
+typedef struct topic_client {
+    int socket_fd;
+    int channel;                    // Gateway channel, 0 for a direct client
+    int pattern_count;
+    char patterns[MAX_SUBSCRIPTIONS][MAX_TOPIC];
+    unsigned mark;                  // Match pass that last collected this client
+    struct topic_client *next;      // Next record in the same bucket
+} topic_client_t;
+
+typedef struct topic_node {
+    char segment[MAX_TOPIC];
+    uint32_t hash;                  // hash_bytes() of segment
+    struct topic_node *parent;
+    struct topic_node *next;        // Next child in the same bucket of the parent
+    struct topic_node **buckets;    // Children by segment hash, NULL until the first
+    int bucket_count;               // Power of two
+    int child_count;
+    topic_client_t **subscribers;   // Clients whose pattern ends here
+    int subscriber_count;
+    int subscriber_capacity;
+} topic_node_t;
+
+topic_node_t topic_root;
+topic_client_t *topic_clients[TOPIC_CLIENT_BUCKETS];
+unsigned match_pass = 0;
+pthread_mutex_t topics_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+#ifdef CHAT_TLS
+// Global state - TLS termination (NULL unless -t is given)
+SSL_CTX *tls_ctx = NULL;
+#endif
+
+// Global state - socket tuning (set with -o key=value)
+typedef struct {
+    int backlog;                    // listen() backlog for the TCP and Unix listeners
+    int nodelay;                    // TCP_NODELAY on client and peer sockets
+    int cork;                       // MSG_MORE on all but the last frame of a batch
+    int sndbuf;                     // SO_SNDBUF in bytes, 0 keeps the kernel default
+    int rcvbuf;                     // SO_RCVBUF in bytes, 0 keeps the kernel default
+    int defer_accept;               // TCP_DEFER_ACCEPT in seconds, 0 is off
+    int user_timeout;               // TCP_USER_TIMEOUT in milliseconds, 0 is off
+    int zerocopy;                   // MSG_ZEROCOPY for large broadcast batches (Linux)
+    int zerocopy_min;               // Smallest batch in bytes sent with MSG_ZEROCOPY
+} socket_tuning_t;
+socket_tuning_t tuning = { LISTEN_BACKLOG, 1, 1, 0, 0, 0, 0, 0, ZEROCOPY_MIN };
+
+// A broadcast batch shared by every zerocopy send of it; the kernel reads the
+// pages after send() returns, so each in-flight send holds a reference until
+// its completion arrives on that socket's error queue
+typedef struct zc_buffer {
+    int refs;
+    size_t len;
+    char data[];
+} zc_buffer_t;
+
+// Outcome of sending a frame or batch to one client
+typedef enum {
+    SEND_OK,
+    SEND_SHORT,                     // Timed out or cut off mid-frame: the reader is not keeping up
+    SEND_ERROR,                     // The connection failed (errno says why)
+} send_status_t;
+
+// Global state - thread placement (set with -o key=value, Linux only)
+// Pinning keeps a thread on one core and its caches. It does not place pool
+// buffers on that core's NUMA node: they share huge pages across threads
+typedef struct {
+    int broadcast_cpu;              // CPU for the broadcast thread, -1 unpinned
+    int accept_cpu;                 // CPU for the accept loop (main thread), -1 unpinned
+    int follow_rx_cpu;              // Pin each client thread to its socket's RX CPU
+} thread_placement_t;
+thread_placement_t placement = { -1, -1, 0 };
+
+// Global state - buffer pool (set hugepages=0 with -o to use regular pages)
+// One mapping holds the broadcast thread's batch slab followed by fixed-size
+// slots for per-connection receive buffers and line readers, so the hot
+// buffers of every connection share a handful of TLB entries. Slots are
+// handed out bump-first, so a quiet server only touches the start of the
+// mapping. A huge page holds the slab and many slots, and lands on the NUMA
+// node of whichever thread touches it first, not on each user's node
+typedef struct pool_slot {
+    struct pool_slot *next;
+} pool_slot_t;
+typedef struct {
+    int hugepages;                  // Try MAP_HUGETLB, then transparent huge pages
+    char *base;                     // Start of the mapping (the broadcast slab)
+    size_t size;                    // Mapping length in bytes
+    char *slots;                    // First slot, after the broadcast slab
+    size_t slot_count;
+    size_t next_unused;             // Slots below this index have been handed out
+    pool_slot_t *free_list;         // Returned slots, reused first
+    const char *backing;            // Page type actually obtained, for the log
+} buffer_pool_t;
+buffer_pool_t pool = { 1, NULL, 0, NULL, 0, 0, NULL, "regular pages" };
+pthread_mutex_t pool_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// Global state - low-latency polling (set with -o key=value)
+// The broadcast thread spins on the queue for spin_us before parking on
+// queue_cond (-1 never parks); producers only signal a parked thread
+typedef struct {
+    int spin_us;                    // Spin window before parking, 0 parks at once
+    int busy_poll;                  // SO_BUSY_POLL in microseconds on client sockets, 0 is off
+} polling_t;
+polling_t polling = { 0, 0 };
+
+// Global state - repeated-message detection (set with -o key=value)
+// Each room (or topic) has a count-min sketch of recent message fingerprints
+// in two generations of half a window each; the older one is cleared as the
+// window slides, so memory per room is fixed and a check is O(SKETCH_DEPTH)
+typedef struct {
+    int repeats;                    // Copies allowed per window, 0 disables the check
+    int window;                     // Window in seconds
+} spam_control_t;
+spam_control_t spam = { SPAM_REPEATS, SPAM_WINDOW };
+
+// Global state - runtime limits (set with -o key=value or the -f config file)
+typedef struct {
+    int queue_limit;                // Messages waiting for broadcast before senders see "queue full"
+    int broadcast_batch;            // Messages taken per broadcast flush
+    int log_level;                  // 0 lifecycle and errors, LOG_CONNECTIONS, LOG_MESSAGES
+} runtime_limits_t;
+runtime_limits_t limits = { QUEUE_SIZE, BROADCAST_BATCH, LOG_MESSAGES };
+
+// Global state - connection memory (set with -o key=value)
+// Each direct connection is charged for its backlog: data waiting in its
+// shared-memory ring, zerocopy batches still in flight and whatever sits in
+// its kernel send buffer. A timer thread totals that every MEMORY_CHECK_MS
+// and, over budget, sheds the consumers with the most unsent data first.
+// With a budget set, client sends never block and a full send buffer sheds
+// its reader; without one, a send that blocks for send_timeout does. Either
+// way one stalled reader cannot hold clients_mutex, and with it the
+// broadcast and the budget check, indefinitely
+typedef struct {
+    int budget_kb;                  // Budget for all connections in KB, 0 is unlimited
+    int send_timeout;               // SO_SNDTIMEO in ms for client sockets, 0 blocks forever
+    unsigned long long shed;        // Clients disconnected by either limit (clients_mutex)
+} memory_control_t;
+memory_control_t memory = { 0, 0, 0 };
 
-// Server control flag
-volatile int server_running = 1;
+// One direct connection's backlog, snapshotted under clients_mutex and then
+// completed with SIOCOUTQ outside it
+typedef struct {
+    int socket_fd;
+    uint32_t user_id;               // Tells a reused fd from the one measured
+    size_t pinned;                  // Bytes charged to the connection
+    size_t unsent;                  // Of which still waiting to reach the reader
+} connection_usage_t;
 
-// Server socket (global to allow signal handler to close it)
+// Sketches live in an open-addressing table keyed by the room's hash, with
+// linear probing and backward-shift deletion. A sketch idle for two windows
+// holds nothing that still counts and is freed when room is needed; under
+// pressure, so is one for a topic nobody here subscribes to
+typedef struct {
+    char room[MAX_TOPIC];           // Room or topic name, empty if the slot is free
+    uint32_t hash;                  // hash_bytes() of room
+    long long rotated_ms;           // When the current generation started
+    long long used_ms;              // Last check against this sketch
+    int current;                    // Generation taking new counts
+    uint8_t counts[2][SKETCH_DEPTH][SKETCH_WIDTH];
+} room_sketch_t;
+room_sketch_t sketches[MAX_ROOMS];
+int sketch_count = 0;
+long long sketches_swept_ms = 0;    // Last reclaim sweep
+pthread_mutex_t sketches_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// Settings accepted by -o key=value and the -f config file: name, field,
+// allowed range and whether a SIGHUP reload may change it. Reloads store
+// each value atomically and readers never lock: they read every setting with
+// a relaxed __atomic_load_n, once per decision, so a thread sees either the
+// old or the new value; socket options reach connections accepted afterwards
+typedef struct {
+    const char *key;
+    int *value;
+    int min;
+    int max;
+    int live;
+} setting_t;
+setting_t settings[] = {
+    { "backlog",         &tuning.backlog,          1, 65535, 0 },
+    { "nodelay",         &tuning.nodelay,          0, 1, 1 },
+    { "cork",            &tuning.cork,             0, 1, 1 },
+    { "sndbuf",          &tuning.sndbuf,           0, 64 * 1024 * 1024, 1 },
+    { "rcvbuf",          &tuning.rcvbuf,           0, 64 * 1024 * 1024, 0 },
+    { "defer_accept",    &tuning.defer_accept,     0, 3600, 0 },
+    { "user_timeout",    &tuning.user_timeout,     0, 3600 * 1000, 1 },
+    { "zerocopy",        &tuning.zerocopy,         0, 1, 1 },
+    { "zerocopy_min",    &tuning.zerocopy_min,     0, ZEROCOPY_MIN_LIMIT, 1 },
+    { "broadcast_cpu",   &placement.broadcast_cpu, -1, 1023, 0 },
+    { "accept_cpu",      &placement.accept_cpu,    -1, 1023, 0 },
+    { "follow_rx_cpu",   &placement.follow_rx_cpu, 0, 1, 1 },
+    { "spin_us",         &polling.spin_us,         -1, 1000000, 1 },
+    { "busy_poll",       &polling.busy_poll,       0, 1000000, 1 },
+    { "hugepages",       &pool.hugepages,          0, 1, 0 },
+    { "spam_repeats",    &spam.repeats,            0, 255, 1 },
+    { "spam_window",     &spam.window,             1, 3600, 1 },
+    { "queue_limit",     &limits.queue_limit,      1, QUEUE_SIZE, 1 },
+    { "broadcast_batch", &limits.broadcast_batch,  1, BROADCAST_BATCH, 1 },
+    { "log_level",       &limits.log_level,        0, LOG_MESSAGES, 1 },
+    { "memory_budget",   &memory.budget_kb,        0, 64 * 1024 * 1024, 1 },
+    { "send_timeout",    &memory.send_timeout,     0, 60 * 1000, 1 },
+};
+#define SETTING_COUNT (sizeof(settings) / sizeof(settings[0]))
+char config_path[256] = {0};        // Set with -f, re-read on SIGHUP
+const char *setting_args[MAX_SETTING_ARGS];  // -o arguments, applied over the file
+int setting_arg_count = 0;
+int tuning_reported = 0;            // Effective client socket values logged once
+
+// Node identity and listening port (set from the command line)
+char node_id[MAX_USERNAME] = {0};
+int server_port = SERVER_PORT;
+
+// Server control flags
+volatile int server_running = 1;    // Cleared to stop accepting and start draining
+volatile int force_shutdown = 0;    // Second signal: skip the drain deadline
+volatile int broadcast_running = 1; // Cleared once every client has been closed
+int drain_deadline = DRAIN_DEADLINE;
+
+// Signals arrive as events on signal_fd, read by the main thread's loops
+// (accept, drain); every other thread has them blocked
+int signal_fd = -1;
+long long started_ms = 0;           // For the SIGUSR1 stats dump
+
+// Server socket
 int server_fd = -1;
 
+// Optional same-host listener (AF_UNIX, SOCK_SEQPACKET where supported)
+int unix_fd = -1;
+char unix_path[sizeof(((struct sockaddr_un *)0)->sun_path)] = {0};
+
+// Hot upgrade state - set while sockets are being handed to a new process
+volatile sig_atomic_t upgrade_in_progress = 0;
+int parked_threads = 0;             // Threads idle until the handoff completes
+pthread_mutex_t upgrade_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t upgrade_cond = PTHREAD_COND_INITIALIZER;  // Broadcast when a handoff aborts
+pthread_t main_thread;
+char upgrade_path[sizeof(((struct sockaddr_un *)0)->sun_path)];
+
+// Connections still waiting for their AUTH line (protected by clients_mutex);
+// a hot upgrade hands these over too, and the new process logs them in
+typedef struct {
+    int socket_fd;
+    pthread_t handler_thread;
+} pending_login_t;
+pending_login_t pending_logins[MAX_CLIENTS];
+int pending_login_count = 0;
+
+// Buffered line reader for connections that may coalesce several frames per read()
+typedef struct {
+    int fd;
+    char data[BUFFER_SIZE];
+    size_t len;
+} line_reader_t;
+_Static_assert(sizeof(line_reader_t) <= POOL_SLOT_SIZE, "line_reader_t must fit a pool slot");
+
+// Dial target for an outbound peer link (host:port from the command line)
+typedef struct {
+    char host[256];
+    char port[16];
+} peer_target_t;
+
+// Handoff record sent over the upgrade socket, with the listed fds attached.
+// A HANDOFF_HISTORY record is followed by the scrollback ring (history_t)
+#define HANDOFF_LISTENER 1
+#define HANDOFF_CLIENTS  2
+#define HANDOFF_HISTORY  3
+#define HANDOFF_DONE     4
+typedef struct {
+    char username[MAX_USERNAME];                // Empty while still logging in
+    int pattern_count;                          // Topic subscriptions
+    char patterns[MAX_SUBSCRIPTIONS][MAX_TOPIC];
+} handoff_client_t;
+
+typedef struct {
+    int kind;                                   // HANDOFF_* record kind
+    int count;                                  // Number of fds attached
+    handoff_client_t clients[HANDOFF_BATCH];    // Registry entry per client fd
+} handoff_record_t;
+
+// Client adopted from a previous server process
+typedef struct {
+    int socket_fd;
+    handoff_client_t state;
+} resumed_client_t;
+
 // Signal handler
-void signal_handler(int sig);
-int add_client(int socket_fd, const char *username);
-void remove_client(int socket_fd);
+void handle_signal(int sig);
+void handle_pending_signals(void);
+void wait_for_signals(int timeout_ms);
+void dump_stats(void);
+int add_client(int socket_fd, int channel, const char *username);
+void remove_client(int socket_fd, int channel);
 int username_exists(const char *username);
+uint32_t find_username(const char *username);
+uint32_t intern_username(const char *username);
+void release_username(uint32_t id);
+const char *username_of(uint32_t id);
+int find_client_index(int socket_fd, int channel);
+int client_send_flags(void);
+send_status_t send_frame(client_info_t *client, const char *frame, size_t len, int flags);
+send_status_t send_status(ssize_t sent, size_t len);
+void attach_shm_ring(int client_socket);
+void release_shm_ring(client_info_t *client);
+int enable_zerocopy(int socket_fd);
+zc_buffer_t *zc_buffer_create(char frames[][BUFFER_SIZE], const size_t *lens, int count);
+void zc_buffer_release(zc_buffer_t *buffer);
+send_status_t send_zerocopy(client_info_t *client, zc_buffer_t *buffer);
+void reap_zerocopy(client_info_t *client);
+void release_zerocopy(client_info_t *client);
+size_t client_backlog(const client_info_t *client);
+int snapshot_connections(connection_usage_t *usage);
+size_t measure_connections(connection_usage_t *usage, int count);
+void shed_client(client_info_t *client, const char *reason, size_t unsent);
+void send_failed(client_info_t *client, send_status_t status);
+void enforce_memory_budget(void);
+void *memory_thread(void *arg);
+void *huge_alloc(size_t *size, const char **backing);
+int init_buffer_pool(void);
+void *pool_alloc(void);
+void pool_free(void *ptr);
 void *handle_client(void *arg);
 void *broadcast_thread(void *arg);
 void broadcast_notification(const char *notification);
+void deliver_to_local_clients(const char *frame);
+int enqueue_for_broadcast(const message_t *msg);
+int read_line(line_reader_t *reader, char *line, size_t line_size);
+int add_peer(int socket_fd, const char *peer_id);
+void remove_peer(int socket_fd);
+void relay_to_peers(const char *frame);
+int send_to_peer(peer_info_t *peer, const char *frame, size_t len);
+int load_cluster_key(const char *path);
+int cluster_key_matches(const char *offered);
+const char *screen_message(const char *room, char *content, const char *origin, int count_repeats);
+int compare_ring_points(const void *a, const void *b);
+int compare_node_ids(const void *a, const void *b);
+void rebuild_hash_ring(void);
+void hand_off_history(peer_info_t *peer);
+void merge_history_entry(int *cursor, const char *sender, const char *content);
+int ring_lookup(const char *room);
+int room_owned_locally(const char *room);
+int room_sequenced_for_peers(const char *room);
+int route_to_room_owner(const char *room, const message_t *msg);
+void run_peer_link(line_reader_t *reader, const char *peer_id);
+void *peer_dial_thread(void *arg);
+int start_peer_dialer(const char *spec);
+void print_usage(const char *prog);
+int log_enabled(int level);
+int find_setting(const char *key);
+int parse_setting(int index, const char *value, int *parsed);
+int apply_setting(const char *key, const char *value);
+int apply_setting_arg(const char *arg);
+char *trim_whitespace(char *text);
+int stage_setting_arg(const char *arg, int *staged, int *present);
+int load_config(int startup);
+void tune_listener(int fd);
+void tune_client_socket(int fd);
+void report_socket_tuning(int fd, const char *label);
+int pin_current_thread(int cpu, const char *label);
+void pin_to_incoming_cpu(int socket_fd);
+int create_server_socket(void);
+int create_unix_socket(void);
+long long monotonic_ms(void);
+long long monotonic_us(void);
+void spin_for_messages(void);
+int wait_for_queue_drain(long long deadline_ms);
+void drain_clients(void);
+void history_push(const history_entry_t *entry);
+uint64_t record_history(const char *sender, const char *content);
+void replay_history(int client_socket, int channel);
+void append_journal(const history_entry_t *batch, int count);
+off_t journal_position(uint32_t doc);
+void compact_journal(uint32_t keep_doc);
+uint32_t index_journal_range(term_index_t *index, uint32_t from, uint32_t to);
+void rebuild_search_index(void);
+void *journal_thread(void *arg);
+void flush_journal(void);
+void stop_journal(void);
+int read_journal_entry(uint32_t doc, history_entry_t *entry);
+int write_snapshot(void);
+void *snapshot_thread(void *arg);
+int restore_state(void);
+int tokenize_terms(const char *text, char terms[][MAX_TERM], int max_terms);
+posting_list_t *index_term(term_index_t *index, const char *term, int create);
+int append_posting(term_index_t *index, posting_list_t *list, uint32_t doc);
+uint32_t next_posting(const posting_list_t *list, uint32_t *pos, uint32_t prev);
+int index_add_doc(term_index_t *index, uint32_t doc, const char *content);
+void free_term_index(term_index_t *index);
+void *index_build_thread(void *arg);
+int search_history(const char *query, uint32_t *hits, int max_hits, uint32_t *total);
+void handle_search_request(int socket_fd, int channel, const message_t *msg);
+void serve_client(line_reader_t *reader, const char *username);
+void handle_chat_message(int socket_fd, int channel, const char *username, message_t *msg);
+line_reader_t *reader_with_leftover(int fd, const char *leftover, int leftover_len);
+void send_to_gateways(const char *frame, int flags);
+int send_to_gateway(peer_info_t *gateway, const char *wrapped, size_t len, int flags);
+void send_to_channel(int gateway_fd, int channel, const char *frame);
+int add_gateway(int socket_fd, const char *gateway_id);
+void remove_gateway(int socket_fd);
+void authenticate_channel(int gateway_fd, int channel, const char *username, int resume);
+void run_gateway_link(line_reader_t *reader, const char *gateway_id);
+int parse_target(const char *spec, peer_target_t *target);
+int dial_target(const peer_target_t *target);
+int send_upstream(const char *frame);
+void gateway_serve_client(int client_socket);
+void send_to_local_user(channel_info_t *user, const char *frame, size_t len);
+void reply_to_local_user(int channel, const char *frame);
+void gateway_deliver(int channel, const char *frame);
+void *gateway_upstream_thread(void *arg);
+int split_topic(const char *topic, char segments[][MAX_TOPIC]);
+topic_node_t *topic_child(topic_node_t *node, const char *segment, int create);
+void prune_topic_path(topic_node_t *node);
+topic_client_t *find_topic_client(int socket_fd, int channel, int create);
+void release_topic_client(topic_client_t *client);
+int subscribe_topic(int socket_fd, int channel, const char *pattern);
+int remove_subscription(topic_client_t *client, const char *pattern);
+int unsubscribe_topic(int socket_fd, int channel, const char *pattern);
+void unsubscribe_all(int socket_fd, int channel);
+void collect_subscribers(const topic_node_t *node, subscriber_t *matches, int *match_count);
+void match_topic(const topic_node_t *node, char segments[][MAX_TOPIC], int depth,
+                 int count, subscriber_t *matches, int *match_count);
+void deliver_to_subscribers(const char *topic, const char *frame);
+void reply_to_client(int socket_fd, int channel, const char *frame);
+int handle_topic_request(int socket_fd, int channel, const char *username, message_t *msg);
+room_sketch_t *find_room_sketch(const char *room, long long now);
+void remove_room_sketch(uint32_t slot);
+int reclaim_room_sketches(long long now);
+int topic_has_subscribers(const char *topic);
+void begin_match_pass(void);
+int is_repeated_message(const char *room, const char *content);
+content_filter_t *build_content_filter(const char *path);
+void free_content_filter(content_filter_t *filter);
+void swap_content_filter(content_filter_t *filter);
+int load_content_filter(void);
+int content_blocked(const char *text);
+#ifdef CHAT_TLS
+int create_tls_context(const char *cert_file, const char *key_file);
+int tls_accept(int client_socket);
+int plaintext_tcp(int socket_fd);
+int tls_relayed(int socket_fd);
+void release_relayed_clients(void);
+#endif
+void track_pending_login(int socket_fd, int pending);
+int topic_patterns_of(int socket_fd, int channel, char patterns[][MAX_TOPIC]);
+void *resume_client(void *arg);
+void upgrade_interrupt_handler(int sig);
+void park_for_upgrade(void);
+int send_fds(int sock, const void *data, size_t len, const int *fds, int fd_count);
+int recv_fds(int sock, void *data, size_t len, int *fds, int max_fds);
+int interrupt_for_upgrade(void);
+void resume_after_failed_upgrade(void);
+void perform_handoff(int conn);
+void *upgrade_listener_thread(void *arg);
+int start_upgrade_listener(void);
+int receive_handoff(void);
+
+// Act on one signal read from signal_fd (main thread only, so no handler
+// restrictions apply: closing the listener cannot race the accept loop)
+void handle_signal(int sig) {
+    if (sig == SIGINT || sig == SIGTERM) {
+        if (!server_running) {
+            printf("\n[Server] Forcing shutdown...\n");
+            force_shutdown = 1;
+            return;
+        }
 
-void signal_handler(int sig) {
-    if (sig == SIGINT) {
         printf("\n[Server] Received shutdown signal...\n");
         server_running = 0;
 
-        // Close server socket to unblock accept()
+        // Stop accepting; the drain then closes the clients
         if (server_fd != -1) {
             close(server_fd);
             server_fd = -1;
         }
+    } else if (sig == SIGHUP) {
+        printf("[Server] SIGHUP: reloading configuration and content filter\n");
+        if (config_path[0] != '\0') load_config(0);
+        load_content_filter();
+    } else if (sig == SIGUSR1) {
+        dump_stats();
     }
 }
 
+// Handle every signal queued on signal_fd
+void handle_pending_signals(void) {
+    int sig;
+    while ((sig = next_signal(signal_fd)) != 0) {
+        handle_signal(sig);
+    }
+}
+
+// Sleep for up to timeout_ms; on the main thread, signals arriving meanwhile
+// are handled (and cut the sleep short), so a second Ctrl+C during the drain
+// takes effect at once
+void wait_for_signals(int timeout_ms) {
+    if (signal_fd < 0 || !pthread_equal(pthread_self(), main_thread)) {
+        usleep((useconds_t)timeout_ms * 1000);
+        return;
+    }
+
+    struct pollfd pending = { .fd = signal_fd, .events = POLLIN };
+    if (poll(&pending, 1, timeout_ms) > 0) {
+        handle_pending_signals();
+    }
+}
+
+// SIGUSR1: print a snapshot of connections, queue and storage
+void dump_stats(void) {
+    connection_usage_t usage[MAX_CLIENTS];
+    size_t pinned = measure_connections(usage, snapshot_connections(usage));
+
+    pthread_mutex_lock(&clients_mutex);
+    int clients_now = client_count;
+    int gateways_now = gateway_count;
+    unsigned long long shed = memory.shed;
+    pthread_mutex_unlock(&clients_mutex);
+
+    pthread_mutex_lock(&peers_mutex);
+    int peers_now = peer_count;
+    pthread_mutex_unlock(&peers_mutex);
+
+    pthread_mutex_lock(&channels_mutex);
+    int channels_now = channel_count;
+    pthread_mutex_unlock(&channels_mutex);
+
+    pthread_mutex_lock(&queue_mutex);
+    int queued = msg_queue.count;
+    pthread_mutex_unlock(&queue_mutex);
+
+    pthread_mutex_lock(&history_mutex);
+    unsigned long long messages = (unsigned long long)(history.next_seq - 1);
+    unsigned long long journal_kb = (unsigned long long)(journal_end / 1024);
+    pthread_mutex_unlock(&history_mutex);
+
+    pthread_mutex_lock(&journal_mutex);
+    unsigned long long journal_lost = journal_dropped;
+    pthread_mutex_unlock(&journal_mutex);
+
+    pthread_mutex_lock(&index_mutex);
+    unsigned terms = search_index.terms;
+    unsigned long long posting_kb = (unsigned long long)(search_index.posting_bytes / 1024);
+    pthread_mutex_unlock(&index_mutex);
+
+    pthread_mutex_lock(&pool_mutex);
+    size_t slots_touched = pool.next_unused;
+    pthread_mutex_unlock(&pool_mutex);
+
+    printf("[Stats] Up %lld s: %d client(s), %d gateway(s), %d peer(s), %d channel(s)\n",
+           (monotonic_ms() - started_ms) / 1000, clients_now, gateways_now, peers_now,
+           channels_now);
+    printf("[Stats] Queue %d/%d, %llu message(s) broadcast, journal %llu KB (%llu not journaled)\n",
+           queued, __atomic_load_n(&limits.queue_limit, __ATOMIC_RELAXED), messages, journal_kb,
+           journal_lost);
+    printf("[Stats] Search index %u term(s), %llu KB of postings; pool %zu/%zu slot(s) used\n",
+           terms, posting_kb, slots_touched, pool.slot_count);
+    printf("[Stats] Connections pin %zu KB (budget %d KB, 0 is unlimited), %llu client(s) shed\n",
+           pinned / 1024, __atomic_load_n(&memory.budget_kb, __ATOMIC_RELAXED), shed);
+    fflush(stdout);
+}
+
 // Add a new client to the tracking list (thread-safe)
-int add_client(int socket_fd, const char *username) {
+int add_client(int socket_fd, int channel, const char *username) {
     pthread_mutex_lock(&clients_mutex);
 
-    if (client_count >= MAX_CLIENTS) {
+    uint32_t user_id = client_count < MAX_CLIENTS ? intern_username(username) : 0;
+    if (user_id == 0) {
         pthread_mutex_unlock(&clients_mutex);
         return -1;  // Server full
     }
 
     clients[client_count].socket_fd = socket_fd;
-    strncpy(clients[client_count].username, username, MAX_USERNAME - 1);
-    clients[client_count].username[MAX_USERNAME - 1] = '\0';
+    clients[client_count].user_id = user_id;
     clients[client_count].authenticated = 1;
+    clients[client_count].handler_thread = pthread_self();
+    clients[client_count].ring = NULL;
+    clients[client_count].ring_event_fd = -1;
+    clients[client_count].channel = channel;
+    clients[client_count].zerocopy = channel == 0 && enable_zerocopy(socket_fd);
+    clients[client_count].zc_next = 0;
+    clients[client_count].zc_tail = 0;
+    clients[client_count].zc_bytes = 0;
+    clients[client_count].shed = 0;
+    clients[client_count].replayed_seq = 0;
     client_count++;
 
-    printf("[Server] Client '%s' added. Total clients: %d\n", username, client_count);
+    // A bounded send turns a stalled reader into a shed client instead of a
+    // broadcast thread blocked with clients_mutex held
+    int send_timeout = __atomic_load_n(&memory.send_timeout, __ATOMIC_RELAXED);
+    if (channel == 0 && send_timeout > 0) {
+        struct timeval timeout = { send_timeout / 1000, (send_timeout % 1000) * 1000 };
+        setsockopt(socket_fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    }
+
+    if (log_enabled(LOG_CONNECTIONS)) {
+        printf("[Server] Client '%s' added. Total clients: %d\n", username, client_count);
+    }
 
     pthread_mutex_unlock(&clients_mutex);
     return 0;
 }
 
 // Remove a client from the tracking list (thread-safe)
-void remove_client(int socket_fd) {
+void remove_client(int socket_fd, int channel) {
     pthread_mutex_lock(&clients_mutex);
 
     for (int i = 0; i < client_count; i++) {
-        if (clients[i].socket_fd == socket_fd) {
-            printf("[Server] Removing client '%s'\n", clients[i].username);
+        if (clients[i].socket_fd == socket_fd && clients[i].channel == channel) {
+            if (log_enabled(LOG_CONNECTIONS)) {
+                printf("[Server] Removing client '%s'\n", username_of(clients[i].user_id));
+            }
+            release_shm_ring(&clients[i]);
+            release_zerocopy(&clients[i]);
+            release_username(clients[i].user_id);
 
             // Shift remaining clients
             for (int j = i; j < client_count - 1; j++) {
@@ -90,298 +870,4811 @@ void remove_client(int socket_fd) {
     }
 
     pthread_mutex_unlock(&clients_mutex);
+
+    // Done before the socket is closed, so a reused fd never inherits them
+    unsubscribe_all(socket_fd, channel);
+}
+
+// Find a client's slot by socket and gateway channel (caller holds clients_mutex)
+// Returns the index into clients[], or -1 if it has already been removed
+int find_client_index(int socket_fd, int channel) {
+    for (int i = 0; i < client_count; i++) {
+        if (clients[i].socket_fd == socket_fd && clients[i].channel == channel) return i;
+    }
+    return -1;
+}
+
+// Classify the result of a send() of len bytes: a full send buffer, a timeout
+// or a short write (which breaks the framing) means the reader is not keeping
+// up; anything else negative is a failed connection
+send_status_t send_status(ssize_t sent, size_t len) {
+    if (sent == (ssize_t)len) return SEND_OK;
+    if (sent >= 0 || errno == EAGAIN || errno == EWOULDBLOCK) return SEND_SHORT;
+    return SEND_ERROR;
+}
+
+// Extra send() flags for client sockets: with a memory budget every send is
+// non-blocking, so a full send buffer is reported instead of waited out
+int client_send_flags(void) {
+    return __atomic_load_n(&memory.budget_kb, __ATOMIC_RELAXED) > 0 ? MSG_DONTWAIT : 0;
+}
+
+// Deliver a frame over the client's shared-memory ring if it has one, or its
+// socket otherwise (caller holds clients_mutex). flags go to send(), e.g.
+// MSG_MORE when another frame for this client follows immediately
+send_status_t send_frame(client_info_t *client, const char *frame, size_t len, int flags) {
+    if (client->channel != 0) {
+        send_to_channel(client->socket_fd, client->channel, frame);
+        return SEND_OK;
+    }
+
+    if (client->ring == NULL) {
+        return send_status(send(client->socket_fd, frame, len, flags | client_send_flags()), len);
+    }
+
+    // A full ring drops the frame for this client
+    int wake = shm_ring_write(client->ring, frame, len);
+    if (wake > 0) {
+        uint64_t one = 1;
+        if (write(client->ring_event_fd, &one, sizeof(one)) < 0) return SEND_ERROR;
+    }
+    return wake < 0 ? SEND_SHORT : SEND_OK;
+}
+
+// Turn on SO_ZEROCOPY for a TCP client when -o zerocopy=1
+// Returns 1 if MSG_ZEROCOPY sends may be used on the socket
+int enable_zerocopy(int socket_fd) {
+#if defined(SO_ZEROCOPY) && defined(MSG_ZEROCOPY)
+    if (!__atomic_load_n(&tuning.zerocopy, __ATOMIC_RELAXED)) return 0;
+
+    struct sockaddr_storage addr;
+    socklen_t addr_len = sizeof(addr);
+    if (getsockname(socket_fd, (struct sockaddr *)&addr, &addr_len) != 0 ||
+        (addr.ss_family != AF_INET && addr.ss_family != AF_INET6)) {
+        return 0;
+    }
+
+    int one = 1;
+    return setsockopt(socket_fd, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one)) == 0;
+#else
+    (void)socket_fd;
+    return 0;
+#endif
+}
+
+// Concatenate a batch of frames into one refcounted buffer (one reference held)
+zc_buffer_t *zc_buffer_create(char frames[][BUFFER_SIZE], const size_t *lens, int count) {
+    size_t total = 0;
+    for (int i = 0; i < count; i++) total += lens[i];
+
+    zc_buffer_t *buffer = malloc(sizeof(zc_buffer_t) + total);
+    if (buffer == NULL) return NULL;
+
+    buffer->refs = 1;
+    buffer->len = 0;
+    for (int i = 0; i < count; i++) {
+        memcpy(buffer->data + buffer->len, frames[i], lens[i]);
+        buffer->len += lens[i];
+    }
+    return buffer;
+}
+
+// Drop one reference; the last one frees the buffer
+void zc_buffer_release(zc_buffer_t *buffer) {
+    if (__atomic_sub_fetch(&buffer->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+        free(buffer);
+    }
+}
+
+// Send a batch buffer without copying it into the socket (caller holds clients_mutex)
+// Falls back to a regular send when too many sends are in flight or the
+// kernel refuses (e.g. optmem exhausted)
+send_status_t send_zerocopy(client_info_t *client, zc_buffer_t *buffer) {
+#if defined(SO_ZEROCOPY) && defined(MSG_ZEROCOPY)
+    if (client->zc_next - client->zc_tail == ZEROCOPY_PENDING) {
+        reap_zerocopy(client);
+    }
+
+    if (client->zerocopy && client->zc_next - client->zc_tail < ZEROCOPY_PENDING) {
+        ssize_t sent = send(client->socket_fd, buffer->data, buffer->len,
+                            MSG_ZEROCOPY | client_send_flags());
+        if (sent >= 0) {
+            // Whatever was sent is pinned until its completion arrives
+            __atomic_add_fetch(&buffer->refs, 1, __ATOMIC_RELAXED);
+            client->zc_pending[client->zc_next % ZEROCOPY_PENDING] = buffer;
+            client->zc_next++;
+            client->zc_bytes += buffer->len;
+
+            // A short write (full buffer or send_timeout mid-batch) has
+            // broken the framing, exactly as on the copy path
+            return send_status(sent, buffer->len);
+        }
+        if (errno != ENOBUFS) return send_status(sent, buffer->len);
+    }
+#endif
+    return send_status(send(client->socket_fd, buffer->data, buffer->len, client_send_flags()),
+                       buffer->len);
+}
+
+// Release buffers whose zerocopy sends the kernel reports complete
+// (caller holds clients_mutex). Completions arrive as ranges of send sequence
+// numbers, in order, on the socket's error queue
+void reap_zerocopy(client_info_t *client) {
+#ifdef SO_EE_ORIGIN_ZEROCOPY
+    char control[128];
+    struct msghdr msg = {0};
+
+    while (client->zc_tail != client->zc_next) {
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        if (recvmsg(client->socket_fd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0) break;
+
+        for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+            if (!((cmsg->cmsg_level == SOL_IP && cmsg->cmsg_type == IP_RECVERR) ||
+                  (cmsg->cmsg_level == SOL_IPV6 && cmsg->cmsg_type == IPV6_RECVERR))) {
+                continue;
+            }
+
+            struct sock_extended_err err;
+            memcpy(&err, CMSG_DATA(cmsg), sizeof(err));
+            if (err.ee_origin != SO_EE_ORIGIN_ZEROCOPY || err.ee_errno != 0) continue;
+
+            // The kernel had to copy after all (e.g. loopback); stop paying
+            // for page pinning and completions on this socket
+            if ((err.ee_code & SO_EE_CODE_ZEROCOPY_COPIED) && client->zerocopy) {
+                client->zerocopy = 0;
+                printf("[ZeroCopy] Kernel copied sends to '%s', using regular sends\n",
+                       username_of(client->user_id));
+            }
+
+            uint32_t last = err.ee_data;
+            while (client->zc_tail != client->zc_next && (int32_t)(last - client->zc_tail) >= 0) {
+                zc_buffer_t *done = client->zc_pending[client->zc_tail % ZEROCOPY_PENDING];
+                client->zc_bytes -= done->len;
+                zc_buffer_release(done);
+                client->zc_tail++;
+            }
+        }
+    }
+#else
+    (void)client;
+#endif
+}
+
+// Drop every in-flight buffer of a departing client (caller holds clients_mutex)
+void release_zerocopy(client_info_t *client) {
+    while (client->zc_tail != client->zc_next) {
+        zc_buffer_release(client->zc_pending[client->zc_tail % ZEROCOPY_PENDING]);
+        client->zc_tail++;
+    }
+    client->zc_bytes = 0;
+}
+
+// Data a client has not yet read: its ring backlog and its kernel send queue
+// (caller holds clients_mutex)
+size_t client_backlog(const client_info_t *client) {
+    size_t unsent = 0;
+    if (client->ring != NULL) {
+        unsent = (size_t)(client->ring->head - __atomic_load_n(&client->ring->tail, __ATOMIC_ACQUIRE));
+    }
+#ifdef SIOCOUTQ
+    int queued = 0;
+    if (ioctl(client->socket_fd, SIOCOUTQ, &queued) == 0 && queued > 0) {
+        unsent += (size_t)queued;
+    }
+#endif
+    return unsent;
+}
+
+// Copy out what each direct connection holds in user space - its ring
+// backlog and zerocopy batches in flight - under clients_mutex, which is
+// held only for the copy. Returns the number of entries in usage
+int snapshot_connections(connection_usage_t *usage) {
+    int count = 0;
+    pthread_mutex_lock(&clients_mutex);
+    for (int i = 0; i < client_count; i++) {
+        const client_info_t *client = &clients[i];
+        if (client->channel != 0 || client->shed) continue;  // Gateway users: the gateway's link
+
+        size_t ring = 0;
+        if (client->ring != NULL) {
+            ring = (size_t)(client->ring->head - __atomic_load_n(&client->ring->tail, __ATOMIC_ACQUIRE));
+        }
+        usage[count].socket_fd = client->socket_fd;
+        usage[count].user_id = client->user_id;
+        usage[count].unsent = ring;
+        usage[count].pinned = ring + client->zc_bytes;
+        count++;
+    }
+    pthread_mutex_unlock(&clients_mutex);
+    return count;
+}
+
+// Add each snapshotted connection's kernel send queue, without holding
+// clients_mutex. Returns the bytes charged to all of them
+size_t measure_connections(connection_usage_t *usage, int count) {
+    size_t total = 0;
+    for (int i = 0; i < count; i++) {
+#ifdef SIOCOUTQ
+        int queued = 0;
+        if (ioctl(usage[i].socket_fd, SIOCOUTQ, &queued) == 0 && queued > 0) {
+            usage[i].pinned += (size_t)queued;
+            usage[i].unsent += (size_t)queued;
+        }
+#endif
+        total += usage[i].pinned;
+    }
+    return total;
+}
+
+// Disconnect a slow consumer (caller holds clients_mutex)
+// Linger 0 makes the reader's close() reset the connection, so the kernel
+// frees its send queue at once instead of trying to deliver it
+void shed_client(client_info_t *client, const char *reason, size_t unsent) {
+    if (client->shed) return;
+    client->shed = 1;
+    memory.shed++;
+
+    struct linger reset = { 1, 0 };
+    setsockopt(client->socket_fd, SOL_SOCKET, SO_LINGER, &reset, sizeof(reset));
+    shutdown(client->socket_fd, SHUT_RDWR);
+    printf("[Memory] Shedding '%s' (%s, %zu KB unsent)\n",
+           username_of(client->user_id), reason, unsent / 1024);
+}
+
+// Report a failed send (caller holds clients_mutex); a send that would block,
+// timed out or was cut short means the reader is not keeping up, so the
+// client is shed. A full shared-memory ring only costs that client the frame
+void send_failed(client_info_t *client, send_status_t status) {
+    if (client->shed || client->ring != NULL) return;
+    if (status == SEND_SHORT) {
+        shed_client(client, client_send_flags() ? "send buffer full" : "send_timeout",
+                    client_backlog(client));
+        return;
+    }
+    perror("[Broadcast] Send failed");
+}
+
+// Over budget, shed the consumers with the most unsent data until the rest
+// fit (memory thread). The kernel queues are measured with clients_mutex
+// released; it is taken again only to shed. Sends are non-blocking while a
+// budget is set, so the broadcast never holds the mutex for long
+void enforce_memory_budget(void) {
+    int budget_kb = __atomic_load_n(&memory.budget_kb, __ATOMIC_RELAXED);
+    if (budget_kb == 0) return;
+
+    static connection_usage_t usage[MAX_CLIENTS];
+    int count = snapshot_connections(usage);
+    size_t total = measure_connections(usage, count);
+    size_t budget = (size_t)budget_kb * 1024;
+    if (total <= budget) return;
+
+    // A connection that closed while it was measured may have had its fd
+    // reused, so its figure belonged to some other socket: drop it
+    pthread_mutex_lock(&clients_mutex);
+    for (int i = 0; i < count; i++) {
+        int index = find_client_index(usage[i].socket_fd, 0);
+        if (index < 0 || clients[index].user_id != usage[i].user_id || clients[index].shed) {
+            total -= usage[i].pinned;
+            usage[i].pinned = 0;
+        }
+    }
+    if (total <= budget) {
+        pthread_mutex_unlock(&clients_mutex);
+        return;
+    }
+
+    printf("[Memory] %zu KB pinned by connections, budget %d KB\n", total / 1024, budget_kb);
+    while (total > budget) {
+        int slowest = -1;
+        for (int i = 0; i < count; i++) {
+            if (usage[i].pinned == 0) continue;
+            if (slowest < 0 || usage[i].unsent > usage[slowest].unsent ||
+                (usage[i].unsent == usage[slowest].unsent && usage[i].pinned > usage[slowest].pinned)) {
+                slowest = i;
+            }
+        }
+        if (slowest < 0) break;
+
+        int index = find_client_index(usage[slowest].socket_fd, 0);
+        shed_client(&clients[index], "memory budget", usage[slowest].unsent);
+        total -= usage[slowest].pinned;
+        usage[slowest].pinned = 0;
+    }
+    pthread_mutex_unlock(&clients_mutex);
+}
+
+// Check the memory budget every MEMORY_CHECK_MS, whether or not anything is
+// being broadcast; paused while connections are being handed off
+void *memory_thread(void *arg) {
+    (void)arg;  // Unused parameter
+
+    while (server_running) {
+        usleep(MEMORY_CHECK_MS * 1000);
+        if (!upgrade_in_progress) enforce_memory_budget();
+    }
+    return NULL;
+}
+
+// Map at least *size bytes, rounded up to whole huge pages, preferring
+// explicit huge pages, then transparent ones, then regular pages
+void *huge_alloc(size_t *size, const char **backing) {
+    *size = (*size + HUGE_PAGE_SIZE - 1) & ~(size_t)(HUGE_PAGE_SIZE - 1);
+
+#ifdef MAP_HUGETLB
+    // Needs pages reserved in /proc/sys/vm/nr_hugepages
+    if (pool.hugepages) {
+        void *mem = mmap(NULL, *size, PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (mem != MAP_FAILED) {
+            *backing = "MAP_HUGETLB";
+            return mem;
+        }
+    }
+#endif
+
+    // Over-map and trim to a huge-page boundary: khugepaged only collapses
+    // aligned 2 MB ranges
+    size_t span = *size + HUGE_PAGE_SIZE;
+    char *raw = mmap(NULL, span, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (raw == MAP_FAILED) return NULL;
+
+    char *mem = (char *)(((uintptr_t)raw + HUGE_PAGE_SIZE - 1) & ~(uintptr_t)(HUGE_PAGE_SIZE - 1));
+    if (mem > raw) munmap(raw, (size_t)(mem - raw));
+    if (raw + span > mem + *size) munmap(mem + *size, (size_t)(raw + span - (mem + *size)));
+
+    *backing = "regular pages";
+#ifdef MADV_HUGEPAGE
+    if (pool.hugepages && madvise(mem, *size, MADV_HUGEPAGE) == 0) {
+        *backing = "transparent huge pages";
+    }
+#endif
+    return mem;
+}
+
+// Map the buffer pool; every slot left over after rounding up to a huge page is usable
+int init_buffer_pool(void) {
+    size_t slab = (size_t)BROADCAST_BATCH * BUFFER_SIZE;
+    size_t size = slab + (size_t)POOL_MIN_SLOTS * POOL_SLOT_SIZE;
+
+    pool.base = huge_alloc(&size, &pool.backing);
+    if (pool.base == NULL) {
+        perror("mmap");
+        return -1;
+    }
+    pool.size = size;
+    pool.slots = pool.base + slab;
+    pool.slot_count = (size - slab) / POOL_SLOT_SIZE;
+
+    printf("[Memory] Buffer pool: %zu x %d bytes on %s\n",
+           pool.slot_count, POOL_SLOT_SIZE, pool.backing);
+    return 0;
+}
+
+// Take a zeroed POOL_SLOT_SIZE buffer, from the heap if the pool is used up
+void *pool_alloc(void) {
+    char *slot = NULL;
+
+    pthread_mutex_lock(&pool_mutex);
+    if (pool.free_list != NULL) {
+        slot = (char *)pool.free_list;
+        pool.free_list = pool.free_list->next;
+    } else if (pool.next_unused < pool.slot_count) {
+        slot = pool.slots + pool.next_unused * POOL_SLOT_SIZE;
+        pool.next_unused++;
+    }
+    pthread_mutex_unlock(&pool_mutex);
+
+    if (slot == NULL) return calloc(1, POOL_SLOT_SIZE);
+    memset(slot, 0, POOL_SLOT_SIZE);
+    return slot;
+}
+
+// Return a buffer from pool_alloc
+void pool_free(void *ptr) {
+    char *slot = ptr;
+    if (slot == NULL) return;
+
+    if (slot < pool.slots || slot >= pool.slots + pool.slot_count * POOL_SLOT_SIZE) {
+        free(ptr);
+        return;
+    }
+
+    pthread_mutex_lock(&pool_mutex);
+    ((pool_slot_t *)slot)->next = pool.free_list;
+    pool.free_list = (pool_slot_t *)slot;
+    pthread_mutex_unlock(&pool_mutex);
+}
+
+// Give a client on the Unix socket a shared-memory ring for broadcasts
+// The ring lives in a memfd; it and an eventfd for wakeups are passed with SHM_OK
+void attach_shm_ring(int client_socket) {
+    char response[BUFFER_SIZE];
+
+#ifdef __linux__
+    struct sockaddr_storage addr;
+    socklen_t addr_len = sizeof(addr);
+    if (getsockname(client_socket, (struct sockaddr *)&addr, &addr_len) != 0 ||
+        addr.ss_family != AF_UNIX) {
+        format_error_message(response, "Shared memory transport requires the Unix socket");
+        send(client_socket, response, strlen(response), 0);
+        return;
+    }
+
+    int mem_fd = memfd_create("live_chat_ring", MFD_CLOEXEC);
+    int event_fd = eventfd(0, EFD_CLOEXEC);
+    shm_ring_t *ring = MAP_FAILED;
+    if (mem_fd >= 0 && ftruncate(mem_fd, sizeof(shm_ring_t)) == 0) {
+        ring = mmap(NULL, sizeof(shm_ring_t), PROT_READ | PROT_WRITE, MAP_SHARED, mem_fd, 0);
+    }
+
+    if (ring == MAP_FAILED || event_fd < 0) {
+        perror("[Server] Shared memory ring setup failed");
+        if (mem_fd >= 0) close(mem_fd);
+        if (event_fd >= 0) close(event_fd);
+        format_error_message(response, "Shared memory transport unavailable");
+        send(client_socket, response, strlen(response), 0);
+        return;
+    }
+
+    // Switch over under clients_mutex: every earlier frame went to the socket
+    // before SHM_OK, every later broadcast goes to the ring
+    int fds[2] = { mem_fd, event_fd };
+    snprintf(response, sizeof(response), "%s\n", SHM_OK);
+
+    pthread_mutex_lock(&clients_mutex);
+    int index = find_client_index(client_socket, 0);
+    if (index >= 0 && send_fds(client_socket, response, strlen(response), fds, 2) == 0) {
+        clients[index].ring = ring;
+        clients[index].ring_event_fd = event_fd;
+        printf("[Server] Client '%s' switched to shared-memory ring\n", username_of(clients[index].user_id));
+    } else {
+        munmap(ring, sizeof(shm_ring_t));
+        close(event_fd);
+    }
+    pthread_mutex_unlock(&clients_mutex);
+
+    close(mem_fd);  // The mapping keeps the memory alive
+#else
+    format_error_message(response, "Shared memory transport not supported on this platform");
+    send(client_socket, response, strlen(response), 0);
+#endif
+}
+
+// Detach a client's ring; the consumer sees closed and goes back to the socket
+// (caller holds clients_mutex)
+void release_shm_ring(client_info_t *client) {
+    if (client->ring == NULL) return;
+
+    __atomic_store_n(&client->ring->closed, 1, __ATOMIC_RELEASE);
+    uint64_t one = 1;
+    if (write(client->ring_event_fd, &one, sizeof(one)) < 0) {
+        perror("[Server] Ring wakeup failed");
+    }
+
+    munmap(client->ring, sizeof(shm_ring_t));
+    close(client->ring_event_fd);
+    client->ring = NULL;
+    client->ring_event_fd = -1;
 }
 
 // Check if username already exists (thread-safe)
 int username_exists(const char *username) {
     pthread_mutex_lock(&clients_mutex);
 
-    for (int i = 0; i < client_count; i++) {
-        if (strcmp(clients[i].username, username) == 0) {
+    // Registry entries hold a reference, so a connected name cannot be
+    // recycled while clients_mutex is held
+    uint32_t user_id = find_username(username);
+    for (int i = 0; user_id != 0 && i < client_count; i++) {
+        if (clients[i].user_id == user_id) {
             pthread_mutex_unlock(&clients_mutex);
             return 1;  // Username exists
         }
     }
 
-    pthread_mutex_unlock(&clients_mutex);
-    return 0;  // Username available
+    pthread_mutex_unlock(&clients_mutex);
+    return 0;  // Username available
+}
+
+// Id of an interned username, 0 if it has none (caller must hold a reference
+// or a lock that keeps the name alive to rely on the id afterwards)
+uint32_t find_username(const char *username) {
+    uint32_t hash = hash_bytes(username, strlen(username));
+
+    pthread_mutex_lock(&intern_mutex);
+    uint32_t id = intern_buckets[hash & (INTERN_BUCKETS - 1)];
+    while (id != 0 && (interned[id].hash != hash || strcmp(interned[id].name, username) != 0)) {
+        id = interned[id].next;
+    }
+    pthread_mutex_unlock(&intern_mutex);
+    return id;
+}
+
+// Take a reference on a username's id, interning it if needed
+// Returns 0 if the table is full
+uint32_t intern_username(const char *username) {
+    uint32_t hash = hash_bytes(username, strlen(username));
+    uint32_t *bucket = &intern_buckets[hash & (INTERN_BUCKETS - 1)];
+
+    pthread_mutex_lock(&intern_mutex);
+    uint32_t id = *bucket;
+    while (id != 0 && (interned[id].hash != hash || strcmp(interned[id].name, username) != 0)) {
+        id = interned[id].next;
+    }
+
+    if (id == 0) {
+        if (intern_free != 0) {
+            id = intern_free;
+            intern_free = interned[id].next;
+        } else if (intern_high < MAX_INTERNED) {
+            id = ++intern_high;
+        } else {
+            pthread_mutex_unlock(&intern_mutex);
+            return 0;
+        }
+        strncpy(interned[id].name, username, MAX_USERNAME - 1);
+        interned[id].name[MAX_USERNAME - 1] = '\0';
+        interned[id].hash = hash;
+        interned[id].next = *bucket;
+        *bucket = id;
+    }
+
+    interned[id].refs++;
+    pthread_mutex_unlock(&intern_mutex);
+    return id;
+}
+
+// Drop a reference taken by intern_username; the last one frees the id
+void release_username(uint32_t id) {
+    if (id == 0) return;
+
+    pthread_mutex_lock(&intern_mutex);
+    if (--interned[id].refs == 0) {
+        uint32_t *link = &intern_buckets[interned[id].hash & (INTERN_BUCKETS - 1)];
+        while (*link != id) link = &interned[*link].next;
+        *link = interned[id].next;
+
+        interned[id].next = intern_free;
+        intern_free = id;
+    }
+    pthread_mutex_unlock(&intern_mutex);
+}
+
+// Name behind an id; stable for as long as the caller holds a reference
+const char *username_of(uint32_t id) {
+    return interned[id].name;
+}
+
+// Send an already formatted frame to every client connected to this node
+void deliver_to_local_clients(const char *frame) {
+    size_t len = strlen(frame);
+
+    pthread_mutex_lock(&clients_mutex);
+    for (int i = 0; i < client_count; i++) {
+        if (clients[i].channel != 0) continue;  // Reached through their gateway
+        if (clients[i].shed) continue;
+        send_status_t status = send_frame(&clients[i], frame, len, 0);
+        if (status != SEND_OK) send_failed(&clients[i], status);
+    }
+    send_to_gateways(frame, 0);
+    pthread_mutex_unlock(&clients_mutex);
+}
+
+// Broadcast notification to all connected clients (and relay it to peer servers)
+void broadcast_notification(const char *notification) {
+    char notify_msg[BUFFER_SIZE];
+    format_notification(notify_msg, notification);
+
+    deliver_to_local_clients(notify_msg);
+    relay_to_peers(notify_msg);
+
+    if (log_enabled(LOG_CONNECTIONS)) {
+        printf("[Server] Notification broadcasted: %s\n", notification);
+    }
+}
+
+// Add a message to the broadcast queue and wake the broadcast thread
+int enqueue_for_broadcast(const message_t *msg) {
+    queued_message_t entry;
+    entry.sender_id = intern_username(msg->sender);
+    if (entry.sender_id == 0) return -1;
+    entry.remote = msg->remote;
+    memcpy(entry.topic, msg->topic, MAX_TOPIC);
+    memcpy(entry.content, msg->content, MAX_MESSAGE);
+
+    pthread_mutex_lock(&queue_mutex);
+    int result = msg_queue.count < __atomic_load_n(&limits.queue_limit, __ATOMIC_RELAXED)
+                     ? enqueue_message(&msg_queue, &entry) : -1;
+    if (result == 0 && broadcast_parked) {
+        pthread_cond_signal(&queue_cond);  // Wake up broadcast thread
+    }
+    pthread_mutex_unlock(&queue_mutex);
+
+    if (result != 0) {
+        release_username(entry.sender_id);
+    }
+    return result;
+}
+
+// Read one newline-terminated frame (newline stripped) into line
+// Returns the line length, -1 when the connection is closed, or -2 when a
+// signal interrupted the read (buffered data is kept for the next call)
+int read_line(line_reader_t *reader, char *line, size_t line_size) {
+    while (1) {
+        char *newline = memchr(reader->data, '\n', reader->len);
+        if (newline != NULL) {
+            size_t line_len = (size_t)(newline - reader->data);
+            size_t copy_len = line_len < line_size - 1 ? line_len : line_size - 1;
+            memcpy(line, reader->data, copy_len);
+            line[copy_len] = '\0';
+
+            reader->len -= line_len + 1;
+            memmove(reader->data, newline + 1, reader->len);
+            return (int)copy_len;
+        }
+
+        // Oversized frame - discard it and resynchronize on the next newline
+        if (reader->len == sizeof(reader->data)) {
+            reader->len = 0;
+        }
+
+        ssize_t valread = read(reader->fd, reader->data + reader->len,
+                               sizeof(reader->data) - reader->len);
+        if (valread < 0 && errno == EINTR) return -2;
+        if (valread <= 0) return -1;
+        reader->len += (size_t)valread;
+    }
+}
+
+// Register a peer server link (thread-safe)
+int add_peer(int socket_fd, const char *peer_id) {
+    pthread_mutex_lock(&peers_mutex);
+
+    if (peer_count >= MAX_PEERS) {
+        pthread_mutex_unlock(&peers_mutex);
+        return -1;  // Peer table full
+    }
+
+    // Only one link per peer, otherwise every message would cross twice
+    for (int i = 0; i < peer_count; i++) {
+        if (strcmp(peers[i].node_id, peer_id) == 0) {
+            pthread_mutex_unlock(&peers_mutex);
+            return -1;
+        }
+    }
+
+    peers[peer_count].socket_fd = socket_fd;
+    strncpy(peers[peer_count].node_id, peer_id, MAX_USERNAME - 1);
+    peers[peer_count].node_id[MAX_USERNAME - 1] = '\0';
+    peers[peer_count].reader_thread = pthread_self();
+    peers[peer_count].stalled = 0;
+    peer_count++;
+
+    printf("[Peer] Linked to node '%s'. Total peers: %d\n", peer_id, peer_count);
+    rebuild_hash_ring();
+
+    pthread_mutex_unlock(&peers_mutex);
+    return 0;
+}
+
+// Remove a peer server link (thread-safe)
+void remove_peer(int socket_fd) {
+    pthread_mutex_lock(&peers_mutex);
+
+    for (int i = 0; i < peer_count; i++) {
+        if (peers[i].socket_fd == socket_fd) {
+            printf("[Peer] Link to node '%s' closed\n", peers[i].node_id);
+
+            for (int j = i; j < peer_count - 1; j++) {
+                peers[j] = peers[j + 1];
+            }
+            peer_count--;
+            rebuild_hash_ring();
+            break;
+        }
+    }
+
+    pthread_mutex_unlock(&peers_mutex);
+}
+
+// Order ring points by hash (qsort comparator)
+int compare_ring_points(const void *a, const void *b) {
+    uint32_t ha = ((const ring_point_t *)a)->hash;
+    uint32_t hb = ((const ring_point_t *)b)->hash;
+    return (ha > hb) - (ha < hb);
+}
+
+// Order node ids (qsort comparator over const char * entries)
+int compare_node_ids(const void *a, const void *b) {
+    return strcmp(*(const char *const *)a, *(const char *const *)b);
+}
+
+// Recompute the cluster view and ring after membership changes or a peer's
+// MESH (caller holds peers_mutex). Only rooms whose successor point belonged
+// to the changed node move; a room this node gives up takes its scrollback
+// along to the new owner
+void rebuild_hash_ring(void) {
+    // This node's view: its own id and every linked peer, sorted
+    const char *ids[MAX_PEERS + 1];
+    int id_count = 0;
+    ids[id_count++] = node_id;
+    for (int p = 0; p < peer_count; p++) {
+        ids[id_count++] = peers[p].node_id;
+    }
+    qsort(ids, (size_t)id_count, sizeof(ids[0]), compare_node_ids);
+
+    char joined[(MAX_PEERS + 1) * MAX_USERNAME];
+    size_t joined_len = 0;
+    for (int i = 0; i < id_count; i++) {
+        joined_len += (size_t)snprintf(joined + joined_len, sizeof(joined) - joined_len,
+                                       "%s,", ids[i]);
+    }
+    uint32_t digest = hash_bytes(joined, joined_len);
+
+    if (digest != view_digest) {
+        char frame[BUFFER_SIZE];
+        format_mesh(frame, id_count, digest);
+        for (int p = 0; p < peer_count; p++) {
+            send_to_peer(&peers[p], frame, strlen(frame));
+        }
+        view_digest = digest;
+    }
+
+    int complete = 1;
+    for (int p = 0; p < peer_count; p++) {
+        if (peers[p].mesh_size != id_count || peers[p].mesh_digest != digest) complete = 0;
+    }
+    if (complete != mesh_complete) {
+        if (complete) {
+            printf("[Cluster] Full mesh of %d node(s), rooms are spread over the ring\n", id_count);
+        } else {
+            printf("[Cluster] Peers disagree on the cluster view; sequencing locally "
+                   "until every node is linked to every other\n");
+        }
+        mesh_complete = complete;
+    }
+
+    char key[MAX_USERNAME + 16];
+    ring_size = 0;
+    for (int p = -1; p < (complete ? peer_count : 0); p++) {
+        const char *id = (p < 0) ? node_id : peers[p].node_id;
+        for (int v = 0; v < RING_VNODES; v++) {
+            int key_len = snprintf(key, sizeof(key), "%s#%d", id, v);
+            hash_ring[ring_size].hash = hash_bytes(key, (size_t)key_len);
+            hash_ring[ring_size].peer_index = p;
+            ring_size++;
+        }
+    }
+    qsort(hash_ring, (size_t)ring_size, sizeof(ring_point_t), compare_ring_points);
+
+    int owner = ring_lookup(DEFAULT_ROOM);
+    const char *owner_id = (owner < 0) ? node_id : peers[owner].node_id;
+    if (strcmp(room_owner, owner_id) != 0) {
+        if (owner >= 0 && strcmp(room_owner, node_id) == 0) {
+            hand_off_history(&peers[owner]);
+        }
+        snprintf(room_owner, sizeof(room_owner), "%s", owner_id);
+        printf("[Cluster] Room '%s' now owned by node '%s'\n", DEFAULT_ROOM, room_owner);
+    }
+}
+
+// Send the room's scrollback, oldest first, to the node taking it over
+// (caller holds peers_mutex)
+void hand_off_history(peer_info_t *peer) {
+    history_t copy;
+    pthread_mutex_lock(&history_mutex);
+    copy = history;
+    pthread_mutex_unlock(&history_mutex);
+
+    int start = (copy.head - copy.count + HISTORY_SIZE) % HISTORY_SIZE;
+    for (int i = 0; i < copy.count; i++) {
+        const history_entry_t *entry = &copy.entries[(start + i) % HISTORY_SIZE];
+        char frame[BUFFER_SIZE];
+        format_history_entry(frame, DEFAULT_ROOM, entry->sender, entry->content);
+        if (send_to_peer(peer, frame, strlen(frame)) != 0) return;
+    }
+    if (copy.count > 0) {
+        printf("[Cluster] Handed %d scrollback message(s) of '%s' to node '%s'\n",
+               copy.count, DEFAULT_ROOM, peer->node_id);
+    }
+}
+
+// Find the owning node of a room (caller holds peers_mutex)
+// Returns a peers[] index, or -1 when this node is the owner
+int ring_lookup(const char *room) {
+    if (ring_size == 0) return -1;
+
+    uint32_t hash = hash_bytes(room, strlen(room));
+    int lo = 0, hi = ring_size;
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+        if (hash_ring[mid].hash < hash) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return hash_ring[lo % ring_size].peer_index;
+}
+
+// Check whether this node sequences the given room (thread-safe)
+int room_owned_locally(const char *room) {
+    pthread_mutex_lock(&peers_mutex);
+    int owner = ring_lookup(room);
+    pthread_mutex_unlock(&peers_mutex);
+    return owner < 0;
+}
+
+// Check whether this node sequences a room for a cluster (thread-safe): its
+// publishers on every node are screened here, whoever subscribes to it
+int room_sequenced_for_peers(const char *room) {
+    pthread_mutex_lock(&peers_mutex);
+    int sequenced = ring_size > 0 && ring_lookup(room) < 0;
+    pthread_mutex_unlock(&peers_mutex);
+    return sequenced;
+}
+
+// Send a chat message or publish to the node owning its room or topic, if
+// that is not this node
+// Returns 0 if owned locally (caller enqueues), 1 if forwarded, -1 on error
+int route_to_room_owner(const char *room, const message_t *msg) {
+    pthread_mutex_lock(&peers_mutex);
+
+    int owner = ring_lookup(room);
+    if (owner < 0) {
+        pthread_mutex_unlock(&peers_mutex);
+        return 0;
+    }
+
+    char frame[BUFFER_SIZE];
+    if (msg->kind == TYPE_PUB) {
+        format_publish(frame, msg->topic, msg->sender, msg->content);
+    } else {
+        format_chat_message(frame, msg->sender, msg->content);
+    }
+    int result = send_to_peer(&peers[owner], frame, strlen(frame)) < 0 ? -1 : 1;
+
+    pthread_mutex_unlock(&peers_mutex);
+    return result;
+}
+
+// Forward a locally originated frame once over every peer link
+// Nothing is relayed while the mesh is partial: this node is then sequencing
+// rooms the others may route elsewhere
+void relay_to_peers(const char *frame) {
+    size_t len = strlen(frame);
+
+    pthread_mutex_lock(&peers_mutex);
+    for (int i = 0; i < peer_count && mesh_complete; i++) {
+        send_to_peer(&peers[i], frame, len);
+    }
+    pthread_mutex_unlock(&peers_mutex);
+}
+
+// Write one frame to a peer link without blocking (caller holds peers_mutex)
+// A link whose send buffer is full is dropped instead of waited on: half a
+// frame cannot be taken back, and one stalled peer must not hold up the
+// rest of the cluster. Its dialer reconnects it. Returns -1 if not sent
+int send_to_peer(peer_info_t *peer, const char *frame, size_t len) {
+    if (peer->stalled) return -1;
+
+    ssize_t sent = send(peer->socket_fd, frame, len, MSG_DONTWAIT);
+    if (sent == (ssize_t)len) return 0;
+
+    if (sent < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
+        perror("[Peer] Relay failed");
+    } else {
+        printf("[Peer] Link to node '%s' is not keeping up, dropping it\n", peer->node_id);
+    }
+    peer->stalled = 1;
+    shutdown(peer->socket_fd, SHUT_RDWR);  // Its reader sees EOF and unlinks it
+    return -1;
+}
+
+// Read the cluster key from the first line of path
+// Returns 0 on success, -1 if the file is unreadable or the key too short
+int load_cluster_key(const char *path) {
+    FILE *file = fopen(path, "r");
+    if (file == NULL) {
+        perror("[Peer] Cannot open cluster key file");
+        return -1;
+    }
+
+    char line[MAX_MESSAGE];
+    int result = -1;
+    if (fgets(line, sizeof(line), file) != NULL) {
+        line[strcspn(line, "\r\n")] = '\0';
+        if (strlen(line) >= CLUSTER_KEY_MIN) {
+            memcpy(cluster_key, line, sizeof(cluster_key));
+            result = 0;
+        }
+    }
+    fclose(file);
+
+    if (result != 0) {
+        fprintf(stderr, "[Peer] Cluster key in %s must be at least %d characters\n",
+                path, CLUSTER_KEY_MIN);
+    }
+    return result;
+}
+
+// Non-zero if a hello carried this node's cluster key (never without -k)
+// Every byte is compared, so the time taken does not reveal a matching prefix
+int cluster_key_matches(const char *offered) {
+    if (cluster_key[0] == '\0') return 0;
+
+    size_t key_len = strlen(cluster_key);
+    unsigned char diff = (unsigned char)(strlen(offered) != key_len);
+    for (size_t i = 0; i < key_len; i++) {
+        diff |= (unsigned char)(cluster_key[i] ^ offered[i]);
+        if (offered[i] == '\0') break;
+    }
+    return diff == 0;
+}
+
+// Service an established peer link until it closes
+// The room owner sequences chat traffic: messages reaching it from edge nodes
+// are re-broadcast to every peer, while edges fan owner traffic out locally only.
+// Notifications are relayed once by their origin, so peers form a full mesh
+void run_peer_link(line_reader_t *reader, const char *peer_id) {
+    if (strcmp(peer_id, node_id) == 0 || add_peer(reader->fd, peer_id) != 0) {
+        printf("[Peer] Rejecting link to node '%s'\n", peer_id);
+        close(reader->fd);
+        return;
+    }
+
+    // Peer frames get the same checks as client frames before anything is
+    // queued: a peer is trusted to name the user it authenticated, not to
+    // have scrubbed or filtered what that user sent
+    char line[BUFFER_SIZE];
+    int history_cursor = 0;         // Where the next handed-over entry goes
+    while (server_running) {
+        // A hot upgrade stops this link's ingress before draining the queue
+        if (upgrade_in_progress) park_for_upgrade();
+
+        int len = read_line(reader, line, sizeof(line));
+        if (len == -2) continue;
+        if (len < 0) break;
+
+        message_t msg;
+        if (parse_message(line, &msg) != 0) {
+            printf("[Peer] Failed to parse frame from '%s'\n", peer_id);
+            continue;
+        }
+        if (msg.kind != TYPE_HIST) history_cursor = 0;
+
+        if (msg.kind == TYPE_PUB || msg.kind == TYPE_MSG) {
+            // The owner of the room or topic sequences it and relays it to
+            // every node, so repeats are counted there, once
+            const char *room = msg.kind == TYPE_PUB ? msg.topic : DEFAULT_ROOM;
+            if (!validate_username(msg.sender) || !validate_message_content(msg.content) ||
+                (msg.kind == TYPE_PUB && !validate_topic(msg.topic, 0))) {
+                printf("[Peer] Invalid %s frame from '%s'\n", msg.type, peer_id);
+                continue;
+            }
+            msg.remote = !room_owned_locally(room);
+            if (screen_message(room, msg.content, msg.sender, !msg.remote) != NULL) continue;
+            if (enqueue_for_broadcast(&msg) != 0) {
+                printf("[Peer] Message queue full, dropping relay from '%s'\n", peer_id);
+            }
+        } else if (msg.kind == TYPE_MESH) {
+            char *end = NULL;
+            long count = strtol(msg.topic, &end, 10);
+            unsigned long digest = strtoul(msg.content, NULL, 16);
+            if (*end != '\0' || count < 1 || count > MAX_PEERS + 1) continue;
+
+            pthread_mutex_lock(&peers_mutex);
+            for (int i = 0; i < peer_count; i++) {
+                if (peers[i].socket_fd == reader->fd) {
+                    peers[i].mesh_size = (int)count;
+                    peers[i].mesh_digest = (uint32_t)digest;
+                    rebuild_hash_ring();
+                    break;
+                }
+            }
+            pthread_mutex_unlock(&peers_mutex);
+        } else if (msg.kind == TYPE_HIST) {
+            if (strcmp(msg.topic, DEFAULT_ROOM) != 0 || !validate_username(msg.sender) ||
+                !validate_message_content(msg.content)) {
+                continue;
+            }
+            scrub_message_content(msg.content);
+            merge_history_entry(&history_cursor, msg.sender, msg.content);
+        } else if (msg.kind == TYPE_NOTIFY) {
+            char notify_msg[BUFFER_SIZE];
+            scrub_message_content(msg.content);
+            format_notification(notify_msg, msg.content);
+            deliver_to_local_clients(notify_msg);
+        }
+    }
+
+    remove_peer(reader->fd);
+    close(reader->fd);
+}
+
+// Parse a host:port spec into a dial target
+int parse_target(const char *spec, peer_target_t *target) {
+    const char *colon = strrchr(spec, ':');
+    if (colon == NULL || colon == spec || colon[1] == '\0') return -1;
+
+    memset(target, 0, sizeof(*target));
+    size_t host_len = (size_t)(colon - spec);
+    if (host_len >= sizeof(target->host)) host_len = sizeof(target->host) - 1;
+    memcpy(target->host, spec, host_len);
+    strncpy(target->port, colon + 1, sizeof(target->port) - 1);
+    return 0;
+}
+
+// Open a TCP connection to a target; returns the socket or -1
+int dial_target(const peer_target_t *target) {
+    struct addrinfo hints = {0};
+    struct addrinfo *result = NULL;
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+
+    int sock = -1;
+    if (getaddrinfo(target->host, target->port, &hints, &result) == 0) {
+        for (struct addrinfo *ai = result; ai != NULL; ai = ai->ai_next) {
+            sock = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+            if (sock < 0) continue;
+            if (connect(sock, ai->ai_addr, ai->ai_addrlen) == 0) {
+                tune_client_socket(sock);
+                break;
+            }
+            close(sock);
+            sock = -1;
+        }
+        freeaddrinfo(result);
+    }
+    return sock;
+}
+
+// Maintain a persistent outbound link to one peer, reconnecting when it drops
+void *peer_dial_thread(void *arg) {
+    peer_target_t *target = (peer_target_t *)arg;
+
+    while (server_running) {
+        int sock = dial_target(target);
+        if (sock >= 0) {
+            // Exchange hellos so both ends know each other's node id and
+            // have shown the cluster key
+            char hello[BUFFER_SIZE];
+            format_peer_hello(hello, node_id, cluster_key);
+            send(sock, hello, strlen(hello), 0);
+
+            line_reader_t *reader = pool_alloc();
+            char line[BUFFER_SIZE];
+            message_t reply;
+            if (reader != NULL) {
+                reader->fd = sock;
+                if (read_line(reader, line, sizeof(line)) >= 0 &&
+                    parse_message(line, &reply) == 0 &&
+                    reply.kind == TYPE_PEER) {
+                    if (cluster_key_matches(reply.content)) {
+                        run_peer_link(reader, reply.sender);
+                        sock = -1;  // Closed by run_peer_link
+                    } else {
+                        printf("[Peer] Node at %s:%s answered with the wrong cluster key\n",
+                               target->host, target->port);
+                    }
+                }
+                pool_free(reader);
+            }
+            if (sock >= 0) close(sock);
+        }
+
+        if (server_running) sleep(PEER_RECONNECT_DELAY);
+    }
+
+    free(target);
+    return NULL;
+}
+
+// Parse a host:port peer spec and start its dialer thread
+int start_peer_dialer(const char *spec) {
+    peer_target_t *target = calloc(1, sizeof(peer_target_t));
+    if (target == NULL) return -1;
+    if (parse_target(spec, target) != 0) {
+        free(target);
+        return -1;
+    }
+
+    pthread_t dial_tid;
+    if (pthread_create(&dial_tid, NULL, peer_dial_thread, target) != 0) {
+        free(target);
+        return -1;
+    }
+    pthread_detach(dial_tid);
+
+    printf("[Peer] Dialing %s:%s\n", target->host, target->port);
+    return 0;
+}
+
+// Send one frame on the upstream link (gateway mode, thread-safe)
+// Returns -1 while the core is unreachable
+int send_upstream(const char *frame) {
+    pthread_mutex_lock(&upstream_mutex);
+    int result = -1;
+    if (upstream_fd >= 0 && send(upstream_fd, frame, strlen(frame), 0) >= 0) {
+        result = 0;
+    }
+    pthread_mutex_unlock(&upstream_mutex);
+    return result;
+}
+
+// Relay a local user's frames to the core over their channel (gateway mode)
+void gateway_serve_client(int client_socket) {
+    pthread_mutex_lock(&channels_mutex);
+    if (channel_count >= MAX_CLIENTS) {
+        pthread_mutex_unlock(&channels_mutex);
+        send(client_socket, SERVER_FULL "\n", strlen(SERVER_FULL) + 1, 0);
+        close(client_socket);
+        return;
+    }
+    int channel = next_channel++;
+    channels[channel_count].socket_fd = client_socket;
+    channels[channel_count].channel = channel;
+    channels[channel_count].username[0] = '\0';
+    channels[channel_count].authenticated = 0;
+    channels[channel_count].stalled = 0;
+    channel_count++;
+    pthread_mutex_unlock(&channels_mutex);
+
+    if (log_enabled(LOG_CONNECTIONS)) {
+        printf("[Gateway] Local client on socket %d mapped to channel %d\n", client_socket, channel);
+    }
+
+    line_reader_t *reader = pool_alloc();
+    char line[BUFFER_SIZE];
+    char wrapped[BUFFER_SIZE];
+    while (reader != NULL && server_running) {
+        reader->fd = client_socket;
+        if (read_line(reader, line, sizeof(line)) < 0) break;
+        if (line[0] == '\0') continue;
+
+        message_t msg;
+        int parsed = parse_message(line, &msg);
+        if (parsed == 0 && msg.kind == TYPE_SHM) {
+            // The ring would have to live on this host with the user; not relayed
+            char response[BUFFER_SIZE];
+            format_error_message(response, "Shared memory transport not available through a gateway");
+            reply_to_local_user(channel, response);
+            continue;
+        }
+
+        if (parsed == 0 && msg.kind == TYPE_AUTH) {
+            // Remembered so the login can be replayed if the core link drops
+            pthread_mutex_lock(&channels_mutex);
+            for (int i = 0; i < channel_count; i++) {
+                if (channels[i].channel == channel && channels[i].username[0] == '\0') {
+                    snprintf(channels[i].username, sizeof(channels[i].username), "%s", msg.sender);
+                }
+            }
+            pthread_mutex_unlock(&channels_mutex);
+        }
+
+        format_channel_frame(wrapped, channel, line);
+        if (send_upstream(wrapped) != 0 && parsed == 0 &&
+            msg.kind == TYPE_MSG) {
+            char response[BUFFER_SIZE];
+            format_error_message(response, "Upstream server unavailable");
+            reply_to_local_user(channel, response);
+        }
+        if (parsed == 0 && msg.kind == TYPE_DISCONNECT) break;
+    }
+    pool_free(reader);
+
+    // An empty frame closes the channel on the core
+    format_channel_frame(wrapped, channel, "");
+    send_upstream(wrapped);
+
+    pthread_mutex_lock(&channels_mutex);
+    for (int i = 0; i < channel_count; i++) {
+        if (channels[i].channel == channel) {
+            for (int j = i; j < channel_count - 1; j++) {
+                channels[j] = channels[j + 1];
+            }
+            channel_count--;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&channels_mutex);
+
+    close(client_socket);
+    if (log_enabled(LOG_CONNECTIONS)) {
+        printf("[Gateway] Channel %d closed\n", channel);
+    }
+}
+
+// Send a frame to one local user without blocking (caller holds channels_mutex)
+// A user whose socket cannot take the whole frame right away is shut down -
+// its reader sees EOF and closes the channel - so one slow user never holds
+// up delivery to the others or the upstream link
+void send_to_local_user(channel_info_t *user, const char *frame, size_t len) {
+    if (user->stalled) return;
+
+    ssize_t sent = send(user->socket_fd, frame, len, MSG_DONTWAIT);
+    if (sent == (ssize_t)len) return;
+
+    if (sent < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
+        perror("[Gateway] Send to local user failed");
+    } else {
+        printf("[Gateway] Channel %d is not keeping up, dropping it\n", user->channel);
+    }
+    user->stalled = 1;
+    shutdown(user->socket_fd, SHUT_RDWR);
+}
+
+// Send a gateway-generated reply to one local user (thread-safe)
+void reply_to_local_user(int channel, const char *frame) {
+    pthread_mutex_lock(&channels_mutex);
+    for (int i = 0; i < channel_count; i++) {
+        if (channels[i].channel == channel) {
+            send_to_local_user(&channels[i], frame, strlen(frame));
+            break;
+        }
+    }
+    pthread_mutex_unlock(&channels_mutex);
+}
+
+// Deliver one frame from the core to its local user(s) (caller holds channels_mutex)
+// Channel 0 is a broadcast to every logged-in user
+void gateway_deliver(int channel, const char *frame) {
+    char local[BUFFER_SIZE];
+    snprintf(local, sizeof(local), "%s\n", frame);
+    size_t len = strlen(local);
+
+    for (int i = 0; i < channel_count; i++) {
+        if (channel == 0) {
+            if (channels[i].authenticated) send_to_local_user(&channels[i], local, len);
+            continue;
+        }
+        if (channels[i].channel != channel) continue;
+
+        if (frame[0] == '\0') {
+            // Core closed the channel; the reader sees EOF and cleans up
+            shutdown(channels[i].socket_fd, SHUT_RDWR);
+        } else if (strcmp(frame, AUTH_OK) == 0) {
+            // A re-login after reconnecting is invisible to the user
+            if (!channels[i].authenticated) send_to_local_user(&channels[i], local, len);
+            channels[i].authenticated = 1;
+        } else {
+            send_to_local_user(&channels[i], local, len);
+        }
+        break;
+    }
+}
+
+// Keep the gateway's single link to the core up, resuming logins on reconnect
+void *gateway_upstream_thread(void *arg) {
+    peer_target_t *target = (peer_target_t *)arg;
+
+    while (server_running) {
+        int sock = dial_target(target);
+        if (sock < 0) {
+            if (server_running) sleep(PEER_RECONNECT_DELAY);
+            continue;
+        }
+
+        char frame[BUFFER_SIZE];
+        format_gateway_hello(frame, node_id, cluster_key);
+        send(sock, frame, strlen(frame), 0);
+
+        // Publish the link and log every known user back in before any
+        // new channel traffic can slip in between. Users the core already
+        // accepted resume: they have seen the scrollback and their join, so
+        // the core sends neither again
+        pthread_mutex_lock(&upstream_mutex);
+        upstream_fd = sock;
+        pthread_mutex_lock(&channels_mutex);
+        for (int i = 0; i < channel_count; i++) {
+            if (channels[i].username[0] == '\0') continue;
+            char auth[BUFFER_SIZE];
+            if (channels[i].authenticated) {
+                format_resume_message(auth, channels[i].username);
+            } else {
+                format_auth_message(auth, channels[i].username);
+            }
+            format_channel_frame(frame, channels[i].channel, auth);
+            send(sock, frame, strlen(frame), 0);
+        }
+        pthread_mutex_unlock(&channels_mutex);
+        pthread_mutex_unlock(&upstream_mutex);
+
+        printf("[Gateway] Connected to core %s:%s\n", target->host, target->port);
+
+        line_reader_t *reader = pool_alloc();
+        char line[BUFFER_SIZE];
+        if (reader != NULL) {
+            reader->fd = sock;
+            while (server_running && read_line(reader, line, sizeof(line)) >= 0) {
+                int channel;
+                const char *payload;
+                if (parse_channel_frame(line, &channel, &payload) != 0) {
+                    printf("[Gateway] Bad frame from core\n");
+                    continue;
+                }
+                pthread_mutex_lock(&channels_mutex);
+                gateway_deliver(channel, payload);
+                pthread_mutex_unlock(&channels_mutex);
+            }
+            pool_free(reader);
+        }
+
+        pthread_mutex_lock(&upstream_mutex);
+        upstream_fd = -1;
+        pthread_mutex_unlock(&upstream_mutex);
+        close(sock);
+
+        if (server_running) {
+            printf("[Gateway] Lost core link, reconnecting\n");
+            sleep(PEER_RECONNECT_DELAY);
+        }
+    }
+
+    free(target);
+    return NULL;
+}
+
+// Dedicated broadcast thread - dequeues and distributes messages
+// Takes up to BROADCAST_BATCH queued messages at a time, so a burst is written
+// to each client back to back (corked with MSG_MORE) instead of per message
+void *broadcast_thread(void *arg) {
+    (void)arg;  // Unused parameter
+
+    // Pin before any work, so the whole thread runs on the chosen CPU
+    if (pin_current_thread(placement.broadcast_cpu, "broadcast thread") == 0 &&
+        placement.broadcast_cpu >= 0) {
+        printf("[Affinity] Broadcast thread pinned to CPU %d\n", placement.broadcast_cpu);
+    }
+
+    printf("[Broadcast Thread] Started\n");
+
+    queued_message_t batch[BROADCAST_BATCH];
+    char (*frames)[BUFFER_SIZE] = (char (*)[BUFFER_SIZE])pool.base;
+    size_t frame_lens[BROADCAST_BATCH];
+    int frame_remote[BROADCAST_BATCH];
+    uint64_t frame_seq[BROADCAST_BATCH];
+
+    while (1) {
+        if (__atomic_load_n(&polling.spin_us, __ATOMIC_RELAXED) != 0) {
+            spin_for_messages();
+        }
+
+        pthread_mutex_lock(&queue_mutex);
+
+        // Wait for messages in queue
+        while (is_queue_empty(&msg_queue) && broadcast_running) {
+            broadcast_parked = 1;
+            pthread_cond_wait(&queue_cond, &queue_mutex);
+            broadcast_parked = 0;
+        }
+
+        // Keep flushing queued messages until the drain has closed every client
+        if (is_queue_empty(&msg_queue) && !broadcast_running) {
+            pthread_mutex_unlock(&queue_mutex);
+            break;
+        }
+
+        // Dequeue a batch
+        int batch_limit = __atomic_load_n(&limits.broadcast_batch, __ATOMIC_RELAXED);
+        int batch_count = 0;
+        while (batch_count < batch_limit &&
+               dequeue_message(&msg_queue, &batch[batch_count]) == 0) {
+            batch_count++;
+        }
+        pthread_mutex_unlock(&queue_mutex);
+
+        int frame_count = 0;
+        for (int m = 0; m < batch_count; m++) {
+            queued_message_t *msg = &batch[m];
+            const char *sender = username_of(msg->sender_id);
+
+            // Topic publishes go only to matching subscribers and skip history
+            if (msg->topic[0] != '\0') {
+                char publish[BUFFER_SIZE];
+                format_publish(publish, msg->topic, sender, msg->content);
+                if (log_enabled(LOG_MESSAGES)) {
+                    printf("[Broadcast] %s -> %s: %s\n", sender, msg->topic, msg->content);
+                }
+
+                deliver_to_subscribers(msg->topic, publish);
+                if (!msg->remote) {
+                    relay_to_peers(publish);
+                }
+                release_username(msg->sender_id);
+                continue;
+            }
+
+            // Format broadcast message
+            format_chat_message(frames[frame_count], sender, msg->content);
+            frame_lens[frame_count] = strlen(frames[frame_count]);
+            frame_remote[frame_count] = msg->remote;
+
+            if (log_enabled(LOG_MESSAGES)) {
+                printf("[Broadcast] %s: %s\n", sender, msg->content);
+            }
+
+            frame_seq[frame_count++] = record_history(sender, msg->content);
+            release_username(msg->sender_id);
+        }
+
+        if (frame_count == 0) continue;
+
+        // Large batches go out as one buffer the kernel reads in place, so
+        // every client's send shares the same pages instead of copying them
+        zc_buffer_t *zc = NULL;
+        if (__atomic_load_n(&tuning.zerocopy, __ATOMIC_RELAXED)) {
+            size_t total = 0;
+            for (int f = 0; f < frame_count; f++) total += frame_lens[f];
+            if (total >= (size_t)__atomic_load_n(&tuning.zerocopy_min, __ATOMIC_RELAXED)) {
+                zc = zc_buffer_create(frames, frame_lens, frame_count);
+            }
+        }
+
+        // Send to all connected clients; the last frame of the batch flushes
+        int more = __atomic_load_n(&tuning.cork, __ATOMIC_RELAXED) ? MSG_MORE : 0;
+        pthread_mutex_lock(&clients_mutex);
+        for (int i = 0; i < client_count; i++) {
+            if (clients[i].channel != 0) continue;  // Reached through their gateway
+            if (clients[i].shed) continue;
+            if (clients[i].zc_tail != clients[i].zc_next) {
+                reap_zerocopy(&clients[i]);
+            }
+
+            // Frames a just-joined client already got in its replay are skipped
+            int first = 0;
+            while (first < frame_count && frame_seq[first] <= clients[i].replayed_seq) first++;
+            if (first == frame_count) continue;
+
+            if (zc != NULL && first == 0 && clients[i].zerocopy && clients[i].ring == NULL) {
+                send_status_t status = send_zerocopy(&clients[i], zc);
+                if (status != SEND_OK) send_failed(&clients[i], status);
+                continue;
+            }
+            for (int f = first; f < frame_count; f++) {
+                int flags = f < frame_count - 1 ? more : 0;
+                send_status_t status = send_frame(&clients[i], frames[f], frame_lens[f], flags);
+                if (status != SEND_OK) {
+                    send_failed(&clients[i], status);
+                    break;
+                }
+            }
+        }
+        for (int f = 0; f < frame_count; f++) {
+            send_to_gateways(frames[f], f < frame_count - 1 ? more : 0);
+        }
+        pthread_mutex_unlock(&clients_mutex);
+
+        if (zc != NULL) {
+            zc_buffer_release(zc);  // In-flight sends keep their own references
+        }
+
+        // Messages sequenced here cross each peer link exactly once
+        for (int f = 0; f < frame_count; f++) {
+            if (!frame_remote[f]) {
+                relay_to_peers(frames[f]);
+            }
+        }
+    }
+
+    printf("[Broadcast Thread] Exiting\n");
+    return NULL;
+}
+
+// Client handler thread - processes authentication and messages
+void *handle_client(void *arg) {
+    int client_socket = *(int*)arg;
+    free(arg);
+
+    char buffer[BUFFER_SIZE] = {0};
+    char username[MAX_USERNAME] = {0};
+
+    if (log_enabled(LOG_CONNECTIONS)) {
+        printf("[Thread %p] New client connected (socket %d)\n",
+               (void*)pthread_self(), client_socket);
+    }
+
+#ifdef CHAT_TLS
+    // Plaintext clients, peers and gateways never start with a TLS record.
+    // With -t, users on the TCP port must use TLS; only peer and gateway links,
+    // which prove the cluster key, and the Unix socket stay plaintext
+    int require_tls = 0;
+    unsigned char first_byte;
+    if (tls_ctx != NULL && recv(client_socket, &first_byte, 1, MSG_PEEK) == 1 &&
+        first_byte == TLS_RECORD_BYTE) {
+        client_socket = tls_accept(client_socket);
+        if (client_socket < 0) return NULL;
+    } else if (tls_ctx != NULL) {
+        require_tls = plaintext_tcp(client_socket);
+    }
+    if (require_tls && gateway_mode) {
+        printf("[TLS] Refusing plaintext user on socket %d\n", client_socket);
+        close(client_socket);
+        return NULL;
+    }
+#endif
+
+    // Gateways relay every frame upstream; the core authenticates
+    if (gateway_mode) {
+        gateway_serve_client(client_socket);
+        return NULL;
+    }
+
+    // Phase 1: Authentication
+    // Read authentication message; until it arrives a hot upgrade may hand
+    // this connection to the new process instead
+    track_pending_login(client_socket, 1);
+    int valread;
+    do {
+        if (upgrade_in_progress) park_for_upgrade();
+        valread = read(client_socket, buffer, BUFFER_SIZE - 1);
+    } while (valread < 0 && errno == EINTR);
+    track_pending_login(client_socket, 0);
+    if (valread <= 0) {
+        printf("[Thread %p] Failed to read auth message\n", (void*)pthread_self());
+        close(client_socket);
+        return NULL;
+    }
+    buffer[valread] = '\0';
+
+    // Only the hello line is parsed here; anything sent behind it in the same
+    // read is kept for the connection's line reader
+    char *leftover = strchr(buffer, '\n');
+    int leftover_len = 0;
+    if (leftover != NULL) {
+        *leftover++ = '\0';
+        leftover_len = valread - (int)(leftover - buffer);
+    }
+
+    // The first read has been through the receive path, so its CPU is known;
+    // per-connection state (line readers etc.) is allocated after this
+    if (__atomic_load_n(&placement.follow_rx_cpu, __ATOMIC_RELAXED)) {
+        pin_to_incoming_cpu(client_socket);
+    }
+
+    // Parse authentication message
+    message_t auth_msg;
+    int parsed = parse_message(buffer, &auth_msg);
+
+    // Another server opening a peer or gateway link instead of a user logging in
+    if (parsed == 0 && (auth_msg.kind == TYPE_PEER ||
+                        auth_msg.kind == TYPE_GATEWAY)) {
+        if (!cluster_key_matches(auth_msg.content)) {
+            printf("[Server] Rejecting %s hello without a valid cluster key (socket %d)\n",
+                   auth_msg.type, client_socket);
+            close(client_socket);
+            return NULL;
+        }
+
+        line_reader_t *reader = reader_with_leftover(client_socket, leftover, leftover_len);
+        if (reader == NULL) {
+            close(client_socket);
+            return NULL;
+        }
+
+        if (auth_msg.kind == TYPE_GATEWAY) {
+            run_gateway_link(reader, auth_msg.sender);
+        } else {
+            char hello[BUFFER_SIZE];
+            format_peer_hello(hello, node_id, cluster_key);
+            send(client_socket, hello, strlen(hello), 0);
+
+            run_peer_link(reader, auth_msg.sender);
+        }
+        pool_free(reader);
+        return NULL;
+    }
+
+#ifdef CHAT_TLS
+    if (require_tls) {
+        char response[BUFFER_SIZE];
+        format_error_message(response, "TLS required on this port");
+        send(client_socket, response, strlen(response), 0);
+        close(client_socket);
+        printf("[TLS] Refusing plaintext user on socket %d\n", client_socket);
+        return NULL;
+    }
+#endif
+
+    if (parsed != 0 ||
+        auth_msg.kind != TYPE_AUTH) {
+
+        // Invalid auth message
+        char response[BUFFER_SIZE];
+        format_error_message(response, "Invalid authentication format");
+        send(client_socket, response, strlen(response), 0);
+        close(client_socket);
+        printf("[Thread %p] Invalid auth format\n", (void*)pthread_self());
+        return NULL;
+    }
+
+    // Validate username
+    if (!validate_username(auth_msg.sender)) {
+        char response[BUFFER_SIZE];
+        strcpy(response, AUTH_FAILED_INVALID);
+        strcat(response, "\n");
+        send(client_socket, response, strlen(response), 0);
+        close(client_socket);
+        printf("[Thread %p] Invalid username: %s\n", (void*)pthread_self(), auth_msg.sender);
+        return NULL;
+    }
+
+    // Check if username already taken
+    if (username_exists(auth_msg.sender)) {
+        char response[BUFFER_SIZE];
+        strcpy(response, AUTH_FAILED);
+        strcat(response, "\n");
+        send(client_socket, response, strlen(response), 0);
+        close(client_socket);
+        printf("[Thread %p] Username already taken: %s\n", (void*)pthread_self(), auth_msg.sender);
+        return NULL;
+    }
+
+    // Authentication successful
+    strncpy(username, auth_msg.sender, MAX_USERNAME - 1);
+    username[MAX_USERNAME - 1] = '\0';
+
+    // Add client to tracking list
+    if (add_client(client_socket, 0, username) != 0) {
+        char response[BUFFER_SIZE];
+        strcpy(response, SERVER_FULL);
+        strcat(response, "\n");
+        send(client_socket, response, strlen(response), 0);
+        close(client_socket);
+        printf("[Thread %p] Server full, rejecting client\n", (void*)pthread_self());
+        return NULL;
+    }
+
+    // Send AUTH_OK
+    char response[BUFFER_SIZE];
+    strcpy(response, AUTH_OK);
+    strcat(response, "\n");
+    send(client_socket, response, strlen(response), 0);
+
+    if (log_enabled(LOG_CONNECTIONS)) {
+        printf("[Thread %p] User '%s' authenticated successfully\n",
+               (void*)pthread_self(), username);
+    }
+
+    // Catch the new user up on recent conversation
+    replay_history(client_socket, 0);
+
+    // Broadcast join notification
+    char join_msg[BUFFER_SIZE];
+    snprintf(join_msg, BUFFER_SIZE, "%s joined the chat", username);
+    broadcast_notification(join_msg);
+
+    // Frames the client sent right behind its AUTH line are served first
+    line_reader_t *reader = reader_with_leftover(client_socket, leftover, leftover_len);
+    if (reader == NULL) {
+        printf("[Thread %p] Out of memory for '%s'\n", (void*)pthread_self(), username);
+        remove_client(client_socket, 0);
+        close(client_socket);
+        return NULL;
+    }
+    serve_client(reader, username);
+    return NULL;
+}
+
+// Message loop for an authenticated client, followed by cleanup
+// Takes ownership of the reader; one read may carry several frames (or part
+// of one), so each is split out on its newline before it is parsed
+void serve_client(line_reader_t *reader, const char *username) {
+    // Phase 2: Message receiving loop
+    // Runs until the client leaves or the drain shuts this socket down
+    int client_socket = reader->fd;
+    char buffer[BUFFER_SIZE];
+
+    while (1) {
+        if (upgrade_in_progress) park_for_upgrade();
+
+        int valread = read_line(reader, buffer, sizeof(buffer));
+
+        // Interrupted so a hot upgrade can take over this socket
+        if (valread == -2) continue;
+
+        if (valread < 0) {
+            // Client disconnected
+            if (log_enabled(LOG_CONNECTIONS)) {
+                printf("[Thread %p] User '%s' disconnected\n", (void*)pthread_self(), username);
+            }
+            break;
+        }
+
+        // Parse message
+        message_t msg;
+        if (parse_message(buffer, &msg) == 0) {
+
+            if (msg.kind == TYPE_MSG) {
+                // Regular chat message
+                handle_chat_message(client_socket, 0, username, &msg);
+
+            } else if (handle_topic_request(client_socket, 0, username, &msg)) {
+                // Subscription change or topic publish
+
+            } else if (msg.kind == TYPE_SEARCH) {
+                // Full-text search over the room's journal
+                handle_search_request(client_socket, 0, &msg);
+
+            } else if (msg.kind == TYPE_SHM) {
+                // Co-located client asking for broadcasts over shared memory
+                attach_shm_ring(client_socket);
+
+            } else if (msg.kind == TYPE_DISCONNECT) {
+                // Client requesting disconnect
+                if (log_enabled(LOG_CONNECTIONS)) {
+                    printf("[Thread %p] User '%s' requested disconnect\n",
+                           (void*)pthread_self(), username);
+                }
+                break;
+            }
+        } else {
+            printf("[Thread %p] Failed to parse message from %s\n",
+                   (void*)pthread_self(), username);
+        }
+    }
+
+    // Phase 3: Cleanup
+    // Broadcast leave notification (not while draining - everyone is leaving)
+    if (server_running) {
+        char leave_msg[BUFFER_SIZE];
+        snprintf(leave_msg, BUFFER_SIZE, "%s left the chat", username);
+        broadcast_notification(leave_msg);
+    }
+
+    remove_client(client_socket, 0);
+    close(client_socket);
+    pool_free(reader);
+
+    if (log_enabled(LOG_CONNECTIONS)) {
+        printf("[Thread %p] Client handler for '%s' exiting\n", (void*)pthread_self(), username);
+    }
+}
+
+// Queue (or forward to the room owner) a chat message from an authenticated user
+// (channel is the gateway channel, 0 for a direct connection)
+void handle_chat_message(int socket_fd, int channel, const char *username, message_t *msg) {
+    const char *refused = screen_message(DEFAULT_ROOM, msg->content, username, 1);
+    if (refused != NULL) {
+        char reply[BUFFER_SIZE];
+        format_error_message(reply, refused);
+        reply_to_client(socket_fd, channel, reply);
+        return;
+    }
+
+    if (log_enabled(LOG_MESSAGES)) {
+        printf("[%s] %s\n", username, msg->content);
+    }
+
+    // Copy username to message (in case client sent wrong username)
+    strncpy(msg->sender, username, MAX_USERNAME - 1);
+
+    // Rooms owned by another node are sequenced there, and come
+    // back over the peer link for local fan-out
+    int routed = route_to_room_owner(DEFAULT_ROOM, msg);
+    if (routed < 0) {
+        printf("[Thread %p] Failed to forward message to room owner\n",
+               (void*)pthread_self());
+    } else if (routed == 0 && enqueue_for_broadcast(msg) != 0) {
+        printf("[Thread %p] Message queue full!\n", (void*)pthread_self());
+    }
+}
+
+// Make message content safe to deliver: scrub it in place, then apply the
+// content filter and, if count_repeats is set, the room's repeat sketch.
+// Shared by client and peer ingress. Returns NULL if the message may go out,
+// otherwise the reason it was refused (already logged)
+const char *screen_message(const char *room, char *content, const char *origin, int count_repeats) {
+    // Nothing unprintable reaches other terminals (or this one)
+    size_t scrubbed = scrub_message_content(content);
+    if (scrubbed > 0) {
+        printf("[Filter] Replaced %zu unsafe bytes in message from '%s'\n", scrubbed, origin);
+    }
+
+    const char *refused = NULL;
+    if (content_blocked(content)) {
+        refused = "Message blocked by content filter";
+    } else if (count_repeats && is_repeated_message(room, content)) {
+        refused = "Repeated message dropped";
+    }
+    if (refused != NULL) {
+        printf("[Filter] %s (from '%s' in %s)\n", refused, origin, room);
+    }
+    return refused;
+}
+
+// Create a connection's line reader, seeded with any frames that arrived in
+// the same read after the hello line (leftover may be NULL)
+line_reader_t *reader_with_leftover(int fd, const char *leftover, int leftover_len) {
+    line_reader_t *reader = pool_alloc();
+    if (reader == NULL) return NULL;
+    reader->fd = fd;
+
+    if (leftover != NULL && leftover_len > 0) {
+        reader->len = (size_t)leftover_len;
+        memcpy(reader->data, leftover, reader->len);
+    }
+    return reader;
+}
+
+// Send one copy of a broadcast frame to every gateway (caller holds clients_mutex)
+// Channel 0 tells the gateway to fan it out to all of its users
+void send_to_gateways(const char *frame, int flags) {
+    if (gateway_count == 0) return;
+
+    char wrapped[BUFFER_SIZE];
+    format_channel_frame(wrapped, 0, frame);
+    size_t len = strlen(wrapped);
+
+    for (int i = 0; i < gateway_count; i++) {
+        send_to_gateway(&gateways[i], wrapped, len, flags);
+    }
+}
+
+// Write one wrapped frame to a gateway link without blocking (caller holds
+// clients_mutex). As with peers, a link that cannot take the whole frame is
+// dropped rather than waited on: a partial CH: frame would garble every user
+// behind it. Its reader sees EOF and the gateway re-dials and resumes them
+int send_to_gateway(peer_info_t *gateway, const char *wrapped, size_t len, int flags) {
+    if (gateway->stalled) return -1;
+
+    ssize_t sent = send(gateway->socket_fd, wrapped, len, flags | MSG_DONTWAIT);
+    if (sent == (ssize_t)len) return 0;
+
+    if (sent < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
+        perror("[Gateway] Send failed");
+    } else {
+        printf("[Gateway] Link to gateway '%s' is not keeping up, dropping it\n", gateway->node_id);
+    }
+    gateway->stalled = 1;
+    shutdown(gateway->socket_fd, SHUT_RDWR);
+    return -1;
+}
+
+// Send a frame to one user behind a gateway (caller holds clients_mutex)
+void send_to_channel(int gateway_fd, int channel, const char *frame) {
+    char wrapped[BUFFER_SIZE];
+    format_channel_frame(wrapped, channel, frame);
+
+    for (int i = 0; i < gateway_count; i++) {
+        if (gateways[i].socket_fd == gateway_fd) {
+            send_to_gateway(&gateways[i], wrapped, strlen(wrapped), 0);
+            return;
+        }
+    }
+}
+
+// Register a gateway link (thread-safe)
+int add_gateway(int socket_fd, const char *gateway_id) {
+    pthread_mutex_lock(&clients_mutex);
+
+    if (gateway_count >= MAX_GATEWAYS) {
+        pthread_mutex_unlock(&clients_mutex);
+        return -1;
+    }
+
+    gateways[gateway_count].socket_fd = socket_fd;
+    strncpy(gateways[gateway_count].node_id, gateway_id, MAX_USERNAME - 1);
+    gateways[gateway_count].node_id[MAX_USERNAME - 1] = '\0';
+    gateways[gateway_count].stalled = 0;
+    gateways[gateway_count].reader_thread = pthread_self();
+    gateway_count++;
+
+    printf("[Gateway] Gateway '%s' connected. Total gateways: %d\n", gateway_id, gateway_count);
+
+    pthread_mutex_unlock(&clients_mutex);
+    return 0;
+}
+
+// Remove a gateway link and every user behind it (thread-safe)
+void remove_gateway(int socket_fd) {
+    char left[MAX_CLIENTS][MAX_USERNAME];
+    int left_channels[MAX_CLIENTS];
+    int left_count = 0;
+
+    pthread_mutex_lock(&clients_mutex);
+
+    for (int i = 0; i < gateway_count; i++) {
+        if (gateways[i].socket_fd == socket_fd) {
+            printf("[Gateway] Gateway '%s' disconnected\n", gateways[i].node_id);
+            for (int j = i; j < gateway_count - 1; j++) {
+                gateways[j] = gateways[j + 1];
+            }
+            gateway_count--;
+            break;
+        }
+    }
+
+    int kept = 0;
+    for (int i = 0; i < client_count; i++) {
+        if (clients[i].socket_fd == socket_fd && clients[i].channel != 0) {
+            left_channels[left_count] = clients[i].channel;
+            snprintf(left[left_count++], MAX_USERNAME, "%s", username_of(clients[i].user_id));
+            release_username(clients[i].user_id);
+        } else {
+            clients[kept++] = clients[i];
+        }
+    }
+    client_count = kept;
+
+    pthread_mutex_unlock(&clients_mutex);
+
+    for (int i = 0; i < left_count; i++) {
+        unsubscribe_all(socket_fd, left_channels[i]);
+    }
+
+    for (int i = 0; i < left_count && server_running; i++) {
+        char leave_msg[BUFFER_SIZE];
+        snprintf(leave_msg, BUFFER_SIZE, "%.*s left the chat", MAX_USERNAME - 1, left[i]);
+        broadcast_notification(leave_msg);
+    }
+}
+
+// Authenticate a user arriving on a gateway channel
+// A resumed login (the gateway reconnected) gets no scrollback or join notice
+void authenticate_channel(int gateway_fd, int channel, const char *username, int resume) {
+    const char *failure = NULL;
+    if (!validate_username(username)) {
+        failure = AUTH_FAILED_INVALID;
+    } else if (username_exists(username)) {
+        failure = AUTH_FAILED;
+    } else if (add_client(gateway_fd, channel, username) != 0) {
+        failure = SERVER_FULL;
+    }
+
+    pthread_mutex_lock(&clients_mutex);
+    if (failure != NULL) {
+        // Reply, then close the channel so the gateway drops the user
+        send_to_channel(gateway_fd, channel, failure);
+        send_to_channel(gateway_fd, channel, "");
+    } else {
+        send_to_channel(gateway_fd, channel, AUTH_OK);
+    }
+    pthread_mutex_unlock(&clients_mutex);
+
+    if (failure != NULL) {
+        printf("[Gateway] Rejected '%s' on channel %d: %s\n", username, channel, failure);
+        return;
+    }
+    if (resume) {
+        if (log_enabled(LOG_CONNECTIONS)) {
+            printf("[Gateway] Resumed '%s' on channel %d\n", username, channel);
+        }
+        return;
+    }
+
+    replay_history(gateway_fd, channel);
+
+    char join_msg[BUFFER_SIZE];
+    snprintf(join_msg, BUFFER_SIZE, "%s joined the chat", username);
+    broadcast_notification(join_msg);
+}
+
+// Service a gateway link until it closes, treating each channel as a user
+void run_gateway_link(line_reader_t *reader, const char *gateway_id) {
+    int gateway_fd = reader->fd;
+    if (add_gateway(gateway_fd, gateway_id) != 0) {
+        printf("[Gateway] Rejecting gateway '%s'\n", gateway_id);
+        close(gateway_fd);
+        return;
+    }
+
+    char line[BUFFER_SIZE];
+    while (1) {
+        // A hot upgrade stops this link's ingress before draining the queue
+        if (upgrade_in_progress) park_for_upgrade();
+
+        int len = read_line(reader, line, sizeof(line));
+        if (len == -2) continue;
+        if (len < 0) break;
+
+        int channel;
+        const char *frame;
+        if (parse_channel_frame(line, &channel, &frame) != 0 || channel == 0) {
+            printf("[Gateway] Bad frame from '%s'\n", gateway_id);
+            continue;
+        }
+
+        char username[MAX_USERNAME] = {0};
+        pthread_mutex_lock(&clients_mutex);
+        int index = find_client_index(gateway_fd, channel);
+        if (index >= 0) {
+            strncpy(username, username_of(clients[index].user_id), MAX_USERNAME - 1);
+        }
+        pthread_mutex_unlock(&clients_mutex);
+
+        message_t msg;
+        int parsed = frame[0] != '\0' ? parse_message(frame, &msg) : -1;
+
+        if (index < 0) {
+            // First frame on a channel must be AUTH
+            if (parsed == 0 && msg.kind == TYPE_AUTH) {
+                authenticate_channel(gateway_fd, channel, msg.sender, is_resume_auth(frame));
+            }
+            continue;
+        }
+
+        if (frame[0] == '\0' || (parsed == 0 && msg.kind == TYPE_DISCONNECT)) {
+            // User left the gateway
+            remove_client(gateway_fd, channel);
+            if (server_running) {
+                char leave_msg[BUFFER_SIZE];
+                snprintf(leave_msg, BUFFER_SIZE, "%s left the chat", username);
+                broadcast_notification(leave_msg);
+            }
+        } else if (parsed == 0 && msg.kind == TYPE_MSG) {
+            handle_chat_message(gateway_fd, channel, username, &msg);
+        } else if (parsed == 0 && msg.kind == TYPE_SEARCH) {
+            handle_search_request(gateway_fd, channel, &msg);
+        } else if (parsed == 0) {
+            handle_topic_request(gateway_fd, channel, username, &msg);
+        }
+    }
+
+    remove_gateway(gateway_fd);
+    close(gateway_fd);
+}
+
+// Split a topic or pattern into its dot-separated segments
+// Returns the number of segments (inputs are already validated)
+int split_topic(const char *topic, char segments[][MAX_TOPIC]) {
+    int count = 0;
+    const char *start = topic;
+    while (count < MAX_TOPIC_DEPTH) {
+        const char *dot = strchr(start, '.');
+        size_t len = dot != NULL ? (size_t)(dot - start) : strlen(start);
+        memcpy(segments[count], start, len);
+        segments[count][len] = '\0';
+        count++;
+        if (dot == NULL) break;
+        start = dot + 1;
+    }
+    return count;
+}
+
+// Find (or create) the child of a trie node for one segment (caller holds topics_mutex)
+topic_node_t *topic_child(topic_node_t *node, const char *segment, int create) {
+    uint32_t hash = hash_bytes(segment, strlen(segment));
+    if (node->bucket_count > 0) {
+        topic_node_t *child = node->buckets[hash & (uint32_t)(node->bucket_count - 1)];
+        for (; child != NULL; child = child->next) {
+            if (child->hash == hash && strcmp(child->segment, segment) == 0) return child;
+        }
+    }
+    if (!create) return NULL;
+
+    // Keep chains short: double the table once it holds a child per bucket
+    if (node->child_count >= node->bucket_count) {
+        int bucket_count = node->bucket_count ? node->bucket_count * 2 : 4;
+        topic_node_t **buckets = calloc((size_t)bucket_count, sizeof(topic_node_t *));
+        if (buckets == NULL) return NULL;
+        for (int b = 0; b < node->bucket_count; b++) {
+            topic_node_t *child = node->buckets[b];
+            while (child != NULL) {
+                topic_node_t *next = child->next;
+                topic_node_t **head = &buckets[child->hash & (uint32_t)(bucket_count - 1)];
+                child->next = *head;
+                *head = child;
+                child = next;
+            }
+        }
+        free(node->buckets);
+        node->buckets = buckets;
+        node->bucket_count = bucket_count;
+    }
+
+    topic_node_t *child = calloc(1, sizeof(topic_node_t));
+    if (child == NULL) return NULL;
+    strncpy(child->segment, segment, MAX_TOPIC - 1);
+    child->hash = hash;
+    child->parent = node;
+    topic_node_t **head = &node->buckets[hash & (uint32_t)(node->bucket_count - 1)];
+    child->next = *head;
+    *head = child;
+    node->child_count++;
+    return child;
+}
+
+// Free a node left without subscribers or children, then each ancestor that
+// this leaves empty, up to the root (caller holds topics_mutex)
+void prune_topic_path(topic_node_t *node) {
+    while (node != &topic_root && node->subscriber_count == 0 && node->child_count == 0) {
+        topic_node_t *parent = node->parent;
+        topic_node_t **link = &parent->buckets[node->hash & (uint32_t)(parent->bucket_count - 1)];
+        while (*link != node) link = &(*link)->next;
+        *link = node->next;
+        parent->child_count--;
+
+        free(node->buckets);
+        free(node->subscribers);
+        free(node);
+        node = parent;
+    }
+}
+
+// Find (or create) the subscription record of a client (caller holds topics_mutex)
+topic_client_t *find_topic_client(int socket_fd, int channel, int create) {
+    uint32_t bucket = ((uint32_t)socket_fd * 2654435761u ^ (uint32_t)channel) &
+                      (TOPIC_CLIENT_BUCKETS - 1);
+    for (topic_client_t *client = topic_clients[bucket]; client != NULL; client = client->next) {
+        if (client->socket_fd == socket_fd && client->channel == channel) return client;
+    }
+    if (!create) return NULL;
+
+    topic_client_t *client = calloc(1, sizeof(topic_client_t));
+    if (client == NULL) return NULL;
+    client->socket_fd = socket_fd;
+    client->channel = channel;
+    client->next = topic_clients[bucket];
+    topic_clients[bucket] = client;
+    return client;
+}
+
+// Free a client's record once it holds no patterns (caller holds topics_mutex)
+void release_topic_client(topic_client_t *client) {
+    if (client->pattern_count > 0) return;
+
+    uint32_t bucket = ((uint32_t)client->socket_fd * 2654435761u ^ (uint32_t)client->channel) &
+                      (TOPIC_CLIENT_BUCKETS - 1);
+    topic_client_t **link = &topic_clients[bucket];
+    while (*link != client) link = &(*link)->next;
+    *link = client->next;
+    free(client);
+}
+
+// Subscribe a client to a pattern (thread-safe)
+// Returns 0 on success, 1 if already subscribed, -1 at the subscription limit
+// or when out of memory
+int subscribe_topic(int socket_fd, int channel, const char *pattern) {
+    char segments[MAX_TOPIC_DEPTH][MAX_TOPIC];
+    int count = split_topic(pattern, segments);
+    int result = -1;
+
+    pthread_mutex_lock(&topics_mutex);
+
+    topic_client_t *client = find_topic_client(socket_fd, channel, 1);
+    if (client == NULL) {
+        pthread_mutex_unlock(&topics_mutex);
+        return -1;
+    }
+    for (int i = 0; i < client->pattern_count; i++) {
+        if (strcmp(client->patterns[i], pattern) == 0) {
+            pthread_mutex_unlock(&topics_mutex);
+            return 1;
+        }
+    }
+
+    topic_node_t *node = &topic_root;
+    topic_node_t *parent = node;
+    for (int i = 0; i < count && node != NULL; i++) {
+        parent = node;
+        node = topic_child(node, segments[i], 1);
+    }
+
+    if (node != NULL && client->pattern_count < MAX_SUBSCRIPTIONS) {
+        if (node->subscriber_count == node->subscriber_capacity) {
+            int capacity = node->subscriber_capacity ? node->subscriber_capacity * 2 : 4;
+            topic_client_t **grown = realloc(node->subscribers,
+                                             (size_t)capacity * sizeof(topic_client_t *));
+            if (grown != NULL) {
+                node->subscribers = grown;
+                node->subscriber_capacity = capacity;
+            }
+        }
+        if (node->subscriber_count < node->subscriber_capacity) {
+            node->subscribers[node->subscriber_count++] = client;
+            strncpy(client->patterns[client->pattern_count++], pattern, MAX_TOPIC - 1);
+            result = 0;
+        }
+    }
+
+    // Undo whatever a failed subscription created
+    if (result != 0) {
+        prune_topic_path(node != NULL ? node : parent);
+        release_topic_client(client);
+    }
+
+    pthread_mutex_unlock(&topics_mutex);
+    return result;
+}
+
+// Remove one of a client's patterns from the trie, freeing only the nodes on
+// that pattern's path left empty (caller holds topics_mutex)
+// Returns 0 on success, -1 if the client did not hold the pattern
+int remove_subscription(topic_client_t *client, const char *pattern) {
+    int slot = -1;
+    for (int i = 0; i < client->pattern_count && slot < 0; i++) {
+        if (strcmp(client->patterns[i], pattern) == 0) slot = i;
+    }
+    if (slot < 0) return -1;
+
+    char segments[MAX_TOPIC_DEPTH][MAX_TOPIC];
+    int count = split_topic(pattern, segments);
+    topic_node_t *node = &topic_root;
+    for (int i = 0; i < count && node != NULL; i++) {
+        node = topic_child(node, segments[i], 0);
+    }
+
+    for (int i = 0; node != NULL && i < node->subscriber_count; i++) {
+        if (node->subscribers[i] == client) {
+            node->subscribers[i] = node->subscribers[--node->subscriber_count];
+            prune_topic_path(node);
+            break;
+        }
+    }
+
+    client->pattern_count--;
+    if (slot != client->pattern_count) {
+        memcpy(client->patterns[slot], client->patterns[client->pattern_count], MAX_TOPIC);
+    }
+    return 0;
+}
+
+// Unsubscribe a client from one pattern (thread-safe)
+// Returns 0 on success, -1 if it was not subscribed
+int unsubscribe_topic(int socket_fd, int channel, const char *pattern) {
+    pthread_mutex_lock(&topics_mutex);
+
+    int result = -1;
+    topic_client_t *client = find_topic_client(socket_fd, channel, 0);
+    if (client != NULL) {
+        result = remove_subscription(client, pattern);
+        release_topic_client(client);
+    }
+
+    pthread_mutex_unlock(&topics_mutex);
+    return result;
+}
+
+// Drop every subscription a departing client held (thread-safe)
+void unsubscribe_all(int socket_fd, int channel) {
+    pthread_mutex_lock(&topics_mutex);
+
+    topic_client_t *client = find_topic_client(socket_fd, channel, 0);
+    if (client != NULL) {
+        while (client->pattern_count > 0) {
+            remove_subscription(client, client->patterns[client->pattern_count - 1]);
+        }
+        release_topic_client(client);
+    }
+
+    pthread_mutex_unlock(&topics_mutex);
+}
+
+// Add a node's subscribers not yet collected in this match pass
+// (caller holds topics_mutex)
+void collect_subscribers(const topic_node_t *node, subscriber_t *matches, int *match_count) {
+    for (int i = 0; i < node->subscriber_count; i++) {
+        topic_client_t *client = node->subscribers[i];
+        if (client->mark == match_pass || *match_count >= MAX_CLIENTS) continue;
+        client->mark = match_pass;
+        matches[*match_count].socket_fd = client->socket_fd;
+        matches[*match_count].channel = client->channel;
+        (*match_count)++;
+    }
+}
+
+// Collect subscribers whose pattern matches segments[depth..count) below a node
+// (caller holds topics_mutex and has started a new match_pass)
+void match_topic(const topic_node_t *node, char segments[][MAX_TOPIC], int depth,
+                 int count, subscriber_t *matches, int *match_count) {
+    if (depth == count) {
+        collect_subscribers(node, matches, match_count);
+    }
+
+    // # matches everything from here on, including nothing
+    const topic_node_t *child = topic_child((topic_node_t *)node, "#", 0);
+    if (child != NULL) {
+        collect_subscribers(child, matches, match_count);
+    }
+    if (depth == count) return;
+
+    child = topic_child((topic_node_t *)node, segments[depth], 0);
+    if (child != NULL) {
+        match_topic(child, segments, depth + 1, count, matches, match_count);
+    }
+    child = topic_child((topic_node_t *)node, "*", 0);
+    if (child != NULL) {
+        match_topic(child, segments, depth + 1, count, matches, match_count);
+    }
+}
+
+// Start a new match pass, so each client is collected at most once by it
+// (caller holds topics_mutex)
+void begin_match_pass(void) {
+    if (++match_pass == 0) {
+        // Wrapped: clear every stamp so none can equal a future pass
+        for (int b = 0; b < TOPIC_CLIENT_BUCKETS; b++) {
+            for (topic_client_t *client = topic_clients[b]; client != NULL; client = client->next) {
+                client->mark = 0;
+            }
+        }
+        match_pass = 1;
+    }
+}
+
+// Non-zero if a local client is subscribed to a pattern matching topic
+// (takes topics_mutex; the sketch sweep calls it under sketches_mutex)
+int topic_has_subscribers(const char *topic) {
+    char segments[MAX_TOPIC_DEPTH][MAX_TOPIC];
+    int count = split_topic(topic, segments);
+
+    subscriber_t matches[MAX_CLIENTS];
+    int match_count = 0;
+    pthread_mutex_lock(&topics_mutex);
+    begin_match_pass();
+    match_topic(&topic_root, segments, 0, count, matches, &match_count);
+    pthread_mutex_unlock(&topics_mutex);
+    return match_count > 0;
+}
+
+// Send a published frame to every local client subscribed to a matching pattern
+void deliver_to_subscribers(const char *topic, const char *frame) {
+    char segments[MAX_TOPIC_DEPTH][MAX_TOPIC];
+    int count = split_topic(topic, segments);
+
+    subscriber_t matches[MAX_CLIENTS];
+    int match_count = 0;
+    pthread_mutex_lock(&topics_mutex);
+    begin_match_pass();
+    match_topic(&topic_root, segments, 0, count, matches, &match_count);
+    pthread_mutex_unlock(&topics_mutex);
+
+    size_t len = strlen(frame);
+    pthread_mutex_lock(&clients_mutex);
+    for (int i = 0; i < match_count; i++) {
+        int index = find_client_index(matches[i].socket_fd, matches[i].channel);
+        if (index < 0 || clients[index].shed) continue;
+        send_status_t status = send_frame(&clients[index], frame, len, 0);
+        if (status != SEND_OK) send_failed(&clients[index], status);
+    }
+    pthread_mutex_unlock(&clients_mutex);
+}
+
+// Send a frame to one client, direct or behind a gateway
+void reply_to_client(int socket_fd, int channel, const char *frame) {
+    pthread_mutex_lock(&clients_mutex);
+    int index = find_client_index(socket_fd, channel);
+    if (index >= 0) {
+        send_frame(&clients[index], frame, strlen(frame), 0);
+    }
+    pthread_mutex_unlock(&clients_mutex);
+}
+
+// Handle SUB, UNSUB and PUB from an authenticated client
+// Returns 1 if the message was a topic request, 0 otherwise
+int handle_topic_request(int socket_fd, int channel, const char *username, message_t *msg) {
+    char reply[BUFFER_SIZE];
+    char text[MAX_MESSAGE];
+
+    if (msg->kind == TYPE_SUB) {
+        int result = validate_topic(msg->topic, 1) ? subscribe_topic(socket_fd, channel, msg->topic) : -2;
+        if (result == -2) {
+            format_error_message(reply, "Invalid topic pattern");
+        } else if (result < 0) {
+            snprintf(text, sizeof(text), "Subscription limit reached (%d)", MAX_SUBSCRIPTIONS);
+            format_error_message(reply, text);
+        } else {
+            snprintf(text, sizeof(text), "Subscribed to %s", msg->topic);
+            format_notification(reply, text);
+            if (log_enabled(LOG_MESSAGES)) {
+                printf("[Topics] '%s' subscribed to %s\n", username, msg->topic);
+            }
+        }
+        reply_to_client(socket_fd, channel, reply);
+        return 1;
+    }
+
+    if (msg->kind == TYPE_UNSUB) {
+        if (validate_topic(msg->topic, 1) && unsubscribe_topic(socket_fd, channel, msg->topic) == 0) {
+            snprintf(text, sizeof(text), "Unsubscribed from %s", msg->topic);
+            format_notification(reply, text);
+            if (log_enabled(LOG_MESSAGES)) {
+                printf("[Topics] '%s' unsubscribed from %s\n", username, msg->topic);
+            }
+        } else {
+            format_error_message(reply, "Not subscribed to that pattern");
+        }
+        reply_to_client(socket_fd, channel, reply);
+        return 1;
+    }
+
+    if (msg->kind == TYPE_PUB) {
+        if (!validate_topic(msg->topic, 0) || !validate_message_content(msg->content)) {
+            format_error_message(reply, "Invalid topic or message");
+            reply_to_client(socket_fd, channel, reply);
+            return 1;
+        }
+
+        const char *refused = screen_message(msg->topic, msg->content, username, 1);
+        if (refused != NULL) {
+            format_error_message(reply, refused);
+            reply_to_client(socket_fd, channel, reply);
+            return 1;
+        }
+
+        // Each topic is sequenced by the node owning it on the ring, like a room
+        strncpy(msg->sender, username, MAX_USERNAME - 1);
+        msg->remote = 0;
+        int routed = route_to_room_owner(msg->topic, msg);
+        if (routed < 0) {
+            printf("[Thread %p] Failed to forward publish to topic owner\n", (void*)pthread_self());
+        } else if (routed == 0 && enqueue_for_broadcast(msg) != 0) {
+            printf("[Thread %p] Message queue full!\n", (void*)pthread_self());
+        }
+        return 1;
+    }
+
+    return 0;
+}
+
+// Sketch slot for a room (caller holds sketches_mutex)
+// The table is kept at most 3/4 full so probes stay short and always end;
+// rooms beyond that share their home slot, which only adds false positives
+room_sketch_t *find_room_sketch(const char *room, long long now) {
+    uint32_t hash = hash_bytes(room, strlen(room));
+    uint32_t slot = hash & (MAX_ROOMS - 1);
+    for (; sketches[slot].room[0] != '\0'; slot = (slot + 1) & (MAX_ROOMS - 1)) {
+        if (sketches[slot].hash == hash && strcmp(sketches[slot].room, room) == 0) {
+            return &sketches[slot];
+        }
+    }
+
+    if (sketch_count >= MAX_ROOMS * 3 / 4 && now - sketches_swept_ms >= 1000) {
+        sketches_swept_ms = now;
+        if (reclaim_room_sketches(now) > 0) return find_room_sketch(room, now);
+    }
+    if (sketch_count >= MAX_ROOMS * 3 / 4) return &sketches[hash & (MAX_ROOMS - 1)];
+
+    room_sketch_t *sketch = &sketches[slot];
+    memset(sketch, 0, sizeof(*sketch));
+    strncpy(sketch->room, room, MAX_TOPIC - 1);
+    sketch->hash = hash;
+    sketch->rotated_ms = now;
+    sketch_count++;
+    return sketch;
+}
+
+// Empty a slot, pulling later entries of its probe run back so lookups never
+// stop early at the hole (caller holds sketches_mutex)
+void remove_room_sketch(uint32_t slot) {
+    uint32_t hole = slot;
+    for (uint32_t i = (slot + 1) & (MAX_ROOMS - 1); sketches[i].room[0] != '\0';
+         i = (i + 1) & (MAX_ROOMS - 1)) {
+        // An entry may fill the hole only if its home slot is not after the hole
+        uint32_t home = sketches[i].hash & (MAX_ROOMS - 1);
+        if (((i - home) & (MAX_ROOMS - 1)) >= ((i - hole) & (MAX_ROOMS - 1))) {
+            sketches[hole] = sketches[i];
+            hole = i;
+        }
+    }
+    sketches[hole].room[0] = '\0';
+    sketch_count--;
+}
+
+// Free sketches idle for two windows; if that frees nothing, also
+// those of topics with no local subscriber that this node does not sequence
+// for the cluster (caller holds sketches_mutex, at most once a second).
+// Returns how many were freed
+int reclaim_room_sketches(long long now) {
+    long long idle_ms = 2 * __atomic_load_n(&spam.window, __ATOMIC_RELAXED) * 1000LL;
+    int freed = 0;
+    for (int pass = 0; pass < 2 && freed == 0; pass++) {
+        for (uint32_t i = 0; i < MAX_ROOMS; ) {
+            const room_sketch_t *sketch = &sketches[i];
+            int idle = sketch->room[0] != '\0' && now - sketch->used_ms >= idle_ms;
+            int unheard = pass == 1 && sketch->room[0] != '\0' &&
+                          strcmp(sketch->room, DEFAULT_ROOM) != 0 &&
+                          !topic_has_subscribers(sketch->room) &&
+                          !room_sequenced_for_peers(sketch->room);
+            if (idle || unheard) {
+                remove_room_sketch(i);  // Another entry may now sit at i
+                freed++;
+            } else {
+                i++;
+            }
+        }
+    }
+    return freed;
+}
+
+// Count one more copy of content in room; non-zero if that makes more than
+// spam.repeats copies within the window. Case and spaces are ignored, so
+// padding a line does not get it past the check
+int is_repeated_message(const char *room, const char *content) {
+    int repeats = __atomic_load_n(&spam.repeats, __ATOMIC_RELAXED);
+    if (repeats == 0) return 0;
+
+    char folded[MAX_MESSAGE];
+    size_t len = 0;
+    for (const char *c = content; *c != '\0' && len < sizeof(folded); c++) {
+        if (*c == ' ') continue;
+        folded[len++] = (*c >= 'A' && *c <= 'Z') ? (char)(*c + ('a' - 'A')) : *c;
+    }
+
+    // Row positions by double hashing one 32-bit fingerprint
+    uint32_t h1 = hash_bytes(folded, len);
+    uint32_t h2 = (h1 * 0x9e3779b1u) | 1;
+    uint32_t slots[SKETCH_DEPTH];
+    for (int row = 0; row < SKETCH_DEPTH; row++) {
+        slots[row] = (h1 + (uint32_t)row * h2) & (SKETCH_WIDTH - 1);
+    }
+
+    long long now = monotonic_ms();
+    long long half = __atomic_load_n(&spam.window, __ATOMIC_RELAXED) * 1000LL / 2;
+
+    pthread_mutex_lock(&sketches_mutex);
+    room_sketch_t *sketch = find_room_sketch(room, now);
+    sketch->used_ms = now;
+
+    // Slide the window: the older generation is recycled as the current one
+    if (now - sketch->rotated_ms >= half) {
+        int stale = now - sketch->rotated_ms >= 2 * half;  // Both are out of the window
+        sketch->current ^= 1;
+        memset(sketch->counts[sketch->current], 0, sizeof(sketch->counts[0]));
+        if (stale) {
+            memset(sketch->counts[sketch->current ^ 1], 0, sizeof(sketch->counts[0]));
+        }
+        sketch->rotated_ms = now;
+    }
+
+    // Count-min estimate over both generations, with a conservative update:
+    // only the rows at the minimum grow, which keeps overestimates down
+    uint8_t (*current)[SKETCH_WIDTH] = sketch->counts[sketch->current];
+    uint8_t (*previous)[SKETCH_WIDTH] = sketch->counts[sketch->current ^ 1];
+    int seen = 255;
+    int fresh = 255;
+    for (int row = 0; row < SKETCH_DEPTH; row++) {
+        int total = current[row][slots[row]] + previous[row][slots[row]];
+        if (total < seen) seen = total;
+        if (current[row][slots[row]] < fresh) fresh = current[row][slots[row]];
+    }
+    for (int row = 0; row < SKETCH_DEPTH; row++) {
+        if (current[row][slots[row]] == fresh && fresh < 255) current[row][slots[row]]++;
+    }
+    pthread_mutex_unlock(&sketches_mutex);
+
+    return seen >= repeats;
+}
+
+// Compile the patterns in path (one per line, case-insensitive; blank lines
+// and lines starting with '#' are skipped) into an Aho-Corasick DFA
+content_filter_t *build_content_filter(const char *path) {
+    FILE *file = fopen(path, "r");
+    if (file == NULL) {
+        perror("[Filter] Cannot open pattern file");
+        return NULL;
+    }
+
+    content_filter_t *filter = calloc(1, sizeof(content_filter_t));
+    char (*patterns)[MAX_MESSAGE] = NULL;
+    int capacity = 0;
+    int max_states = 1;
+    char line[BUFFER_SIZE];
+
+    // Pass 1: collect patterns and assign an input class to each byte used
+    while (filter != NULL && fgets(line, sizeof(line), file) != NULL) {
+        // A line that overflows the buffer is longer than any message; skip
+        // all of it, or its tail would be read as a pattern of its own
+        size_t len = strlen(line);
+        if (len > 0 && line[len - 1] != '\n' && !feof(file)) {
+            int c;
+            while ((c = getc(file)) != EOF && c != '\n') {}
+            continue;
+        }
+        line[strcspn(line, "\r\n")] = '\0';
+        if (line[0] == '\0' || line[0] == '#') continue;
+        if (strlen(line) >= MAX_MESSAGE) continue;  // Could never match a message
+
+        if (filter->pattern_count == capacity) {
+            capacity = capacity ? capacity * 2 : 64;
+            void *grown = realloc(patterns, (size_t)capacity * MAX_MESSAGE);
+            if (grown == NULL) break;
+            patterns = grown;
+        }
+
+        char *pattern = patterns[filter->pattern_count++];
+        for (int i = 0; ; i++) {
+            unsigned char c = (unsigned char)line[i];
+            if (c >= 'A' && c <= 'Z') c += 'a' - 'A';
+            pattern[i] = (char)c;
+            if (c == '\0') break;
+
+            if (filter->class_of[c] == 0) {
+                filter->class_of[c] = (uint8_t)++filter->class_count;
+                if (c >= 'a' && c <= 'z') filter->class_of[c - ('a' - 'A')] = filter->class_of[c];
+            }
+            max_states++;
+        }
+    }
+    fclose(file);
+
+    int classes = filter != NULL ? filter->class_count + 1 : 0;  // Class 0: bytes in no pattern
+    int32_t *fail = malloc((size_t)max_states * sizeof(int32_t));
+    int32_t *queue = malloc((size_t)max_states * sizeof(int32_t));
+    if (filter != NULL) {
+        filter->next = malloc((size_t)max_states * classes * sizeof(int32_t));
+        filter->accepts = calloc((size_t)max_states, 1);
+    }
+    if (filter == NULL || fail == NULL || queue == NULL ||
+        filter->next == NULL || filter->accepts == NULL) {
+        fprintf(stderr, "[Filter] Out of memory compiling %s\n", path);
+        free(patterns);
+        free(fail);
+        free(queue);
+        free_content_filter(filter);
+        return NULL;
+    }
+
+    // Pass 2: build the trie (-1 marks a missing edge)
+    memset(filter->next, 0xff, (size_t)max_states * classes * sizeof(int32_t));
+    filter->state_count = 1;
+    for (int p = 0; p < filter->pattern_count; p++) {
+        int32_t state = 0;
+        for (const unsigned char *c = (const unsigned char *)patterns[p]; *c != '\0'; c++) {
+            int32_t *edge = &filter->next[state * classes + filter->class_of[*c]];
+            if (*edge < 0) *edge = filter->state_count++;
+            state = *edge;
+        }
+        filter->accepts[state] = 1;
+    }
+    free(patterns);
+
+    // Pass 3: breadth-first, fill each missing edge with its failure
+    // state's edge, turning the trie into a complete DFA
+    int head = 0, tail = 0;
+    fail[0] = 0;
+    for (int c = 0; c < classes; c++) {
+        int32_t child = filter->next[c];
+        if (child < 0) {
+            filter->next[c] = 0;
+        } else {
+            fail[child] = 0;
+            queue[tail++] = child;
+        }
+    }
+    while (head < tail) {
+        int32_t state = queue[head++];
+        int32_t *edges = &filter->next[state * classes];
+        const int32_t *fallback = &filter->next[fail[state] * classes];
+
+        filter->accepts[state] |= filter->accepts[fail[state]];
+        for (int c = 0; c < classes; c++) {
+            if (edges[c] < 0) {
+                edges[c] = fallback[c];
+            } else {
+                fail[edges[c]] = fallback[c];
+                queue[tail++] = edges[c];
+            }
+        }
+    }
+    free(fail);
+    free(queue);
+
+    return filter;
+}
+
+// Free a compiled filter (NULL is fine)
+void free_content_filter(content_filter_t *filter) {
+    if (filter == NULL) return;
+    free(filter->next);
+    free(filter->accepts);
+    free(filter);
+}
+
+// Publish a new filter (NULL disables filtering) and free the old one once
+// no reader can still be using it. Only the reloading thread waits
+void swap_content_filter(content_filter_t *filter) {
+    pthread_mutex_lock(&filter_mutex);
+    content_filter_t *old = __atomic_exchange_n(&active_filter, filter, __ATOMIC_SEQ_CST);
+
+    // A reader that sampled the epoch just before a flip may register on the
+    // old counter after the first wait, so flip and drain twice
+    for (int round = 0; round < 2; round++) {
+        unsigned idx = __atomic_fetch_add(&filter_epoch, 1, __ATOMIC_SEQ_CST) & 1;
+        while (__atomic_load_n(&filter_readers[idx], __ATOMIC_SEQ_CST) != 0) {
+            usleep(100);
+        }
+    }
+    pthread_mutex_unlock(&filter_mutex);
+
+    free_content_filter(old);
+}
+
+// (Re)compile the -F pattern file and swap it in; a bad file keeps the old filter
+int load_content_filter(void) {
+    if (filter_path[0] == '\0') return 0;
+
+    content_filter_t *filter = build_content_filter(filter_path);
+    if (filter == NULL) {
+        printf("[Filter] Keeping the previous patterns\n");
+        return -1;
+    }
+
+    printf("[Filter] Loaded %d pattern(s) from %s (%d states, %d byte classes)\n",
+           filter->pattern_count, filter_path, filter->state_count, filter->class_count);
+    swap_content_filter(filter);
+    return 0;
+}
+
+// Non-zero if text contains any filter pattern
+int content_blocked(const char *text) {
+    unsigned idx = __atomic_load_n(&filter_epoch, __ATOMIC_SEQ_CST) & 1;
+    __atomic_add_fetch(&filter_readers[idx], 1, __ATOMIC_SEQ_CST);
+
+    int blocked = 0;
+    const content_filter_t *filter = __atomic_load_n(&active_filter, __ATOMIC_SEQ_CST);
+    if (filter != NULL) {
+        const int classes = filter->class_count + 1;
+        int32_t state = 0;
+        for (const unsigned char *c = (const unsigned char *)text; *c != '\0'; c++) {
+            state = filter->next[state * classes + filter->class_of[*c]];
+            if (filter->accepts[state]) {
+                blocked = 1;
+                break;
+            }
+        }
+    }
+
+    __atomic_sub_fetch(&filter_readers[idx], 1, __ATOMIC_RELEASE);
+    return blocked;
+}
+
+#ifdef CHAT_TLS
+// Load the certificate and key and enable kernel TLS offload
+int create_tls_context(const char *cert_file, const char *key_file) {
+    tls_ctx = SSL_CTX_new(TLS_server_method());
+    if (tls_ctx == NULL) return -1;
+
+    SSL_CTX_set_min_proto_version(tls_ctx, TLS1_2_VERSION);
+    SSL_CTX_set_options(tls_ctx, SSL_OP_ENABLE_KTLS);
+
+    // No resumption tickets: nothing is written after the handshake, so the
+    // socket is plain application data once the keys are in the kernel
+    SSL_CTX_set_num_tickets(tls_ctx, 0);
+
+    if (SSL_CTX_use_certificate_chain_file(tls_ctx, cert_file) != 1 ||
+        SSL_CTX_use_PrivateKey_file(tls_ctx, key_file, SSL_FILETYPE_PEM) != 1 ||
+        SSL_CTX_check_private_key(tls_ctx) != 1) {
+        ERR_print_errors_fp(stderr);
+        SSL_CTX_free(tls_ctx);
+        tls_ctx = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+// Run the server side of the handshake on a new connection
+// Returns the fd to serve the client on, or -1 (the socket is closed)
+int tls_accept(int client_socket) {
+    SSL *ssl = SSL_new(tls_ctx);
+    if (ssl == NULL || SSL_set_fd(ssl, client_socket) != 1 || SSL_accept(ssl) != 1) {
+        printf("[TLS] Handshake failed on socket %d\n", client_socket);
+        ERR_clear_error();
+        SSL_free(ssl);
+        close(client_socket);
+        return -1;
+    }
+
+    int offloaded = tls_kernel_offloaded(ssl);
+    const char *version = SSL_get_version(ssl);
+    int fd = tls_finish(ssl, client_socket);
+    if (fd >= 0) {
+        printf("[TLS] %s session on socket %d (%s)\n", version, client_socket,
+               offloaded ? "kTLS" : "user-space fallback");
+    }
+    return fd;
+}
+
+// A TCP connection that is not encrypted. kTLS sockets, including ones
+// inherited mid-login through a hot upgrade, carry the "tls" ULP
+int plaintext_tcp(int socket_fd) {
+    struct sockaddr_storage addr;
+    socklen_t addr_len = sizeof(addr);
+    if (getsockname(socket_fd, (struct sockaddr *)&addr, &addr_len) != 0 ||
+        (addr.ss_family != AF_INET && addr.ss_family != AF_INET6)) {
+        return 0;
+    }
+#ifdef TCP_ULP
+    char ulp[16] = {0};
+    socklen_t ulp_len = sizeof(ulp) - 1;
+    if (getsockopt(socket_fd, IPPROTO_TCP, TCP_ULP, ulp, &ulp_len) == 0 && strcmp(ulp, "tls") == 0) {
+        return 0;
+    }
+#endif
+    return 1;
+}
+
+// A TLS connection served through the user-space relay: its socketpair end
+// is unnamed, unlike sockets accepted on the Unix listener
+int tls_relayed(int socket_fd) {
+    struct sockaddr_un addr;
+    socklen_t addr_len = sizeof(addr);
+    return getsockname(socket_fd, (struct sockaddr *)&addr, &addr_len) == 0 &&
+           addr.sun_family == AF_UNIX && addr_len <= sizeof(sa_family_t);
+}
+
+// Tell the users of relayed TLS sessions to reconnect, then give each relay
+// a moment to flush and close its session before this process exits
+// (the caller holds clients_mutex and the handoff is already acknowledged)
+void release_relayed_clients(void) {
+    char hint[BUFFER_SIZE];
+    format_notification(hint, "Server upgrading - reconnect now");
+
+    struct pollfd relays[MAX_CLIENTS];
+    int relayed = 0;
+    for (int i = 0; i < client_count; i++) {
+        if (clients[i].channel != 0 || !tls_relayed(clients[i].socket_fd)) continue;
+        send_frame(&clients[i], hint, strlen(hint), 0);
+        shutdown(clients[i].socket_fd, SHUT_WR);
+        relays[relayed].fd = clients[i].socket_fd;
+        relays[relayed].events = POLLRDHUP;
+        relayed++;
+    }
+    if (relayed == 0) return;
+
+    // A relay closes its end once it has written our EOF through SSL
+    long long deadline_ms = monotonic_ms() + UPGRADE_RELAY_MS;
+    for (int done = 0; done < relayed; ) {
+        long long left = deadline_ms - monotonic_ms();
+        if (left <= 0 || poll(relays, relayed, (int)left) <= 0) break;
+        done = 0;
+        for (int i = 0; i < relayed; i++) {
+            if (relays[i].revents & (POLLRDHUP | POLLHUP)) relays[i].fd = -1;
+            if (relays[i].fd < 0) done++;
+        }
+    }
+    printf("[Upgrade] Told %d TLS client(s) on the user-space relay to reconnect\n", relayed);
+}
+#endif
+
+// Thread entry for a client socket inherited through a hot upgrade
+void *resume_client(void *arg) {
+    resumed_client_t resumed = *(resumed_client_t *)arg;
+    free(arg);
+
+    if (__atomic_load_n(&placement.follow_rx_cpu, __ATOMIC_RELAXED)) {
+        pin_to_incoming_cpu(resumed.socket_fd);
+    }
+
+    line_reader_t *reader = pool_alloc();
+    if (reader == NULL || add_client(resumed.socket_fd, 0, resumed.state.username) != 0) {
+        pool_free(reader);
+        close(resumed.socket_fd);
+        return NULL;
+    }
+    reader->fd = resumed.socket_fd;
+
+    for (int i = 0; i < resumed.state.pattern_count && i < MAX_SUBSCRIPTIONS; i++) {
+        resumed.state.patterns[i][MAX_TOPIC - 1] = '\0';
+        if (validate_topic(resumed.state.patterns[i], 1)) {
+            subscribe_topic(resumed.socket_fd, 0, resumed.state.patterns[i]);
+        }
+    }
+
+    serve_client(reader, resumed.state.username);
+    return NULL;
+}
+
+// Register (pending set) or forget a connection waiting for its AUTH line
+// (thread-safe)
+void track_pending_login(int socket_fd, int pending) {
+    pthread_mutex_lock(&clients_mutex);
+    if (pending && pending_login_count < MAX_CLIENTS) {
+        pending_logins[pending_login_count].socket_fd = socket_fd;
+        pending_logins[pending_login_count].handler_thread = pthread_self();
+        pending_login_count++;
+    } else if (!pending) {
+        for (int i = 0; i < pending_login_count; i++) {
+            if (pending_logins[i].socket_fd == socket_fd) {
+                pending_logins[i] = pending_logins[--pending_login_count];
+                break;
+            }
+        }
+    }
+    pthread_mutex_unlock(&clients_mutex);
+}
+
+// Copy the topic patterns a client is subscribed to (thread-safe)
+// Returns the number copied
+int topic_patterns_of(int socket_fd, int channel, char patterns[][MAX_TOPIC]) {
+    pthread_mutex_lock(&topics_mutex);
+    int count = 0;
+    topic_client_t *client = find_topic_client(socket_fd, channel, 0);
+    if (client != NULL) {
+        count = client->pattern_count;
+        memcpy(patterns, client->patterns, (size_t)count * MAX_TOPIC);
+    }
+    pthread_mutex_unlock(&topics_mutex);
+    return count;
+}
+
+// SIGUSR2 handler - only exists to interrupt blocking accept()/read() calls
+void upgrade_interrupt_handler(int sig) {
+    (void)sig;
+}
+
+// Idle the calling thread without touching its socket while a handoff runs
+// The flag is rechecked under upgrade_mutex, so the wakeup from an aborted
+// handoff cannot slip in between the check and the wait
+void park_for_upgrade(void) {
+    pthread_mutex_lock(&upgrade_mutex);
+    __atomic_add_fetch(&parked_threads, 1, __ATOMIC_SEQ_CST);
+    while (upgrade_in_progress) {
+        pthread_cond_wait(&upgrade_cond, &upgrade_mutex);
+    }
+    __atomic_sub_fetch(&parked_threads, 1, __ATOMIC_SEQ_CST);
+    pthread_mutex_unlock(&upgrade_mutex);
+}
+
+// Send data with file descriptors attached (SCM_RIGHTS)
+int send_fds(int sock, const void *data, size_t len, const int *fds, int fd_count) {
+    char control[CMSG_SPACE(sizeof(int) * HANDOFF_BATCH)];
+    struct iovec iov = { .iov_base = (void *)data, .iov_len = len };
+    struct msghdr msgh = {0};
+    msgh.msg_iov = &iov;
+    msgh.msg_iovlen = 1;
+
+    if (fd_count > 0) {
+        memset(control, 0, sizeof(control));
+        msgh.msg_control = control;
+        msgh.msg_controllen = CMSG_SPACE(sizeof(int) * fd_count);
+
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msgh);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int) * fd_count);
+        memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * fd_count);
+    }
+
+    return sendmsg(sock, &msgh, 0) == (ssize_t)len ? 0 : -1;
+}
+
+// Receive exactly len bytes plus any attached file descriptors
+// Returns the number of fds received, or -1 on error
+int recv_fds(int sock, void *data, size_t len, int *fds, int max_fds) {
+    char control[CMSG_SPACE(sizeof(int) * HANDOFF_BATCH)];
+    int fd_count = 0;
+    size_t received = 0;
+
+    while (received < len) {
+        struct iovec iov = { .iov_base = (char *)data + received, .iov_len = len - received };
+        struct msghdr msgh = {0};
+        msgh.msg_iov = &iov;
+        msgh.msg_iovlen = 1;
+        msgh.msg_control = control;
+        msgh.msg_controllen = sizeof(control);
+
+        ssize_t n = recvmsg(sock, &msgh, 0);
+        if (n <= 0) return -1;
+        received += (size_t)n;
+
+        for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msgh); cmsg != NULL;
+             cmsg = CMSG_NXTHDR(&msgh, cmsg)) {
+            if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) continue;
+
+            int count = (int)((cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int));
+            for (int i = 0; i < count; i++) {
+                int fd;
+                memcpy(&fd, CMSG_DATA(cmsg) + i * sizeof(int), sizeof(int));
+                if (fd_count < max_fds) {
+                    fds[fd_count++] = fd;
+                } else {
+                    close(fd);
+                }
+            }
+        }
+    }
+
+    return fd_count;
+}
+
+// Stop the accept loop, every client reader (logged in or not) and every peer
+// and gateway link reader, so no socket data is consumed and nothing more
+// can be queued once the broadcast queue has drained
+// Returns 0 once all of them are parked
+int interrupt_for_upgrade(void) {
+    upgrade_in_progress = 1;
+
+    // Signals can land just before a thread blocks, so keep nudging
+    for (int attempt = 0; attempt < 500; attempt++) {
+        pthread_mutex_lock(&clients_mutex);
+        int expected = 1;  // The accept loop
+        pthread_kill(main_thread, SIGUSR2);
+        for (int i = 0; i < client_count; i++) {
+            if (clients[i].channel != 0) continue;  // Read by their gateway's link
+            pthread_kill(clients[i].handler_thread, SIGUSR2);
+            expected++;
+        }
+        for (int i = 0; i < pending_login_count; i++) {
+            pthread_kill(pending_logins[i].handler_thread, SIGUSR2);
+            expected++;
+        }
+        for (int i = 0; i < gateway_count; i++) {
+            pthread_kill(gateways[i].reader_thread, SIGUSR2);
+            expected++;
+        }
+        pthread_mutex_unlock(&clients_mutex);
+
+        pthread_mutex_lock(&peers_mutex);
+        for (int i = 0; i < peer_count; i++) {
+            pthread_kill(peers[i].reader_thread, SIGUSR2);
+            expected++;
+        }
+        pthread_mutex_unlock(&peers_mutex);
+
+        if (__atomic_load_n(&parked_threads, __ATOMIC_SEQ_CST) >= expected) return 0;
+        usleep(10000);
+    }
+
+    return -1;
+}
+
+// Wake parked threads after an aborted handoff
+void resume_after_failed_upgrade(void) {
+    pthread_mutex_lock(&upgrade_mutex);
+    upgrade_in_progress = 0;
+    pthread_cond_broadcast(&upgrade_cond);
+    pthread_mutex_unlock(&upgrade_mutex);
+
+    printf("[Upgrade] Handoff aborted, resuming service\n");
+}
+
+// Hand the listening socket and every client to the connected new process,
+// then exit without closing anything - the sockets live on in the new process
+void perform_handoff(int conn) {
+    printf("[Upgrade] New server process connected, handing off\n");
+
+    if (interrupt_for_upgrade() != 0) {
+        resume_after_failed_upgrade();
+        return;
+    }
+
+    // Let the broadcast thread flush whatever readers queued before parking,
+    // and get its journal records on disk for the new process to replay
+    wait_for_queue_drain(0);
+    if (journal_fd >= 0) flush_journal();
+
+    // Holding clients_mutex waits out an in-flight fan-out and blocks new ones,
+    // so the new process never starts writing in the middle of a frame
+    pthread_mutex_lock(&clients_mutex);
+
+    // Rings are not carried over; their clients continue on the socket
+    for (int i = 0; i < client_count; i++) {
+        release_shm_ring(&clients[i]);
+    }
+
+    handoff_record_t record;
+    memset(&record, 0, sizeof(record));
+    int listener_fds[2] = { server_fd, unix_fd };
+    record.kind = HANDOFF_LISTENER;
+    record.count = unix_fd >= 0 ? 2 : 1;
+    int failed = send_fds(conn, &record, sizeof(record), listener_fds, record.count) != 0;
+
+    // Scrollback and sequence numbers, so the new process carries on from
+    // here even without a data directory to restore from; sent before the
+    // clients so none of them logs in to an empty scrollback
+    history_t *scrollback = failed ? NULL : malloc(sizeof(history_t));
+    if (scrollback == NULL) failed = 1;
+    if (!failed) {
+        pthread_mutex_lock(&history_mutex);
+        *scrollback = history;
+        pthread_mutex_unlock(&history_mutex);
+
+        memset(&record, 0, sizeof(record));
+        record.kind = HANDOFF_HISTORY;
+        failed = send_fds(conn, &record, sizeof(record), NULL, 0) != 0 ||
+                 send_fds(conn, scrollback, sizeof(history_t), NULL, 0) != 0;
+    }
+    free(scrollback);
+
+    // Users behind a gateway stay with their gateway, which re-dials the new
+    // process and resumes them. Logged-in clients carry their name and topic
+    // subscriptions; connections still logging in follow with an empty name.
+    // TLS sessions on the user-space relay end with this process, so they are
+    // kept back and told to reconnect once the handoff is acknowledged
+    int handed_off = 0;
+    int total = client_count + pending_login_count;
+    for (int i = 0; i < total && !failed; ) {
+        int fds[HANDOFF_BATCH];
+        memset(&record, 0, sizeof(record));
+        record.kind = HANDOFF_CLIENTS;
+
+        for (; i < total && record.count < HANDOFF_BATCH; i++) {
+            handoff_client_t *state = &record.clients[record.count];
+            if (i >= client_count) {
+#ifdef CHAT_TLS
+                if (tls_relayed(pending_logins[i - client_count].socket_fd)) continue;
+#endif
+                fds[record.count++] = pending_logins[i - client_count].socket_fd;
+                continue;
+            }
+            if (clients[i].channel != 0) continue;
+#ifdef CHAT_TLS
+            if (tls_relayed(clients[i].socket_fd)) continue;
+#endif
+            fds[record.count] = clients[i].socket_fd;
+            snprintf(state->username, sizeof(state->username), "%s",
+                     username_of(clients[i].user_id));
+            state->pattern_count = topic_patterns_of(clients[i].socket_fd, 0, state->patterns);
+            record.count++;
+        }
+        if (record.count == 0) break;
+        handed_off += record.count;
+        failed = send_fds(conn, &record, sizeof(record), fds, record.count) != 0;
+    }
+
+    memset(&record, 0, sizeof(record));
+    record.kind = HANDOFF_DONE;
+    char ack = 0;
+    if (!failed && send_fds(conn, &record, sizeof(record), NULL, 0) == 0 &&
+        read(conn, &ack, 1) == 1 && ack == '1') {
+#ifdef CHAT_TLS
+        release_relayed_clients();
+#endif
+        printf("[Upgrade] Handed off %d client(s), exiting\n", handed_off);
+        fflush(stdout);
+        _exit(0);
+    }
+
+    pthread_mutex_unlock(&clients_mutex);
+    resume_after_failed_upgrade();
+}
+
+// Accept hot upgrade requests from a new server binary on the control socket
+void *upgrade_listener_thread(void *arg) {
+    int control_fd = *(int *)arg;
+    free(arg);
+
+    while (server_running) {
+        int conn = accept(control_fd, NULL, NULL);
+        if (conn < 0) continue;
+
+        perform_handoff(conn);
+        close(conn);
+    }
+
+    close(control_fd);
+    return NULL;
+}
+
+// Bind the upgrade control socket and start its listener thread
+int start_upgrade_listener(void) {
+    // upgrade_path is sized like sun_path and always NUL-terminated
+    struct sockaddr_un addr = {0};
+    addr.sun_family = AF_UNIX;
+    memcpy(addr.sun_path, upgrade_path, sizeof(addr.sun_path));
+
+    int *control_fd = malloc(sizeof(int));
+    if (control_fd == NULL) return -1;
+
+    *control_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (*control_fd < 0) {
+        free(control_fd);
+        return -1;
+    }
+
+    // Created owner-only from the start: a chmod after bind would leave a
+    // window in which anyone could connect and be handed every client
+    unlink(upgrade_path);
+    mode_t old_mask = umask(S_IRWXG | S_IRWXO);
+    int bound = bind(*control_fd, (struct sockaddr *)&addr, sizeof(addr));
+    umask(old_mask);
+    if (bound < 0 || listen(*control_fd, 1) < 0) {
+        close(*control_fd);
+        free(control_fd);
+        return -1;
+    }
+
+    pthread_t upgrade_tid;
+    if (pthread_create(&upgrade_tid, NULL, upgrade_listener_thread, control_fd) != 0) {
+        close(*control_fd);
+        free(control_fd);
+        return -1;
+    }
+    pthread_detach(upgrade_tid);
+
+    return 0;
+}
+
+// Take over the listening socket, clients and scrollback of the running server
+int receive_handoff(void) {
+    struct sockaddr_un addr = {0};
+    addr.sun_family = AF_UNIX;
+    memcpy(addr.sun_path, upgrade_path, sizeof(addr.sun_path));
+
+    int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (sock < 0) return -1;
+
+    if (connect(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        close(sock);
+        return -1;
+    }
+
+    int adopted = 0;
+    while (1) {
+        handoff_record_t record;
+        int fds[HANDOFF_BATCH];
+        int fd_count = recv_fds(sock, &record, sizeof(record), fds, HANDOFF_BATCH);
+        if (fd_count < 0) break;
+
+        if (record.kind == HANDOFF_LISTENER && fd_count >= 1) {
+            server_fd = fds[0];
+            if (fd_count > 1) unix_fd = fds[1];  // Unix listener, if the old server had one
+        } else if (record.kind == HANDOFF_CLIENTS) {
+            for (int i = 0; i < fd_count; i++) {
+                // A connection still logging in starts over at authentication
+                int logging_in = record.clients[i].username[0] == '\0';
+                void *arg = logging_in ? malloc(sizeof(int)) : calloc(1, sizeof(resumed_client_t));
+                pthread_t thread_id;
+                if (arg == NULL) {
+                    close(fds[i]);
+                    continue;
+                }
+                if (logging_in) {
+                    *(int *)arg = fds[i];
+                } else {
+                    resumed_client_t *resumed = arg;
+                    resumed->socket_fd = fds[i];
+                    resumed->state = record.clients[i];
+                    resumed->state.username[MAX_USERNAME - 1] = '\0';
+                }
+
+                if (pthread_create(&thread_id, NULL, logging_in ? handle_client : resume_client,
+                                   arg) != 0) {
+                    close(fds[i]);
+                    free(arg);
+                    continue;
+                }
+                pthread_detach(thread_id);
+                adopted++;
+            }
+        } else if (record.kind == HANDOFF_HISTORY) {
+            history_t *scrollback = malloc(sizeof(history_t));
+            if (scrollback == NULL ||
+                recv_fds(sock, scrollback, sizeof(history_t), fds, HANDOFF_BATCH) != 0 ||
+                scrollback->count < 0 || scrollback->count > HISTORY_SIZE ||
+                scrollback->head < 0 || scrollback->head >= HISTORY_SIZE) {
+                free(scrollback);
+                break;
+            }
+
+            // The old process flushed its journal before sending this, and no
+            // client has been adopted yet, so the data directory is restored
+            // here; the scrollback replaces it only if it is at least as new
+            if (data_dir[0] != '\0' && restore_state() != 0) {
+                perror("[Server] Failed to open data directory");
+                free(scrollback);
+                break;
+            }
+            pthread_mutex_lock(&history_mutex);
+            if (scrollback->next_seq >= history.next_seq) history = *scrollback;
+            pthread_mutex_unlock(&history_mutex);
+            free(scrollback);
+            printf("[Upgrade] Adopted %d scrollback message(s) (next seq %llu)\n",
+                   history.count, (unsigned long long)history.next_seq);
+        } else if (record.kind == HANDOFF_DONE && server_fd >= 0) {
+            // Old process exits once it sees the ack
+            char ack = '1';
+            int result = write(sock, &ack, 1) == 1 ? 0 : -1;
+            close(sock);
+            printf("[Upgrade] Adopted listening socket and %d client(s)\n", adopted);
+            return result;
+        } else {
+            for (int i = 0; i < fd_count; i++) close(fds[i]);
+        }
+    }
+
+    close(sock);
+    return -1;
+}
+
+// Append an entry to the scrollback ring (caller holds history_mutex)
+void history_push(const history_entry_t *entry) {
+    history.entries[history.head] = *entry;
+    history.head = (history.head + 1) % HISTORY_SIZE;
+    if (history.count < HISTORY_SIZE) history.count++;
+    if (entry->seq >= history.next_seq) history.next_seq = entry->seq + 1;
+}
+
+// Merge one scrollback entry handed over by the room's previous owner
+// (thread-safe). Entries arrive oldest first and *cursor is where the next one
+// goes, counted from the oldest entry kept: one this node already has (it
+// saw the message as an edge) is stepped over, a missing one is inserted
+// there. They are not journaled again; the previous owner's journal has them
+void merge_history_entry(int *cursor, const char *sender, const char *content) {
+    history_entry_t merged[HISTORY_SIZE + 1];
+
+    pthread_mutex_lock(&history_mutex);
+    int count = history.count;
+    int start = (history.head - count + HISTORY_SIZE) % HISTORY_SIZE;
+    int at = *cursor < count ? *cursor : count;
+    for (int i = at; i < count; i++) {
+        const history_entry_t *kept = &history.entries[(start + i) % HISTORY_SIZE];
+        if (strcmp(kept->sender, sender) == 0 && strcmp(kept->content, content) == 0) {
+            *cursor = i + 1;
+            pthread_mutex_unlock(&history_mutex);
+            return;
+        }
+    }
+
+    // Oldest first, with the new entry at the cursor; a full ring then drops
+    // its oldest entry (which is the new one if it goes in front)
+    int n = 0;
+    for (int i = 0; i <= count; i++) {
+        if (i == at) {
+            memset(&merged[n], 0, sizeof(merged[n]));
+            snprintf(merged[n].sender, sizeof(merged[n].sender), "%s", sender);
+            snprintf(merged[n].content, sizeof(merged[n].content), "%s", content);
+            n++;
+        }
+        if (i < count) merged[n++] = history.entries[(start + i) % HISTORY_SIZE];
+    }
+    int dropped = n > HISTORY_SIZE ? n - HISTORY_SIZE : 0;
+    for (int i = dropped; i < n; i++) {
+        history.entries[i - dropped] = merged[i];
+    }
+    history.count = n - dropped;
+    history.head = history.count % HISTORY_SIZE;
+    *cursor = at + 1 - dropped;
+    pthread_mutex_unlock(&history_mutex);
+}
+
+// Sequence a broadcast message into scrollback and queue it for the journal
+// Returns the sequence number it was given
+uint64_t record_history(const char *sender, const char *content) {
+    history_entry_t entry;
+    memset(&entry, 0, sizeof(entry));
+    strncpy(entry.sender, sender, MAX_USERNAME - 1);
+    strncpy(entry.content, content, MAX_MESSAGE - 1);
+
+    pthread_mutex_lock(&history_mutex);
+    entry.seq = history.next_seq;
+    history_push(&entry);
+
+    // Only the broadcast thread records, so the queue stays in sequence order.
+    // journal_end advances only for records that will reach the disk
+    if (journal_fd >= 0) {
+        pthread_mutex_lock(&journal_mutex);
+        if (journal_queued < JOURNAL_QUEUE) {
+            journal_queue[(journal_queue_head + journal_queued) % JOURNAL_QUEUE] = entry;
+            journal_queued++;
+            journal_end += sizeof(entry);
+            pthread_cond_broadcast(&journal_cond);
+        } else if (journal_dropped++ == 0 || journal_dropped % JOURNAL_QUEUE == 0) {
+            printf("[History] Journal queue full, %llu record(s) left out of the journal\n",
+                   journal_dropped);
+        }
+        pthread_mutex_unlock(&journal_mutex);
+    }
+    pthread_mutex_unlock(&history_mutex);
+    return entry.seq;
+}
+
+// Send the scrollback ring, oldest first, to a newly joined client
+// (channel is the gateway channel, 0 for a direct connection)
+// Runs under clients_mutex so no broadcast lands in the middle of it; the
+// broadcast thread then skips the frames the replay already covered
+void replay_history(int client_socket, int channel) {
+    history_t copy;
+
+    pthread_mutex_lock(&clients_mutex);
+    int index = find_client_index(client_socket, channel);
+    if (index < 0) {
+        pthread_mutex_unlock(&clients_mutex);
+        return;
+    }
+    client_info_t *client = &clients[index];
+
+    pthread_mutex_lock(&history_mutex);
+    copy = history;
+    pthread_mutex_unlock(&history_mutex);
+    client->replayed_seq = copy.next_seq - 1;
+
+    int more = __atomic_load_n(&tuning.cork, __ATOMIC_RELAXED) ? MSG_MORE : 0;
+    int start = (copy.head - copy.count + HISTORY_SIZE) % HISTORY_SIZE;
+    for (int i = 0; i < copy.count; i++) {
+        const history_entry_t *entry = &copy.entries[(start + i) % HISTORY_SIZE];
+        char frame[BUFFER_SIZE];
+        format_chat_message(frame, entry->sender, entry->content);
+        send_status_t status = send_frame(client, frame, strlen(frame), i < copy.count - 1 ? more : 0);
+        if (status != SEND_OK) {
+            send_failed(client, status);
+            break;
+        }
+    }
+    pthread_mutex_unlock(&clients_mutex);
+}
+
+// Append a batch to the journal with one write and index it (journal thread)
+// A failed or short write is cut back off, so records never straddle a tear
+void append_journal(const history_entry_t *batch, int count) {
+    size_t bytes = (size_t)count * sizeof(history_entry_t);
+    size_t written = 0;
+    while (written < bytes) {
+        ssize_t n = write(journal_fd, (const char *)batch + written, bytes - written);
+        if (n <= 0) {
+            if (n < 0 && errno == EINTR) continue;
+            break;
+        }
+        written += (size_t)n;
+    }
+
+    if (written < bytes) {
+        perror("[History] Journal write failed");
+        pthread_mutex_lock(&index_mutex);
+        off_t file_end = journal_data_start +
+                         (off_t)(journal_offset - (uint64_t)journal_first_doc * sizeof(history_entry_t));
+        pthread_mutex_unlock(&index_mutex);
+        if (written > 0 && ftruncate(journal_fd, file_end) != 0) {
+            perror("[History] Journal truncate failed");
+        }
+
+        // Keep the logical end in step with what is really on disk
+        pthread_mutex_lock(&history_mutex);
+        journal_end -= bytes;
+        pthread_mutex_unlock(&history_mutex);
+        return;
+    }
+
+    pthread_mutex_lock(&index_mutex);
+    for (int i = 0; i < count; i++) {
+        uint32_t doc = (uint32_t)(journal_offset / sizeof(history_entry_t));
+        journal_offset += sizeof(history_entry_t);
+        index_add_doc(&search_index, doc, batch[i].content);
+    }
+    pthread_mutex_unlock(&index_mutex);
+}
+
+// File position of a journal record (caller holds index_mutex, or is the
+// journal thread, or runs before it starts)
+off_t journal_position(uint32_t doc) {
+    return journal_data_start +
+           (off_t)(doc - journal_first_doc) * (off_t)sizeof(history_entry_t);
+}
+
+// Rewrite the journal without the records before keep_doc, once it holds
+// more than twice JOURNAL_RETAIN (journal thread). The newest JOURNAL_RETAIN
+// always stay searchable, and nothing the latest snapshot lacks is dropped
+void compact_journal(uint32_t keep_doc) {
+    // The startup index build reads the file unlocked until it finishes
+    if (!__atomic_load_n(&index_ready, __ATOMIC_ACQUIRE)) return;
+
+    uint32_t end_doc = (uint32_t)(journal_offset / sizeof(history_entry_t));
+    if (end_doc - journal_first_doc <= 2 * (uint32_t)JOURNAL_RETAIN) return;
+    uint32_t first_doc = end_doc - JOURNAL_RETAIN;
+    if (first_doc > keep_doc) first_doc = keep_doc;
+    if (first_doc <= journal_first_doc) return;
+
+    char tmp_path[sizeof(data_dir) + 32];
+    char path[sizeof(data_dir) + 32];
+    snprintf(tmp_path, sizeof(tmp_path), "%s/journal.tmp", data_dir);
+    snprintf(path, sizeof(path), "%s/journal.bin", data_dir);
+
+    int fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    if (fd < 0) {
+        perror("[History] Journal compaction failed");
+        return;
+    }
+
+    journal_header_t header;
+    memset(&header, 0, sizeof(header));
+    header.magic = JOURNAL_MAGIC;
+    header.first_doc = first_doc;
+    int ok = write(fd, &header, sizeof(header)) == (ssize_t)sizeof(header);
+
+    // Only this thread appends, so the records being copied cannot change
+    history_entry_t entries[64];
+    for (uint32_t doc = first_doc; ok && doc < end_doc; ) {
+        uint32_t batch = end_doc - doc < 64 ? end_doc - doc : 64;
+        size_t bytes = batch * sizeof(history_entry_t);
+        ok = pread(journal_fd, entries, bytes, journal_position(doc)) == (ssize_t)bytes &&
+             write(fd, entries, bytes) == (ssize_t)bytes;
+        doc += batch;
+    }
+    ok = ok && fsync(fd) == 0;
+    close(fd);
+    if (!ok || rename(tmp_path, path) != 0) {
+        perror("[History] Journal compaction failed");
+        unlink(tmp_path);
+        return;
+    }
+
+    // Searches read through journal_fd under index_mutex, so swapping the
+    // file underneath it there is atomic for them
+    fd = open(path, O_RDWR | O_APPEND);
+    if (fd < 0) {
+        perror("[History] Journal reopen failed");
+        return;
+    }
+    pthread_mutex_lock(&index_mutex);
+    uint32_t dropped = first_doc - journal_first_doc;
+    if (dup2(fd, journal_fd) >= 0) {
+        journal_first_doc = first_doc;
+        journal_data_start = sizeof(journal_header_t);
+    } else {
+        perror("[History] Journal reopen failed");
+    }
+    pthread_mutex_unlock(&index_mutex);
+    close(fd);
+
+    printf("[History] Compacted journal: dropped %u record(s), kept %u\n",
+           dropped, end_doc - first_doc);
+    rebuild_search_index();
+}
+
+// Index journal records [from, to) into index (the caller keeps the file
+// stable). Returns the first document not indexed
+uint32_t index_journal_range(term_index_t *index, uint32_t from, uint32_t to) {
+    history_entry_t entries[64];
+    uint32_t doc = from;
+    while (doc < to) {
+        uint32_t batch = to - doc < 64 ? to - doc : 64;
+        ssize_t got = pread(journal_fd, entries, batch * sizeof(history_entry_t),
+                            journal_position(doc));
+        if (got < (ssize_t)sizeof(history_entry_t)) break;
+
+        for (uint32_t i = 0; i < (uint32_t)got / sizeof(history_entry_t); i++) {
+            index_add_doc(index, doc++, entries[i].content);
+        }
+    }
+    return doc;
+}
+
+// Replace the search index with one built from the records the journal still
+// holds (journal thread, after a compaction). Only this thread adds documents
+// or moves the file once the startup build is merged, so the new index is
+// built unlocked and nothing is missed before the swap
+void rebuild_search_index(void) {
+    long long started = monotonic_ms();
+    uint32_t end_doc = (uint32_t)(journal_offset / sizeof(history_entry_t));
+    term_index_t kept = {0};
+    index_journal_range(&kept, journal_first_doc, end_doc);
+
+    pthread_mutex_lock(&index_mutex);
+    term_index_t old = search_index;
+    search_index = kept;
+    pthread_mutex_unlock(&index_mutex);
+
+    printf("[Search] Rebuilt index over %u record(s) in %lld ms (%u terms, %llu KB of postings, was %llu KB)\n",
+           end_doc - journal_first_doc, monotonic_ms() - started, kept.terms,
+           (unsigned long long)(kept.posting_bytes / 1024),
+           (unsigned long long)(old.posting_bytes / 1024));
+    free_term_index(&old);
+}
+
+// Write queued records to the journal until shutdown, compacting it when a
+// snapshot asks
+void *journal_thread(void *arg) {
+    (void)arg;  // Unused parameter
+    static history_entry_t batch[JOURNAL_BATCH];
+
+    pthread_mutex_lock(&journal_mutex);
+    while (1) {
+        while (journal_queued == 0 && journal_compact_doc == 0 && journal_running) {
+            pthread_cond_wait(&journal_cond, &journal_mutex);
+        }
+        if (journal_queued == 0 && journal_compact_doc == 0) break;  // Stopped and drained
+
+        int count = journal_queued < JOURNAL_BATCH ? journal_queued : JOURNAL_BATCH;
+        for (int i = 0; i < count; i++) {
+            batch[i] = journal_queue[(journal_queue_head + i) % JOURNAL_QUEUE];
+        }
+        journal_queue_head = (journal_queue_head + count) % JOURNAL_QUEUE;
+        journal_queued -= count;
+        uint32_t compact_doc = journal_compact_doc;
+        journal_compact_doc = 0;
+        journal_busy = 1;
+        pthread_cond_broadcast(&journal_cond);  // The queue has room again
+        pthread_mutex_unlock(&journal_mutex);
+
+        if (count > 0) append_journal(batch, count);
+        if (compact_doc > 0) compact_journal(compact_doc);
+
+        pthread_mutex_lock(&journal_mutex);
+        journal_busy = 0;
+        pthread_cond_broadcast(&journal_cond);
+    }
+    pthread_mutex_unlock(&journal_mutex);
+    return NULL;
+}
+
+// Wait until every record queued so far is on disk and any compaction asked
+// for is done, so another process can take the journal over
+void flush_journal(void) {
+    pthread_mutex_lock(&journal_mutex);
+    while ((journal_queued > 0 || journal_compact_doc > 0 || journal_busy) && journal_running) {
+        pthread_cond_wait(&journal_cond, &journal_mutex);
+    }
+    pthread_mutex_unlock(&journal_mutex);
+}
+
+// Stop the journal thread once it has written everything queued
+void stop_journal(void) {
+    pthread_mutex_lock(&journal_mutex);
+    journal_running = 0;
+    journal_compact_doc = 0;
+    pthread_cond_broadcast(&journal_cond);
+    pthread_mutex_unlock(&journal_mutex);
+    pthread_join(journal_tid, NULL);
+}
+
+// Write a snapshot of the scrollback ring and sequence counter
+// Only the struct copy happens under history_mutex; file I/O runs unlocked,
+// so the broadcast thread is never held up by disk writes
+int write_snapshot(void) {
+    static snapshot_t snapshot;
+    static uint64_t last_seq = 0;
+
+    snapshot.magic = SNAPSHOT_MAGIC;
+    snapshot.version = SNAPSHOT_VERSION;
+    snapshot.entry_size = sizeof(history_entry_t);
+    snapshot.history_size = HISTORY_SIZE;
+
+    pthread_mutex_lock(&history_mutex);
+    snapshot.history = history;
+    snapshot.journal_offset = journal_end;
+    pthread_mutex_unlock(&history_mutex);
+
+    if (snapshot.history.next_seq == last_seq) return 0;  // Nothing new
+
+    char tmp_path[sizeof(data_dir) + 32];
+    char path[sizeof(data_dir) + 32];
+    snprintf(tmp_path, sizeof(tmp_path), "%s/snapshot.tmp", data_dir);
+    snprintf(path, sizeof(path), "%s/snapshot.bin", data_dir);
+
+    int fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    if (fd < 0) return -1;
+
+    // Write to a temporary file and rename, so a crash never leaves a torn snapshot
+    int ok = write(fd, &snapshot, sizeof(snapshot)) == (ssize_t)sizeof(snapshot) &&
+             fsync(fd) == 0;
+    close(fd);
+    if (!ok || rename(tmp_path, path) != 0) {
+        unlink(tmp_path);
+        return -1;
+    }
+
+    last_seq = snapshot.history.next_seq;
+
+    // Records the snapshot covers are now only needed by search
+    pthread_mutex_lock(&journal_mutex);
+    journal_compact_doc = (uint32_t)(snapshot.journal_offset / sizeof(history_entry_t));
+    pthread_cond_broadcast(&journal_cond);
+    pthread_mutex_unlock(&journal_mutex);
+    return 0;
+}
+
+// Periodically snapshot state while the server runs
+void *snapshot_thread(void *arg) {
+    (void)arg;  // Unused parameter
+
+    int elapsed = 0;
+    while (server_running) {
+        sleep(1);
+        if (++elapsed < SNAPSHOT_INTERVAL) continue;
+        elapsed = 0;
+
+        if (write_snapshot() != 0) {
+            perror("[History] Snapshot failed");
+        }
+    }
+
+    return NULL;
+}
+
+// Restore scrollback from the latest snapshot plus the journal written after it
+int restore_state(void) {
+    char path[sizeof(data_dir) + 32];
+    uint64_t replay_from = 0;
+
+    // Map the snapshot instead of reading it; only the pages we copy are touched
+    snprintf(path, sizeof(path), "%s/snapshot.bin", data_dir);
+    int fd = open(path, O_RDONLY);
+    if (fd >= 0) {
+        struct stat st;
+        if (fstat(fd, &st) == 0 && st.st_size == (off_t)sizeof(snapshot_t)) {
+            const snapshot_t *snapshot = mmap(NULL, sizeof(snapshot_t), PROT_READ,
+                                              MAP_PRIVATE, fd, 0);
+            if (snapshot != MAP_FAILED) {
+                if (snapshot->magic == SNAPSHOT_MAGIC &&
+                    snapshot->version == SNAPSHOT_VERSION &&
+                    snapshot->entry_size == sizeof(history_entry_t) &&
+                    snapshot->history_size == HISTORY_SIZE) {
+                    history = snapshot->history;
+                    replay_from = snapshot->journal_offset;
+                }
+                munmap((void *)snapshot, sizeof(snapshot_t));
+            }
+        }
+        close(fd);
+    }
+
+    snprintf(path, sizeof(path), "%s/journal.bin", data_dir);
+    journal_fd = open(path, O_RDWR | O_CREAT | O_APPEND, 0600);
+    if (journal_fd < 0) return -1;
+
+    struct stat st;
+    if (fstat(journal_fd, &st) != 0) return -1;
+
+    // A compacted journal names the first record it still holds
+    journal_header_t header;
+    if (st.st_size >= (off_t)sizeof(header) &&
+        pread(journal_fd, &header, sizeof(header), 0) == (ssize_t)sizeof(header) &&
+        header.magic == JOURNAL_MAGIC) {
+        journal_first_doc = (uint32_t)header.first_doc;
+        journal_data_start = sizeof(header);
+    }
+
+    // Replay only the journal tail, then drop any record torn by a crash.
+    // Offsets are logical; records still queued at a crash are in the snapshot
+    uint64_t journal_start = (uint64_t)journal_first_doc * sizeof(history_entry_t);
+    uint64_t journal_size = journal_start + (uint64_t)(st.st_size - journal_data_start);
+    uint64_t whole = journal_size - (journal_size - journal_start) % sizeof(history_entry_t);
+    if (replay_from < journal_start) replay_from = journal_start;
+    if (replay_from > whole) replay_from = whole;
+
+    uint64_t offset = replay_from;
+    int replayed = 0;
+    history_entry_t entry;
+    while (offset + sizeof(entry) <= journal_size &&
+           pread(journal_fd, &entry, sizeof(entry),
+                 journal_data_start + (off_t)(offset - journal_start)) == (ssize_t)sizeof(entry)) {
+        history_push(&entry);
+        offset += sizeof(entry);
+        replayed++;
+    }
+    if (offset != journal_size &&
+        ftruncate(journal_fd, journal_data_start + (off_t)(offset - journal_start)) != 0) {
+        return -1;
+    }
+    journal_offset = offset;
+    journal_end = offset;
+
+    printf("[History] Restored %d message(s) (next seq %llu, %d from journal)\n",
+           history.count, (unsigned long long)history.next_seq, replayed);
+    return 0;
+}
+
+// Split text into lowercase search terms: runs of ASCII letters and digits,
+// plus any UTF-8 bytes, truncated to MAX_TERM-1 bytes. Returns the count
+int tokenize_terms(const char *text, char terms[][MAX_TERM], int max_terms) {
+    int count = 0;
+    size_t len = 0;
+
+    for (const unsigned char *c = (const unsigned char *)text; count < max_terms; c++) {
+        unsigned char folded = (*c >= 'A' && *c <= 'Z') ? *c + ('a' - 'A') : *c;
+        if ((folded >= 'a' && folded <= 'z') || (folded >= '0' && folded <= '9') || folded >= 0x80) {
+            if (len < MAX_TERM - 1) terms[count][len++] = (char)folded;
+        } else if (len > 0) {
+            terms[count++][len] = '\0';
+            len = 0;
+        }
+        if (*c == '\0') break;
+    }
+    return count;
+}
+
+// Posting list for term, added if create is set (NULL if absent or out of memory)
+posting_list_t *index_term(term_index_t *index, const char *term, int create) {
+    if (create && (index->terms + 1) * 2 > index->capacity) {
+        // Keep the table at most half full; rehash into twice the slots
+        uint32_t capacity = index->capacity ? index->capacity * 2 : 1024;
+        posting_list_t *slots = calloc(capacity, sizeof(posting_list_t));
+        if (slots == NULL) return NULL;
+
+        for (uint32_t i = 0; i < index->capacity; i++) {
+            if (index->slots[i].term[0] == '\0') continue;
+            uint32_t slot = hash_bytes(index->slots[i].term, strlen(index->slots[i].term));
+            while (slots[slot & (capacity - 1)].term[0] != '\0') slot++;
+            slots[slot & (capacity - 1)] = index->slots[i];
+        }
+        free(index->slots);
+        index->slots = slots;
+        index->capacity = capacity;
+    }
+    if (index->capacity == 0) return NULL;
+
+    uint32_t slot = hash_bytes(term, strlen(term));
+    posting_list_t *list;
+    while ((list = &index->slots[slot & (index->capacity - 1)])->term[0] != '\0') {
+        if (strcmp(list->term, term) == 0) return list;
+        slot++;
+    }
+    if (!create) return NULL;
+
+    strcpy(list->term, term);
+    index->terms++;
+    return list;
+}
+
+// Append doc to a posting list unless it is already the last entry
+// (documents arrive in ascending order)
+int append_posting(term_index_t *index, posting_list_t *list, uint32_t doc) {
+    if (list->count > 0 && list->last_doc == doc) return 0;  // Repeated word
+
+    if (list->bytes + 5 > list->capacity) {
+        uint32_t capacity = list->capacity ? list->capacity * 2 : 16;
+        uint8_t *grown = realloc(list->postings, capacity);
+        if (grown == NULL) return -1;
+        list->postings = grown;
+        index->posting_bytes += capacity - list->capacity;
+        list->capacity = capacity;
+    }
+
+    uint32_t delta = doc - (list->count > 0 ? list->last_doc : 0);
+    while (delta >= 0x80) {
+        list->postings[list->bytes++] = (uint8_t)(delta | 0x80);
+        delta >>= 7;
+    }
+    list->postings[list->bytes++] = (uint8_t)delta;
+    list->last_doc = doc;
+    list->count++;
+    return 0;
+}
+
+// Add document doc (higher than any already indexed) to the list of each of its terms
+int index_add_doc(term_index_t *index, uint32_t doc, const char *content) {
+    char terms[MAX_MESSAGE / 2][MAX_TERM];
+    int term_count = tokenize_terms(content, terms, MAX_MESSAGE / 2);
+
+    for (int t = 0; t < term_count; t++) {
+        posting_list_t *list = index_term(index, terms[t], 1);
+        if (list == NULL || append_posting(index, list, doc) != 0) return -1;
+    }
+    return 0;
+}
+
+// Free every posting list and the term table
+void free_term_index(term_index_t *index) {
+    for (uint32_t i = 0; i < index->capacity; i++) {
+        free(index->slots[i].postings);
+    }
+    free(index->slots);
+    memset(index, 0, sizeof(*index));
+}
+
+// Decode the next document of a posting list; *pos advances over its varint
+uint32_t next_posting(const posting_list_t *list, uint32_t *pos, uint32_t prev) {
+    uint32_t delta = 0;
+    int shift = 0;
+    uint8_t byte;
+    do {
+        byte = list->postings[(*pos)++];
+        delta |= (uint32_t)(byte & 0x7f) << shift;
+        shift += 7;
+    } while (byte & 0x80);
+    return prev + delta;
+}
+
+// Index the journal written before startup, then merge the live index
+// (messages since startup) onto it. Queries meanwhile see the live index only
+void *index_build_thread(void *arg) {
+    (void)arg;
+    long long started = monotonic_ms();
+    term_index_t base = {0};
+
+    // Compaction waits for index_ready, so the file is stable while we read
+    uint32_t doc = index_journal_range(&base, journal_first_doc, indexed_from_doc);
+
+    pthread_mutex_lock(&index_mutex);
+    for (uint32_t i = 0; i < search_index.capacity; i++) {
+        const posting_list_t *live = &search_index.slots[i];
+        if (live->term[0] == '\0') continue;
+
+        // Live documents all follow the base ones, so they append in order
+        posting_list_t *merged = index_term(&base, live->term, 1);
+        uint32_t pos = 0, live_doc = 0;
+        for (uint32_t n = 0; merged != NULL && n < live->count; n++) {
+            live_doc = next_posting(live, &pos, live_doc);
+            append_posting(&base, merged, live_doc);
+        }
+    }
+    free_term_index(&search_index);
+    search_index = base;
+    indexed_from_doc = 0;
+    index_ready = 1;
+    uint32_t terms = search_index.terms;
+    uint64_t bytes = search_index.posting_bytes;
+    pthread_mutex_unlock(&index_mutex);
+
+    printf("[Search] Indexed %u journal message(s) in %lld ms (%u terms, %llu KB of postings)\n",
+           doc - journal_first_doc, monotonic_ms() - started, terms, (unsigned long long)(bytes / 1024));
+    return NULL;
+}
+
+// Documents containing every term of query; the newest max_hits go to hits
+// in ascending order. Returns the number stored, -1 for a query with no terms
+int search_history(const char *query, uint32_t *hits, int max_hits, uint32_t *total) {
+    char terms[8][MAX_TERM];
+    int term_count = tokenize_terms(query, terms, 8);
+    if (term_count == 0) return -1;
+
+    *total = 0;
+    pthread_mutex_lock(&index_mutex);
+
+    // Intersect starting from the shortest list
+    const posting_list_t *lists[8];
+    for (int t = 0; t < term_count; t++) {
+        lists[t] = index_term(&search_index, terms[t], 0);
+        if (lists[t] == NULL) {
+            pthread_mutex_unlock(&index_mutex);
+            return 0;
+        }
+        for (int k = t; k > 0 && lists[k]->count < lists[k - 1]->count; k--) {
+            const posting_list_t *shorter = lists[k];
+            lists[k] = lists[k - 1];
+            lists[k - 1] = shorter;
+        }
+    }
+
+    uint32_t *matches = malloc((size_t)lists[0]->count * sizeof(uint32_t));
+    if (matches == NULL) {
+        pthread_mutex_unlock(&index_mutex);
+        return 0;
+    }
+    uint32_t match_count = 0, pos = 0, doc = 0;
+    for (uint32_t n = 0; n < lists[0]->count; n++) {
+        doc = next_posting(lists[0], &pos, doc);
+        if (doc >= journal_first_doc) matches[match_count++] = doc;  // Not compacted away
+    }
+
+    // Merge each longer list against the survivors, decoding it once
+    for (int t = 1; t < term_count && match_count > 0; t++) {
+        uint32_t kept = 0, n = 0;
+        pos = 0;
+        doc = 0;
+        int have = 0;
+        for (uint32_t m = 0; m < match_count; m++) {
+            while ((!have || doc < matches[m]) && n < lists[t]->count) {
+                doc = next_posting(lists[t], &pos, doc);
+                n++;
+                have = 1;
+            }
+            if (have && doc == matches[m]) matches[kept++] = matches[m];
+            else if (have && doc < matches[m]) break;  // List exhausted
+        }
+        match_count = kept;
+    }
+    pthread_mutex_unlock(&index_mutex);
+
+    *total = match_count;
+    int stored = match_count < (uint32_t)max_hits ? (int)match_count : max_hits;
+    memcpy(hits, matches + (match_count - (uint32_t)stored), (size_t)stored * sizeof(uint32_t));
+    free(matches);
+    return stored;
+}
+
+// Read one journal record by document number. Returns -1 if compaction has
+// dropped it or the read fails
+int read_journal_entry(uint32_t doc, history_entry_t *entry) {
+    pthread_mutex_lock(&index_mutex);
+    int ok = doc >= journal_first_doc &&
+             pread(journal_fd, entry, sizeof(*entry), journal_position(doc)) == (ssize_t)sizeof(*entry);
+    pthread_mutex_unlock(&index_mutex);
+    return ok ? 0 : -1;
+}
+
+// Answer a SEARCH request with the newest matching messages from the journal
+// (channel is the gateway channel, 0 for a direct connection)
+void handle_search_request(int socket_fd, int channel, const message_t *msg) {
+    char reply[BUFFER_SIZE];
+
+    if (journal_fd < 0) {
+        format_error_message(reply, "Search needs a data directory (-D)");
+        reply_to_client(socket_fd, channel, reply);
+        return;
+    }
+    if (strcmp(msg->topic, DEFAULT_ROOM) != 0) {
+        format_error_message(reply, "Unknown room");
+        reply_to_client(socket_fd, channel, reply);
+        return;
+    }
+
+    uint32_t hits[SEARCH_LIMIT];
+    uint32_t total = 0;
+    int found = search_history(msg->content, hits, SEARCH_LIMIT, &total);
+    if (found < 0) {
+        format_error_message(reply, "Nothing to search for");
+        reply_to_client(socket_fd, channel, reply);
+        return;
+    }
+
+    for (int i = 0; i < found; i++) {
+        history_entry_t entry;
+        if (read_journal_entry(hits[i], &entry) != 0) continue;
+        format_search_result(reply, entry.sender, entry.content);
+        reply_to_client(socket_fd, channel, reply);
+    }
+
+    char text[MAX_MESSAGE];
+    snprintf(text, sizeof(text), "Search '%.64s': %u match(es)%s%s", msg->content, total,
+             total > (uint32_t)found ? ", newest shown" : "",
+             __atomic_load_n(&index_ready, __ATOMIC_ACQUIRE) ? "" : " (older history still indexing)");
+    format_notification(reply, text);
+    reply_to_client(socket_fd, channel, reply);
+}
+
+// Milliseconds on the monotonic clock
+long long monotonic_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// Microseconds on the monotonic clock
+long long monotonic_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+// Busy-wait for the queue to become non-empty, for at most spin_us
+// (forever when -1), so a message arriving in the window skips the
+// condition variable wakeup entirely
+void spin_for_messages(void) {
+    int spin_us = __atomic_load_n(&polling.spin_us, __ATOMIC_RELAXED);
+    long long deadline_us = spin_us > 0 ? monotonic_us() + spin_us : -1;
+
+    while (__atomic_load_n(&msg_queue.count, __ATOMIC_ACQUIRE) == 0 && broadcast_running) {
+        if (deadline_us >= 0 && monotonic_us() >= deadline_us) break;
+        cpu_relax();
+    }
+}
+
+// Wait until the broadcast thread has taken every queued message
+// A deadline of 0 waits indefinitely; returns -1 if the deadline passed first
+int wait_for_queue_drain(long long deadline_ms) {
+    while (!force_shutdown) {
+        pthread_mutex_lock(&queue_mutex);
+        int empty = is_queue_empty(&msg_queue);
+        pthread_mutex_unlock(&queue_mutex);
+        if (empty) return 0;
+
+        if (deadline_ms > 0 && monotonic_ms() >= deadline_ms) break;
+        wait_for_signals(1);
+    }
+    return -1;
+}
+
+// Graceful drain: flush queued messages, tell clients when to reconnect, then
+// close them one by one across the deadline so reconnects are spread out
+void drain_clients(void) {
+    long long start_ms = monotonic_ms();
+    long long deadline_ms = start_ms + (long long)drain_deadline * 1000;
+
+    if (wait_for_queue_drain(deadline_ms) != 0) {
+        printf("[Drain] Deadline reached with messages still queued\n");
+    }
+
+    // Snapshot sockets; readers remove themselves as their sockets shut down
+    int fds[MAX_CLIENTS];
+    int chans[MAX_CLIENTS];
+    pthread_mutex_lock(&clients_mutex);
+    int total = client_count;
+    for (int i = 0; i < total; i++) {
+        fds[i] = clients[i].socket_fd;
+        chans[i] = clients[i].channel;
+    }
+    pthread_mutex_unlock(&clients_mutex);
+
+    printf("[Drain] Closing %d client(s) over %d second(s)\n", total, drain_deadline);
+
+    // Each client learns its own slot, so reconnects follow the close schedule
+    pthread_mutex_lock(&clients_mutex);
+    for (int i = 0; i < total; i++) {
+        char hint[BUFFER_SIZE];
+        char notice[MAX_MESSAGE];
+        snprintf(notice, sizeof(notice), "Server shutting down - reconnect in %d second(s)",
+                 drain_deadline * (i + 1) / total + 1);
+        format_notification(hint, notice);
+        int index = find_client_index(fds[i], chans[i]);
+        if (index >= 0) {
+            send_frame(&clients[index], hint, strlen(hint), 0);
+        }
+    }
+    pthread_mutex_unlock(&clients_mutex);
+
+    for (int i = 0; i < total; i++) {
+        long long close_at = start_ms + (long long)drain_deadline * 1000 * (i + 1) / total;
+        while (!force_shutdown && monotonic_ms() < close_at) {
+            wait_for_signals(10);
+        }
+
+        // shutdown() makes the reader see EOF and run its own cleanup;
+        // users behind a gateway get an empty channel frame instead
+        pthread_mutex_lock(&clients_mutex);
+        int index = find_client_index(fds[i], chans[i]);
+        if (index >= 0 && chans[i] == 0) {
+            shutdown(fds[i], SHUT_RDWR);
+        } else if (index >= 0) {
+            send_to_channel(fds[i], chans[i], "");
+            unsubscribe_all(fds[i], chans[i]);
+            release_username(clients[index].user_id);
+            for (int j = index; j < client_count - 1; j++) {
+                clients[j] = clients[j + 1];
+            }
+            client_count--;
+        }
+        pthread_mutex_unlock(&clients_mutex);
+    }
+
+    // Give readers a moment to finish their cleanup
+    for (int attempt = 0; attempt < 100; attempt++) {
+        pthread_mutex_lock(&clients_mutex);
+        int remaining = client_count;
+        pthread_mutex_unlock(&clients_mutex);
+        if (remaining == 0) break;
+        wait_for_signals(10);
+    }
+}
+
+// Non-zero if the current log_level includes messages of this level
+int log_enabled(int level) {
+    return __atomic_load_n(&limits.log_level, __ATOMIC_RELAXED) >= level;
+}
+
+// Index of the setting called key, or -1
+int find_setting(const char *key) {
+    for (size_t i = 0; i < SETTING_COUNT; i++) {
+        if (strcmp(settings[i].key, key) == 0) return (int)i;
+    }
+    return -1;
+}
+
+// Parse a value for settings[index], checking its range
+// Returns 0 on success, -1 for a malformed or out-of-range value
+int parse_setting(int index, const char *value, int *parsed) {
+    char *end;
+    errno = 0;
+    long number = strtol(value, &end, 10);
+    if (errno != 0 || end == value || *end != '\0' ||
+        number < settings[index].min || number > settings[index].max) {
+        return -1;
+    }
+    *parsed = (int)number;
+    return 0;
+}
+
+// Apply one tuning setting by name (shared by -o and the config file)
+// Returns 0 on success, -1 for an unknown key or out-of-range value
+int apply_setting(const char *key, const char *value) {
+    int index = find_setting(key);
+    int parsed;
+    if (index < 0 || parse_setting(index, value, &parsed) != 0) return -1;
+
+    __atomic_store_n(settings[index].value, parsed, __ATOMIC_RELEASE);
+    return 0;
+}
+
+// Apply a key=value command line setting
+int apply_setting_arg(const char *arg) {
+    char key[64];
+    const char *equals = strchr(arg, '=');
+    if (equals == NULL || (size_t)(equals - arg) >= sizeof(key)) return -1;
+
+    memcpy(key, arg, (size_t)(equals - arg));
+    key[equals - arg] = '\0';
+    return apply_setting(key, equals + 1);
+}
+
+// Strip leading and trailing whitespace in place
+char *trim_whitespace(char *text) {
+    while (*text == ' ' || *text == '\t') text++;
+    size_t len = strlen(text);
+    while (len > 0 && (text[len - 1] == ' ' || text[len - 1] == '\t' ||
+                       text[len - 1] == '\n' || text[len - 1] == '\r')) {
+        text[--len] = '\0';
+    }
+    return text;
+}
+
+// Record a validated -o key=value into the staged values of a config load
+int stage_setting_arg(const char *arg, int *staged, int *present) {
+    char key[64];
+    const char *equals = strchr(arg, '=');
+    if (equals == NULL || (size_t)(equals - arg) >= sizeof(key)) return -1;
+
+    memcpy(key, arg, (size_t)(equals - arg));
+    key[equals - arg] = '\0';
+    int index = find_setting(key);
+    if (index < 0 || parse_setting(index, equals + 1, &staged[index]) != 0) return -1;
+    present[index] = 1;
+    return 0;
 }
 
-// Broadcast notification to all connected clients
-void broadcast_notification(const char *notification) {
-    char notify_msg[BUFFER_SIZE];
-    format_notification(notify_msg, notification);
+// Load the -f config file: one "key = value" setting per line, # comments
+// The whole file is checked before anything changes, so a bad edit leaves the
+// running values alone, and -o settings still win over the file. At startup
+// every key applies; on reload, keys that are not live keep their value
+// until a restart. A key removed from the file keeps its current value
+int load_config(int startup) {
+    int staged[SETTING_COUNT];
+    int present[SETTING_COUNT] = {0};
 
-    pthread_mutex_lock(&clients_mutex);
-    for (int i = 0; i < client_count; i++) {
-        send(clients[i].socket_fd, notify_msg, strlen(notify_msg), 0);
+    FILE *file = fopen(config_path, "r");
+    if (file == NULL) {
+        printf("[Config] Cannot open %s: %s\n", config_path, strerror(errno));
+        return -1;
     }
-    pthread_mutex_unlock(&clients_mutex);
-
-    printf("[Server] Notification broadcasted: %s\n", notification);
-}
 
-// Dedicated broadcast thread - dequeues and distributes messages
-void *broadcast_thread(void *arg) {
-    (void)arg;  // Unused parameter
+    char line[MAX_CONFIG_LINE];
+    int line_number = 0;
+    int errors = 0;
+    while (fgets(line, sizeof(line), file) != NULL) {
+        line_number++;
+        char *comment = strchr(line, '#');
+        if (comment != NULL) *comment = '\0';
+        char *key = trim_whitespace(line);
+        if (*key == '\0') continue;
 
-    printf("[Broadcast Thread] Started\n");
+        char *equals = strchr(key, '=');
+        int index = -1;
+        if (equals != NULL) {
+            *equals = '\0';
+            index = find_setting(trim_whitespace(key));
+        }
+        if (index < 0 || parse_setting(index, trim_whitespace(equals + 1), &staged[index]) != 0) {
+            printf("[Config] %s:%d: invalid setting\n", config_path, line_number);
+            errors++;
+            continue;
+        }
+        present[index] = 1;
+    }
+    fclose(file);
 
-    while (server_running) {
-        message_t msg;
+    if (errors > 0) {
+        printf("[Config] Keeping the previous settings\n");
+        return -1;
+    }
+    for (int i = 0; i < setting_arg_count; i++) {
+        stage_setting_arg(setting_args[i], staged, present);
+    }
 
-        pthread_mutex_lock(&queue_mutex);
+    int changed = 0;
+    for (size_t i = 0; i < SETTING_COUNT; i++) {
+        int current = __atomic_load_n(settings[i].value, __ATOMIC_ACQUIRE);
+        if (!present[i] || staged[i] == current) continue;
 
-        // Wait for messages in queue
-        while (is_queue_empty(&msg_queue) && server_running) {
-            pthread_cond_wait(&queue_cond, &queue_mutex);
+        if (!startup && !settings[i].live) {
+            printf("[Config] %s needs a restart to change (keeping %d)\n",
+                   settings[i].key, current);
+            continue;
         }
-
-        if (!server_running) {
-            pthread_mutex_unlock(&queue_mutex);
-            break;
+        __atomic_store_n(settings[i].value, staged[i], __ATOMIC_RELEASE);
+        if (!startup) {
+            printf("[Config] %s: %d -> %d\n", settings[i].key, current, staged[i]);
         }
+        changed++;
+    }
+    printf("[Config] Loaded %s (%d setting(s) changed)\n", config_path, changed);
+    return 0;
+}
 
-        // Dequeue message
-        if (dequeue_message(&msg_queue, &msg) == 0) {
-            pthread_mutex_unlock(&queue_mutex);
-
-            // Format broadcast message
-            char broadcast[BUFFER_SIZE];
-            format_chat_message(broadcast, msg.sender, msg.content);
+// Set listener-level options (before listen(), or again after a takeover)
+void tune_listener(int fd) {
+    int rcvbuf = __atomic_load_n(&tuning.rcvbuf, __ATOMIC_RELAXED);
+    if (rcvbuf > 0) {
+        // Inherited by accepted sockets, so the window is sized from the SYN on
+        setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+    }
+#ifdef TCP_DEFER_ACCEPT
+    // Wake accept() only once the first frame (AUTH or a link hello) arrived
+    int defer_accept = __atomic_load_n(&tuning.defer_accept, __ATOMIC_RELAXED);
+    setsockopt(fd, IPPROTO_TCP, TCP_DEFER_ACCEPT, &defer_accept, sizeof(defer_accept));
+#endif
+}
 
-            printf("[Broadcast] %s: %s\n", msg.sender, msg.content);
+// Set per-connection options on an accepted or dialed TCP socket
+void tune_client_socket(int fd) {
+    struct sockaddr_storage addr;
+    socklen_t addr_len = sizeof(addr);
+    if (getsockname(fd, (struct sockaddr *)&addr, &addr_len) != 0 ||
+        (addr.ss_family != AF_INET && addr.ss_family != AF_INET6)) {
+        return;
+    }
 
-            // Send to all connected clients
-            pthread_mutex_lock(&clients_mutex);
-            for (int i = 0; i < client_count; i++) {
-                if (send(clients[i].socket_fd, broadcast, strlen(broadcast), 0) < 0) {
-                    perror("[Broadcast] Send failed");
-                }
-            }
-            pthread_mutex_unlock(&clients_mutex);
-        } else {
-            pthread_mutex_unlock(&queue_mutex);
-        }
+    // Settings may change under us (SIGHUP); each is read once
+    int nodelay = __atomic_load_n(&tuning.nodelay, __ATOMIC_RELAXED);
+    int sndbuf = __atomic_load_n(&tuning.sndbuf, __ATOMIC_RELAXED);
+    int rcvbuf = __atomic_load_n(&tuning.rcvbuf, __ATOMIC_RELAXED);
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+    if (sndbuf > 0) {
+        setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof(sndbuf));
+    }
+    if (rcvbuf > 0) {
+        setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+    }
+#ifdef SO_BUSY_POLL
+    // Blocking reads poll the device queue instead of sleeping for the IRQ;
+    // values above net.core.busy_read need CAP_NET_ADMIN
+    int busy_poll = __atomic_load_n(&polling.busy_poll, __ATOMIC_RELAXED);
+    if (busy_poll > 0 &&
+        setsockopt(fd, SOL_SOCKET, SO_BUSY_POLL, &busy_poll, sizeof(busy_poll)) < 0 &&
+        !tuning_reported) {
+        perror("[Tuning] SO_BUSY_POLL");
     }
+#endif
+#ifdef TCP_USER_TIMEOUT
+    // Drop a peer whose unacknowledged data has been stuck this long
+    unsigned int user_timeout = (unsigned int)__atomic_load_n(&tuning.user_timeout, __ATOMIC_RELAXED);
+    setsockopt(fd, IPPROTO_TCP, TCP_USER_TIMEOUT, &user_timeout, sizeof(user_timeout));
+#endif
 
-    printf("[Broadcast Thread] Exiting\n");
-    return NULL;
+    if (!__atomic_exchange_n(&tuning_reported, 1, __ATOMIC_RELAXED)) {
+        report_socket_tuning(fd, "client socket");
+    }
 }
 
-// Client handler thread - processes authentication and messages
-void *handle_client(void *arg) {
-    int client_socket = *(int*)arg;
-    free(arg);
+// Log the values the kernel actually applied to a socket (read back, since
+// it rounds and clamps buffer sizes and timeouts)
+void report_socket_tuning(int fd, const char *label) {
+    int nodelay = 0, sndbuf = 0, rcvbuf = 0, defer_accept = 0, busy_poll = 0;
+    unsigned int user_timeout = 0;
+    socklen_t len = sizeof(int);
+    getsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &nodelay, &len);
+    len = sizeof(int);
+    getsockopt(fd, SOL_SOCKET, SO_SNDBUF, &sndbuf, &len);
+    len = sizeof(int);
+    getsockopt(fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, &len);
+#ifdef TCP_DEFER_ACCEPT
+    len = sizeof(int);
+    getsockopt(fd, IPPROTO_TCP, TCP_DEFER_ACCEPT, &defer_accept, &len);
+#endif
+#ifdef SO_BUSY_POLL
+    len = sizeof(int);
+    getsockopt(fd, SOL_SOCKET, SO_BUSY_POLL, &busy_poll, &len);
+#endif
+#ifdef TCP_USER_TIMEOUT
+    len = sizeof(user_timeout);
+    getsockopt(fd, IPPROTO_TCP, TCP_USER_TIMEOUT, &user_timeout, &len);
+#endif
 
-    char buffer[BUFFER_SIZE] = {0};
-    char username[MAX_USERNAME] = {0};
+    printf("[Tuning] %s: nodelay=%d sndbuf=%d rcvbuf=%d defer_accept=%d user_timeout=%u "
+           "busy_poll=%d (backlog=%d cork=%d spin_us=%d)\n", label, nodelay, sndbuf, rcvbuf,
+           defer_accept, user_timeout, busy_poll, __atomic_load_n(&tuning.backlog, __ATOMIC_RELAXED),
+           __atomic_load_n(&tuning.cork, __ATOMIC_RELAXED),
+           __atomic_load_n(&polling.spin_us, __ATOMIC_RELAXED));
+}
 
-    printf("[Thread %p] New client connected (socket %d)\n",
-           (void*)pthread_self(), client_socket);
+// Pin the calling thread to one CPU (no-op for cpu < 0)
+// Returns 0 if pinned, -1 if the CPU is unavailable or pinning is unsupported
+int pin_current_thread(int cpu, const char *label) {
+    if (cpu < 0) return 0;
 
-    // Phase 1: Authentication
-    // Read authentication message
-    int valread = read(client_socket, buffer, BUFFER_SIZE - 1);
-    if (valread <= 0) {
-        printf("[Thread %p] Failed to read auth message\n", (void*)pthread_self());
-        close(client_socket);
-        return NULL;
+#ifdef __linux__
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    int err = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    if (err != 0) {
+        printf("[Affinity] Cannot pin %s to CPU %d: %s\n", label, cpu, strerror(err));
+        return -1;
     }
-    buffer[valread] = '\0';
-
-    // Parse authentication message
-    message_t auth_msg;
-    if (parse_message(buffer, &auth_msg) != 0 ||
-        strcmp(auth_msg.type, MSG_TYPE_AUTH) != 0) {
+    return 0;
+#else
+    printf("[Affinity] Thread pinning not supported on this platform (%s)\n", label);
+    return -1;
+#endif
+}
 
-        // Invalid auth message
-        char response[BUFFER_SIZE];
-        format_error_message(response, "Invalid authentication format");
-        send(client_socket, response, strlen(response), 0);
-        close(client_socket);
-        printf("[Thread %p] Invalid auth format\n", (void*)pthread_self());
-        return NULL;
+// Move a client thread onto the CPU that handles its socket's receive path,
+// so the NIC queue, softirq and reader share a core and its NUMA node
+void pin_to_incoming_cpu(int socket_fd) {
+#ifdef SO_INCOMING_CPU
+    int cpu = -1;
+    socklen_t len = sizeof(cpu);
+    if (getsockopt(socket_fd, SOL_SOCKET, SO_INCOMING_CPU, &cpu, &len) == 0 && cpu >= 0) {
+        pin_current_thread(cpu, "client thread");
     }
+#else
+    (void)socket_fd;
+#endif
+}
 
-    // Validate username
-    if (!validate_username(auth_msg.sender)) {
-        char response[BUFFER_SIZE];
-        strcpy(response, AUTH_FAILED_INVALID);
-        strcat(response, "\n");
-        send(client_socket, response, strlen(response), 0);
-        close(client_socket);
-        printf("[Thread %p] Invalid username: %s\n", (void*)pthread_self(), auth_msg.sender);
-        return NULL;
+// Create, bind and listen on the TCP server socket
+int create_server_socket(void) {
+    struct sockaddr_in address;
+
+    // Create socket
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) {
+        perror("[Server] Socket creation failed");
+        return -1;
     }
 
-    // Check if username already taken
-    if (username_exists(auth_msg.sender)) {
-        char response[BUFFER_SIZE];
-        strcpy(response, AUTH_FAILED);
-        strcat(response, "\n");
-        send(client_socket, response, strlen(response), 0);
-        close(client_socket);
-        printf("[Thread %p] Username already taken: %s\n", (void*)pthread_self(), auth_msg.sender);
-        return NULL;
+    int opt = 1;
+    if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) < 0) {
+        perror("[Server] Setsockopt failed");
+        close(fd);
+        return -1;
     }
 
-    // Authentication successful
-    strncpy(username, auth_msg.sender, MAX_USERNAME - 1);
-    username[MAX_USERNAME - 1] = '\0';
+    // Bind socket
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = INADDR_ANY;  // Listen on all interfaces
+    address.sin_port = htons(server_port);
 
-    // Add client to tracking list
-    if (add_client(client_socket, username) != 0) {
-        char response[BUFFER_SIZE];
-        strcpy(response, SERVER_FULL);
-        strcat(response, "\n");
-        send(client_socket, response, strlen(response), 0);
-        close(client_socket);
-        printf("[Thread %p] Server full, rejecting client\n", (void*)pthread_self());
-        return NULL;
+    if (bind(fd, (struct sockaddr *)&address, sizeof(address)) < 0) {
+        perror("[Server] Bind failed");
+        close(fd);
+        return -1;
     }
 
-    // Send AUTH_OK
-    char response[BUFFER_SIZE];
-    strcpy(response, AUTH_OK);
-    strcat(response, "\n");
-    send(client_socket, response, strlen(response), 0);
+    tune_listener(fd);
 
-    printf("[Thread %p] User '%s' authenticated successfully\n",
-           (void*)pthread_self(), username);
+    // Listen for connections
+    if (listen(fd, __atomic_load_n(&tuning.backlog, __ATOMIC_RELAXED)) < 0) {
+        perror("[Server] Listen failed");
+        close(fd);
+        return -1;
+    }
 
-    // Broadcast join notification
-    char join_msg[BUFFER_SIZE];
-    snprintf(join_msg, BUFFER_SIZE, "%s joined the chat", username);
-    broadcast_notification(join_msg);
+    return fd;
+}
 
-    // Phase 2: Message receiving loop
-    while (server_running) {
-        memset(buffer, 0, BUFFER_SIZE);
-        valread = read(client_socket, buffer, BUFFER_SIZE - 1);
+// Create, bind and listen on the Unix-domain socket at unix_path
+// SOCK_SEQPACKET keeps each send() a separate frame; platforms without it for
+// AF_UNIX fall back to SOCK_STREAM
+int create_unix_socket(void) {
+    struct sockaddr_un addr = {0};
+    addr.sun_family = AF_UNIX;
+    // unix_path is sized like sun_path and its length is checked in main()
+    memcpy(addr.sun_path, unix_path, sizeof(addr.sun_path));
 
-        if (valread <= 0) {
-            // Client disconnected
-            printf("[Thread %p] User '%s' disconnected\n", (void*)pthread_self(), username);
-            break;
-        }
+    int type = SOCK_SEQPACKET;
+    int fd = socket(AF_UNIX, type, 0);
+    if (fd < 0) {
+        type = SOCK_STREAM;
+        fd = socket(AF_UNIX, type, 0);
+    }
+    if (fd < 0) {
+        perror("[Server] Unix socket creation failed");
+        return -1;
+    }
 
-        buffer[valread] = '\0';
+    unlink(unix_path);
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        perror("[Server] Unix socket bind failed");
+        close(fd);
+        return -1;
+    }
 
-        // Parse message
-        message_t msg;
-        if (parse_message(buffer, &msg) == 0) {
+    if (listen(fd, __atomic_load_n(&tuning.backlog, __ATOMIC_RELAXED)) < 0) {
+        perror("[Server] Unix socket listen failed");
+        close(fd);
+        return -1;
+    }
 
-            if (strcmp(msg.type, MSG_TYPE_MESSAGE) == 0) {
-                // Regular chat message
-                printf("[%s] %s\n", username, msg.content);
+    printf("[Server] Listening on %s (%s)\n", unix_path,
+           type == SOCK_SEQPACKET ? "SOCK_SEQPACKET" : "SOCK_STREAM");
+    return fd;
+}
 
-                // Copy username to message (in case client sent wrong username)
-                strncpy(msg.sender, username, MAX_USERNAME - 1);
+// Print command line usage
+void print_usage(const char *prog) {
+    printf("Usage: %s [-p port] [-n node_id] [-c host:port]... [-g host:port] [-k file] [-t cert.pem [-K key.pem]] [-o key=value]... [-f file] [-d seconds] [-s path] [-D dir] [-F file] [-U]\n", prog);
+    printf("  -p port       Listen port (default %d)\n", SERVER_PORT);
+    printf("  -n node_id    Node id announced to peer servers (default node_<port>)\n");
+    printf("  -c host:port  Peer server to link with (repeatable, max %d)\n", MAX_PEERS);
+    printf("  -g host:port  Gateway mode: relay all users over one link to this core server\n");
+    printf("  -k file       Cluster key shared by peers and gateways (required for -c and -g;\n");
+    printf("                without it, peer and gateway links are refused)\n");
+    printf("  -t cert.pem   Accept TLS on the TCP port (kTLS when available)\n");
+    printf("  -K key.pem    Private key for -t (default: read from the certificate file)\n");
+    printf("  -o key=value  Socket tuning (repeatable): backlog, nodelay, cork, sndbuf,\n");
+    printf("                rcvbuf, defer_accept (s), user_timeout (ms), broadcast_cpu,\n");
+    printf("                accept_cpu, follow_rx_cpu, spin_us, busy_poll (us), zerocopy,\n");
+    printf("                zerocopy_min (bytes), hugepages, spam_repeats,\n");
+    printf("                spam_window (s), queue_limit, broadcast_batch, log_level,\n");
+    printf("                memory_budget (KB), send_timeout (ms)\n");
+    printf("  -f file       Read key = value settings from file (reloaded on SIGHUP)\n");
+    printf("  -d seconds    Drain deadline for graceful shutdown (default %d)\n", DRAIN_DEADLINE);
+    printf("  -s path       Also listen on a Unix-domain socket at path\n");
+    printf("  -D dir        Data directory for journal and snapshots (enables persistence)\n");
+    printf("  -F file       Block messages containing any pattern in file (reloaded on SIGHUP)\n");
+    printf("  -U            Hot upgrade: take over sockets from the server on this port\n");
+}
 
-                // Add to message queue for broadcasting
-                pthread_mutex_lock(&queue_mutex);
-                if (enqueue_message(&msg_queue, &msg) == 0) {
-                    pthread_cond_signal(&queue_cond);  // Wake up broadcast thread
-                } else {
-                    printf("[Thread %p] Message queue full!\n", (void*)pthread_self());
-                }
-                pthread_mutex_unlock(&queue_mutex);
+// Main server function
+int main(int argc, char *argv[]) {
+    const char *peer_specs[MAX_PEERS];
+    int peer_spec_count = 0;
+    int take_over = 0;
+    peer_target_t *upstream_target = NULL;
+    const char *tls_cert = NULL;
+    const char *tls_key = NULL;
 
-            } else if (strcmp(msg.type, MSG_TYPE_DISCONNECT) == 0) {
-                // Client requesting disconnect
-                printf("[Thread %p] User '%s' requested disconnect\n",
-                       (void*)pthread_self(), username);
+    int opt_char;
+    while ((opt_char = getopt(argc, argv, "p:n:c:g:k:t:K:o:f:d:s:D:F:Uh")) != -1) {
+        switch (opt_char) {
+            case 'p':
+                server_port = atoi(optarg);
+                if (server_port <= 0 || server_port > 65535) {
+                    fprintf(stderr, "Invalid port: %s\n", optarg);
+                    return EXIT_FAILURE;
+                }
                 break;
-            }
-        } else {
-            printf("[Thread %p] Failed to parse message from %s\n",
-                   (void*)pthread_self(), username);
+            case 'n':
+                if (!validate_username(optarg)) {
+                    fprintf(stderr, "Invalid node id: %s\n", optarg);
+                    return EXIT_FAILURE;
+                }
+                strncpy(node_id, optarg, MAX_USERNAME - 1);
+                break;
+            case 'c':
+                if (peer_spec_count >= MAX_PEERS) {
+                    fprintf(stderr, "Too many peers (max %d)\n", MAX_PEERS);
+                    return EXIT_FAILURE;
+                }
+                peer_specs[peer_spec_count++] = optarg;
+                break;
+            case 'g':
+                upstream_target = calloc(1, sizeof(peer_target_t));
+                if (upstream_target == NULL || parse_target(optarg, upstream_target) != 0) {
+                    fprintf(stderr, "Invalid core server '%s' (expected host:port)\n", optarg);
+                    return EXIT_FAILURE;
+                }
+                gateway_mode = 1;
+                break;
+            case 'k':
+                if (load_cluster_key(optarg) != 0) return EXIT_FAILURE;
+                break;
+            case 't':
+                tls_cert = optarg;
+                break;
+            case 'K':
+                tls_key = optarg;
+                break;
+            case 'o':
+                if (setting_arg_count >= MAX_SETTING_ARGS || apply_setting_arg(optarg) != 0) {
+                    fprintf(stderr, "Invalid setting: %s\n", optarg);
+                    return EXIT_FAILURE;
+                }
+                setting_args[setting_arg_count++] = optarg;
+                break;
+            case 'f':
+                strncpy(config_path, optarg, sizeof(config_path) - 1);
+                break;
+            case 'd':
+                drain_deadline = atoi(optarg);
+                if (drain_deadline < 0) {
+                    fprintf(stderr, "Invalid drain deadline: %s\n", optarg);
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 's':
+                if (strlen(optarg) >= sizeof(unix_path)) {
+                    fprintf(stderr, "Unix socket path too long: %s\n", optarg);
+                    return EXIT_FAILURE;
+                }
+                strncpy(unix_path, optarg, sizeof(unix_path) - 1);
+                break;
+            case 'D':
+                strncpy(data_dir, optarg, sizeof(data_dir) - 1);
+                break;
+            case 'F':
+                strncpy(filter_path, optarg, sizeof(filter_path) - 1);
+                break;
+            case 'U':
+                take_over = 1;
+                break;
+            default:
+                print_usage(argv[0]);
+                return opt_char == 'h' ? 0 : EXIT_FAILURE;
         }
     }
 
-    // Phase 3: Cleanup
-    // Broadcast leave notification
-    char leave_msg[BUFFER_SIZE];
-    snprintf(leave_msg, BUFFER_SIZE, "%s left the chat", username);
-    broadcast_notification(leave_msg);
+    if (node_id[0] == '\0') {
+        snprintf(node_id, MAX_USERNAME, "node_%d", server_port);
+    }
 
-    remove_client(client_socket);
-    close(client_socket);
+    if (config_path[0] != '\0' && load_config(1) != 0) {
+        fprintf(stderr, "Failed to load config file %s\n", config_path);
+        return EXIT_FAILURE;
+    }
 
-    printf("[Thread %p] Client handler for '%s' exiting\n", (void*)pthread_self(), username);
+    if ((peer_spec_count > 0 || gateway_mode) && cluster_key[0] == '\0') {
+        fprintf(stderr, "Peer links (-c) and gateway mode (-g) need a cluster key (-k)\n");
+        return EXIT_FAILURE;
+    }
 
-    return NULL;
-}
+    // A gateway holds no room state of its own: the core does all of that
+    if (gateway_mode && (peer_spec_count > 0 || data_dir[0] != '\0' || filter_path[0] != '\0' ||
+                         take_over)) {
+        fprintf(stderr, "Gateway mode (-g) cannot be combined with -c, -D, -F or -U\n");
+        return EXIT_FAILURE;
+    }
 
-// Main server function
-int main() {
-    struct sockaddr_in address;
+    if (tls_cert != NULL) {
+#ifdef CHAT_TLS
+        if (create_tls_context(tls_cert, tls_key != NULL ? tls_key : tls_cert) != 0) {
+            fprintf(stderr, "Failed to load TLS certificate/key from %s\n", tls_cert);
+            return EXIT_FAILURE;
+        }
+#else
+        (void)tls_key;
+        fprintf(stderr, "TLS support not compiled in (rebuild with -DCHAT_TLS -lssl -lcrypto)\n");
+        return EXIT_FAILURE;
+#endif
+    }
 
     printf("╔════════════════════════════════════════╗\n");
     printf("║     Live Chat Room - Server           ║\n");
     printf("╚════════════════════════════════════════╝\n\n");
 
-    // Register signal handler for graceful shutdown
-    signal(SIGINT, signal_handler);
+    // Shutdown, reload and stats signals become events on signal_fd; they are
+    // blocked from here on, so every thread started later inherits the mask
+    static const int handled_signals[] = { SIGINT, SIGTERM, SIGHUP, SIGUSR1 };
+    signal_fd = open_signal_fd(handled_signals, 4);
+    if (signal_fd < 0) {
+        perror("[Server] Signal setup failed");
+        exit(EXIT_FAILURE);
+    }
+    started_ms = monotonic_ms();
+
+    // A peer or client may vanish mid-send; report EPIPE instead of dying
+    signal(SIGPIPE, SIG_IGN);
 
     init_message_queue(&msg_queue);
     printf("[Server] Message queue initialized\n");
 
-    // Create broadcast thread
-    pthread_t broadcast_tid;
-    if (pthread_create(&broadcast_tid, NULL, broadcast_thread, NULL) != 0) {
-        perror("[Server] Failed to create broadcast thread");
+    if (init_buffer_pool() != 0) {
+        fprintf(stderr, "[Server] Failed to map the buffer pool\n");
         exit(EXIT_FAILURE);
     }
-    pthread_detach(broadcast_tid);
-    printf("[Server] Broadcast thread started\n");
 
-    // Create socket
-    server_fd = socket(AF_INET, SOCK_STREAM, 0);
-    if (server_fd == 0) {
-        perror("[Server] Socket creation failed");
+    if (load_content_filter() != 0) {
+        fprintf(stderr, "[Server] Failed to load content filter from %s\n", filter_path);
         exit(EXIT_FAILURE);
     }
 
-    int opt = 1;
-    if (setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) < 0) {
-        perror("[Server] Setsockopt failed");
-        close(server_fd);
+    snprintf(upgrade_path, sizeof(upgrade_path), UPGRADE_SOCKET_FMT, server_port);
+    main_thread = pthread_self();
+
+    // Interrupt-only handler, installed without SA_RESTART so accept()/read() return EINTR
+    struct sigaction upgrade_action = {0};
+    upgrade_action.sa_handler = upgrade_interrupt_handler;
+    sigemptyset(&upgrade_action.sa_mask);
+    sigaction(SIGUSR2, &upgrade_action, NULL);
+
+    if (take_over) {
+        // Hot upgrade: inherit the listening socket and clients instead of binding
+        if (receive_handoff() != 0) {
+            fprintf(stderr, "[Server] Hot upgrade failed: no server to take over at %s\n",
+                    upgrade_path);
+            exit(EXIT_FAILURE);
+        }
+
+        // listen() on a listening socket just updates its backlog
+        tune_listener(server_fd);
+        listen(server_fd, __atomic_load_n(&tuning.backlog, __ATOMIC_RELAXED));
+    } else if ((server_fd = create_server_socket()) < 0) {
         exit(EXIT_FAILURE);
     }
+    report_socket_tuning(server_fd, "listener");
 
-    // Bind socket
-    address.sin_family = AF_INET;
-    address.sin_addr.s_addr = INADDR_ANY;  // Listen on all interfaces
-    address.sin_port = htons(SERVER_PORT);
+    // A Unix listener inherited through a hot upgrade is reused as-is
+    if (unix_path[0] != '\0' && unix_fd < 0 && (unix_fd = create_unix_socket()) < 0) {
+        exit(EXIT_FAILURE);
+    }
 
-    if (bind(server_fd, (struct sockaddr *)&address, sizeof(address)) < 0) {
-        perror("[Server] Bind failed");
-        close(server_fd);
+    // Restore state before anything can be broadcast; a hot upgrade already
+    // restored it while receiving the scrollback, before adopting any client
+    if (data_dir[0] != '\0') {
+        if (journal_fd < 0 && restore_state() != 0) {
+            perror("[Server] Failed to open data directory");
+            exit(EXIT_FAILURE);
+        }
+
+        indexed_from_doc = (uint32_t)(journal_offset / sizeof(history_entry_t));
+        pthread_t index_tid;
+        if (pthread_create(&index_tid, NULL, index_build_thread, NULL) != 0) {
+            perror("[Server] Failed to create search index thread");
+            exit(EXIT_FAILURE);
+        }
+        pthread_detach(index_tid);
+
+        if (pthread_create(&journal_tid, NULL, journal_thread, NULL) != 0) {
+            perror("[Server] Failed to create journal thread");
+            exit(EXIT_FAILURE);
+        }
+
+        pthread_t snapshot_tid;
+        if (pthread_create(&snapshot_tid, NULL, snapshot_thread, NULL) != 0) {
+            perror("[Server] Failed to create snapshot thread");
+            exit(EXIT_FAILURE);
+        }
+        pthread_detach(snapshot_tid);
+    }
+
+    pthread_t memory_tid;
+    if (pthread_create(&memory_tid, NULL, memory_thread, NULL) != 0) {
+        perror("[Server] Failed to create memory budget thread");
         exit(EXIT_FAILURE);
     }
+    pthread_detach(memory_tid);
 
-    // Listen for connections
-    if (listen(server_fd, 5) < 0) {
-        perror("[Server] Listen failed");
-        close(server_fd);
+    // Create broadcast thread
+    pthread_t broadcast_tid;
+    if (pthread_create(&broadcast_tid, NULL, broadcast_thread, NULL) != 0) {
+        perror("[Server] Failed to create broadcast thread");
         exit(EXIT_FAILURE);
     }
+    printf("[Server] Broadcast thread started\n");
+
+    if (gateway_mode) {
+        pthread_t upstream_tid;
+        if (pthread_create(&upstream_tid, NULL, gateway_upstream_thread, upstream_target) != 0) {
+            perror("[Server] Failed to create gateway upstream thread");
+            exit(EXIT_FAILURE);
+        }
+        pthread_detach(upstream_tid);
+        printf("[Gateway] Relaying users to core %s:%s\n",
+               upstream_target->host, upstream_target->port);
+    } else if (start_upgrade_listener() != 0) {
+        perror("[Server] Upgrade socket unavailable, hot upgrade disabled");
+    }
 
-    printf("[Server] Listening on port %d\n", SERVER_PORT);
+    printf("[Server] Listening on port %d\n", server_port);
     printf("[Server] Maximum clients: %d\n", MAX_CLIENTS);
-    printf("[Server] Press Ctrl+C to shutdown\n\n");
+    printf("[Server] Node id: %s\n", node_id);
+
+    pthread_mutex_lock(&peers_mutex);
+    rebuild_hash_ring();
+    pthread_mutex_unlock(&peers_mutex);
+
+    // Bring up persistent links to configured peer servers
+    for (int i = 0; i < peer_spec_count; i++) {
+        if (start_peer_dialer(peer_specs[i]) != 0) {
+            fprintf(stderr, "[Server] Invalid peer '%s' (expected host:port)\n", peer_specs[i]);
+        }
+    }
+    if (pin_current_thread(placement.accept_cpu, "accept loop") == 0 && placement.accept_cpu >= 0) {
+        printf("[Affinity] Accept loop pinned to CPU %d\n", placement.accept_cpu);
+    }
+    printf("[Server] Press Ctrl+C to shutdown (twice to skip the drain)\n\n");
 
-    // Main accept loop
+    // Main accept loop - TCP and Unix listeners share all connection handling
     while (server_running) {
         struct sockaddr_in client_addr;
         socklen_t client_len = sizeof(client_addr);
 
-        int new_socket = accept(server_fd, (struct sockaddr *)&client_addr, &client_len);
+        if (upgrade_in_progress) park_for_upgrade();
+
+        // Signals are just another event source, so there is no timeout to
+        // poll flags on; an upgrade interrupt (SIGUSR2) still ends the poll
+        struct pollfd listeners[3] = {
+            { .fd = server_fd, .events = POLLIN },
+            { .fd = unix_fd, .events = POLLIN },  // Ignored by poll() when -1
+            { .fd = signal_fd, .events = POLLIN },
+        };
+        int ready = poll(listeners, 3, -1);
+        if (ready <= 0) {
+            if (ready < 0 && errno != EINTR && server_running) {
+                perror("[Server] Poll failed");
+            }
+            continue;
+        }
+
+        if (listeners[2].revents & POLLIN) {
+            handle_pending_signals();
+            continue;
+        }
 
         if (!server_running) break;  // Check shutdown flag
 
+        int new_socket;
+        int is_local = !(listeners[0].revents & POLLIN) && (listeners[1].revents & POLLIN);
+        if (is_local) {
+            new_socket = accept(unix_fd, NULL, NULL);
+        } else {
+            new_socket = accept(server_fd, (struct sockaddr *)&client_addr, &client_len);
+        }
+
+        if (new_socket < 0 && errno == EINTR) continue;
+
         if (new_socket < 0) {
             if (server_running) {
                 perror("[Server] Accept failed");
@@ -389,8 +5682,17 @@ int main() {
             continue;
         }
 
-        char *client_ip = inet_ntoa(client_addr.sin_addr);
-        printf("[Server] New connection from %s\n", client_ip);
+        if (is_local) {
+            if (log_enabled(LOG_CONNECTIONS)) {
+                printf("[Server] New connection on %s\n", unix_path[0] ? unix_path : "Unix socket");
+            }
+        } else {
+            char *client_ip = inet_ntoa(client_addr.sin_addr);
+            if (log_enabled(LOG_CONNECTIONS)) {
+                printf("[Server] New connection from %s\n", client_ip);
+            }
+            tune_client_socket(new_socket);
+        }
 
         // Allocate memory for socket fd to pass to thread
         int *client_sock = malloc(sizeof(int));
@@ -417,25 +5719,62 @@ int main() {
     // Cleanup and shutdown
     printf("\n[Server] Shutting down...\n");
 
-    // Close all client connections
+    // Stop accepting (listener already closed), flush and close progressively
+    drain_clients();
+
+    // Shut down any client connections left after the drain; each reader
+    // sees EOF and closes its own fd, so none is closed twice
     pthread_mutex_lock(&clients_mutex);
     printf("[Server] Closing %d client connection(s)\n", client_count);
     for (int i = 0; i < client_count; i++) {
-        close(clients[i].socket_fd);
+        if (clients[i].channel == 0) shutdown(clients[i].socket_fd, SHUT_RDWR);
+    }
+    for (int i = 0; i < gateway_count; i++) {
+        shutdown(gateways[i].socket_fd, SHUT_RDWR);
     }
-    client_count = 0;
     pthread_mutex_unlock(&clients_mutex);
 
+    // Gateway mode: close local users; the core sees their channels close
+    pthread_mutex_lock(&channels_mutex);
+    for (int i = 0; i < channel_count; i++) {
+        shutdown(channels[i].socket_fd, SHUT_RDWR);
+    }
+    pthread_mutex_unlock(&channels_mutex);
+
+    // Shut down peer links; their readers close them
+    pthread_mutex_lock(&peers_mutex);
+    for (int i = 0; i < peer_count; i++) {
+        shutdown(peers[i].socket_fd, SHUT_RDWR);
+    }
+    pthread_mutex_unlock(&peers_mutex);
+
     // Close server socket
     close(server_fd);
+    unlink(upgrade_path);
+    if (unix_fd >= 0) {
+        close(unix_fd);
+        if (unix_path[0] != '\0') unlink(unix_path);
+    }
 
-    // Signal broadcast thread to exit
+    // Signal broadcast thread to exit once the queue is empty, and wait for it
+    pthread_mutex_lock(&queue_mutex);
+    broadcast_running = 0;
     pthread_cond_signal(&queue_cond);
+    pthread_mutex_unlock(&queue_mutex);
+    pthread_join(broadcast_tid, NULL);
+
+    // Final snapshot so the next start has no journal to replay
+    if (journal_fd >= 0) {
+        stop_journal();
+        if (write_snapshot() != 0) {
+            perror("[Server] Final snapshot failed");
+        }
+        close(journal_fd);
+    }
 
-    // Destroy synchronization primitives
-    pthread_mutex_destroy(&clients_mutex);
-    pthread_mutex_destroy(&queue_mutex);
-    pthread_cond_destroy(&queue_cond);
+    // The mutexes are statically initialized and left alone: detached
+    // readers, the memory thread and the snapshot thread may still hold or
+    // wait on them until the process exits
 
     printf("[Server] Shutdown complete\n");
     printf("╔════════════════════════════════════════╗\n");
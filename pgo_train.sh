@@ -0,0 +1,119 @@
+#!/bin/sh
+# Training run for the profile-guided server build (make pgo)
+# Usage: pgo_train.sh ./server-pgo-gen ./client
+#
+# Drives an instrumented server through the benchmark scenarios over a Unix
+# socket - chat fan-out, shared-memory clients, topics, search, repeated
+# messages and join/leave churn - then shuts it down cleanly so the profile
+# counters are written out
+
+SERVER=${1:-./server-pgo-gen}
+CLIENT=${2:-./client}
+PORT=${PGO_PORT:-18080}
+ROUNDS=${PGO_ROUNDS:-200}
+
+WORK=$(mktemp -d /tmp/chat_pgo.XXXXXX) || exit 1
+SOCK="$WORK/chat.sock"
+trap 'rm -rf "$WORK"' EXIT
+
+"$SERVER" -p "$PORT" -s "$SOCK" -D "$WORK" -d 2 > "$WORK/server.log" 2>&1 &
+SERVER_PID=$!
+
+# Wait for the Unix socket to appear
+i=0
+while [ ! -S "$SOCK" ]; do
+    i=$((i + 1))
+    if [ $i -gt 50 ] || ! kill -0 "$SERVER_PID" 2>/dev/null; then
+        echo "pgo_train: server failed to start" >&2
+        cat "$WORK/server.log" >&2
+        exit 1
+    fi
+    sleep 0.1
+done
+
+# Run one client: username, then the lines produced by the given command
+run_client() {
+    name=$1; shift
+    flags=$1; shift
+    { echo "$name"; "$@"; sleep 1; } | "$CLIENT" $flags "$SOCK" > /dev/null 2>&1
+}
+
+chat_lines() {
+    n=0
+    while [ $n -lt "$ROUNDS" ]; do
+        echo "message $n from $1 about deployment latency and throughput"
+        n=$((n + 1))
+    done
+}
+
+topic_lines() {
+    echo "/sub news.*"
+    echo "/sub alerts.#"
+    n=0
+    while [ $n -lt "$ROUNDS" ]; do
+        echo "/pub news.tech update $n"
+        echo "/pub alerts.disk.full warning $n"
+        n=$((n + 1))
+    done
+    echo "/unsub news.*"
+}
+
+search_lines() {
+    n=0
+    while [ $n -lt 50 ]; do
+        echo "/search deployment latency"
+        echo "/search message $n"
+        n=$((n + 1))
+    done
+}
+
+repeat_lines() {
+    n=0
+    while [ $n -lt 50 ]; do
+        echo "same text every time"
+        n=$((n + 1))
+    done
+}
+
+# Wait for every client started since the last call
+CLIENTS=""
+wait_clients() {
+    for pid in $CLIENTS; do
+        wait "$pid"
+    done
+    CLIENTS=""
+}
+
+# Chat fan-out over sockets and shared-memory rings
+for c in 1 2 3 4 5 6; do
+    run_client "chat$c" "" chat_lines "chat$c" &
+    CLIENTS="$CLIENTS $!"
+done
+for c in 1 2; do
+    run_client "ring$c" "-m" chat_lines "ring$c" &
+    CLIENTS="$CLIENTS $!"
+done
+wait_clients
+
+# Topics, search over the journal just written, repeated messages
+for c in 1 2 3; do
+    run_client "topic$c" "" topic_lines &
+    CLIENTS="$CLIENTS $!"
+done
+run_client "searcher" "" search_lines &
+CLIENTS="$CLIENTS $!"
+run_client "repeater" "" repeat_lines &
+CLIENTS="$CLIENTS $!"
+wait_clients
+
+# Join/leave churn
+c=0
+while [ $c -lt 40 ]; do
+    { echo "churn$c"; echo "hello"; } | "$CLIENT" "$SOCK" > /dev/null 2>&1 &
+    CLIENTS="$CLIENTS $!"
+    c=$((c + 1))
+done
+wait_clients
+
+kill -INT "$SERVER_PID"
+wait "$SERVER_PID"
@@ -12,20 +12,137 @@
 #include <stdint.h>
 #include <string.h>
 #include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <pthread.h>
+#ifdef __linux__
+#include <sys/signalfd.h>
+#endif
 
 // Configuration
+// Deployment shape - each may be overridden at build time (-DMAX_CLIENTS=1024,
+// or a SHAPE in the Makefile); ring sizes must stay powers of two
+#ifndef SERVER_PORT
 #define SERVER_PORT 8080
-#define MAX_USERNAME 32
+#endif
+#ifndef MAX_MESSAGE
 #define MAX_MESSAGE 256
+#endif
+#ifndef MAX_CLIENTS
 #define MAX_CLIENTS 50
+#endif
+#ifndef BUFFER_SIZE
 #define BUFFER_SIZE 1024
+#endif
+#ifndef QUEUE_SIZE
+#define QUEUE_SIZE 128
+#endif
+#ifndef HISTORY_SIZE
+#define HISTORY_SIZE 50
+#endif
+#ifndef MAX_PEERS
+#define MAX_PEERS 8
+#endif
+#ifndef MAX_GATEWAYS
+#define MAX_GATEWAYS 8
+#endif
+#ifndef MAX_INTERNED
+#define MAX_INTERNED 1024
+#endif
+#ifndef MAX_ROOMS
+#define MAX_ROOMS 64
+#endif
+#ifndef BROADCAST_BATCH
+#define BROADCAST_BATCH 16
+#endif
+#ifndef JOURNAL_RETAIN
+#define JOURNAL_RETAIN 65536
+#endif
 
-// Message types
-#define MSG_TYPE_AUTH       "AUTH"
-#define MSG_TYPE_MESSAGE    "MSG"
-#define MSG_TYPE_NOTIFY     "NOTIFY"
-#define MSG_TYPE_ERROR      "ERROR"
-#define MSG_TYPE_DISCONNECT "DISCONNECT"
+#define MAX_USERNAME 32
+#define PEER_RECONNECT_DELAY 2
+#define RING_VNODES 64
+#define DEFAULT_ROOM "lobby"
+#define UPGRADE_SOCKET_FMT "/tmp/live_chat_%d.upgrade"
+#define HANDOFF_BATCH 16
+#define UPGRADE_RELAY_MS 500
+#define DRAIN_DEADLINE 10
+#define SNAPSHOT_INTERVAL 30
+#define JOURNAL_BATCH 64
+#define JOURNAL_QUEUE 1024
+#define MAX_TOPIC 64
+#define MAX_TOPIC_DEPTH 16
+#define MAX_SUBSCRIPTIONS 16
+#define LISTEN_BACKLOG 128
+#define ZEROCOPY_MIN 16384
+#define ZEROCOPY_MIN_LIMIT (BROADCAST_BATCH * BUFFER_SIZE > ZEROCOPY_MIN ? \
+                            BROADCAST_BATCH * BUFFER_SIZE : ZEROCOPY_MIN)
+#define ZEROCOPY_PENDING 64
+#define POOL_SLOT_SIZE (BUFFER_SIZE * 2)
+#define INTERN_BUCKETS 256
+#define TOPIC_CLIENT_BUCKETS 256
+#define SKETCH_DEPTH 4
+#define SKETCH_WIDTH 1024
+#define SPAM_REPEATS 5
+#define SPAM_WINDOW 10
+#define MAX_TERM 32
+#define SEARCH_LIMIT 20
+#define POOL_MIN_SLOTS (MAX_CLIENTS * 4)
+#define HUGE_PAGE_SIZE (2 * 1024 * 1024)
+#define QUEUE_MASK (QUEUE_SIZE - 1)
+#define MAX_CONFIG_LINE 256
+#define MAX_SETTING_ARGS 64
+#define LOG_CONNECTIONS 1
+#define LOG_MESSAGES 2
+#define MEMORY_CHECK_MS 100
+#define CLUSTER_KEY_MIN 16
+
+// Reject shapes the code cannot index or fit
+_Static_assert((QUEUE_SIZE & QUEUE_MASK) == 0, "QUEUE_SIZE must be a power of two");
+_Static_assert((MAX_ROOMS & (MAX_ROOMS - 1)) == 0, "MAX_ROOMS must be a power of two");
+_Static_assert(MAX_MESSAGE + MAX_TOPIC + MAX_USERNAME + 16 <= BUFFER_SIZE,
+               "BUFFER_SIZE must hold a full frame");
+_Static_assert(MAX_INTERNED > MAX_CLIENTS, "every client needs an interned name");
+
+// Message types - the one table the enum, type names, dispatch hash, parser
+// and formatter are generated from. Columns: kind, wire name, its first two
+// bytes (the dispatch hash key) and the fields that follow the name, in wire
+// order; the last non-sender field takes the rest of the line, colons included
+#define PROTOCOL_TYPES(X) \
+    X(AUTH,       "AUTH",       'A', 'U', FIELD_SENDER,  FIELD_NONE,    FIELD_NONE)    \
+    X(MSG,        "MSG",        'M', 'S', FIELD_SENDER,  FIELD_CONTENT, FIELD_NONE)    \
+    X(NOTIFY,     "NOTIFY",     'N', 'O', FIELD_CONTENT, FIELD_NONE,    FIELD_NONE)    \
+    X(ERROR,      "ERROR",      'E', 'R', FIELD_CONTENT, FIELD_NONE,    FIELD_NONE)    \
+    X(DISCONNECT, "DISCONNECT", 'D', 'I', FIELD_SENDER,  FIELD_NONE,    FIELD_NONE)    \
+    X(PEER,       "PEER",       'P', 'E', FIELD_SENDER,  FIELD_CONTENT, FIELD_NONE)    \
+    X(SHM,        "SHM",        'S', 'H', FIELD_NONE,    FIELD_NONE,    FIELD_NONE)    \
+    X(GATEWAY,    "GATEWAY",    'G', 'A', FIELD_SENDER,  FIELD_CONTENT, FIELD_NONE)    \
+    X(CH,         "CH",         'C', 'H', FIELD_NONE,    FIELD_NONE,    FIELD_NONE)    \
+    X(SUB,        "SUB",        'S', 'U', FIELD_TOPIC,   FIELD_NONE,    FIELD_NONE)    \
+    X(UNSUB,      "UNSUB",      'U', 'N', FIELD_TOPIC,   FIELD_NONE,    FIELD_NONE)    \
+    X(PUB,        "PUB",        'P', 'U', FIELD_TOPIC,   FIELD_SENDER,  FIELD_CONTENT) \
+    X(SEARCH,     "SEARCH",     'S', 'E', FIELD_TOPIC,   FIELD_CONTENT, FIELD_NONE)    \
+    X(RESULT,     "RESULT",     'R', 'E', FIELD_SENDER,  FIELD_CONTENT, FIELD_NONE)    \
+    X(MESH,       "MESH",       'M', 'E', FIELD_TOPIC,   FIELD_CONTENT, FIELD_NONE)    \
+    X(HIST,       "HIST",       'H', 'I', FIELD_TOPIC,   FIELD_SENDER,  FIELD_CONTENT)
+
+// message_t field a protocol field is parsed into (PEER/GATEWAY ids go in
+// sender, their cluster key in content)
+typedef enum {
+    FIELD_NONE,
+    FIELD_SENDER,
+    FIELD_TOPIC,
+    FIELD_CONTENT,
+} message_field_t;
+
+#define PROTOCOL_KIND(kind, name, c0, c1, f1, f2, f3) TYPE_##kind,
+typedef enum {
+    PROTOCOL_TYPES(PROTOCOL_KIND)
+    TYPE_UNKNOWN                    // Replies such as AUTH_OK, or anything unrecognized
+} message_kind_t;
+#undef PROTOCOL_KIND
 
 // Response codes
 #define AUTH_OK             "AUTH_OK"
@@ -34,40 +151,208 @@
 #define MSG_DELIVERED       "MSG_OK"
 #define SERVER_FULL         "ERROR:Server is full"
 #define DISCONNECT_ACK      "DISCONNECT_ACK"
+#define SHM_OK              "SHM_OK"
 
 // Message structure
 typedef struct {
-    char type[16];              // Message type (AUTH, MSG, NOTIFY, etc.)
+    message_kind_t kind;        // Message type, TYPE_UNKNOWN if not in PROTOCOL_TYPES
+    char type[16];              // Message type as received (AUTH, MSG, NOTIFY, etc.)
     char sender[MAX_USERNAME];  // Username of sender
     char content[MAX_MESSAGE];  // Message content
+    char topic[MAX_TOPIC];      // Topic (PUB), pattern (SUB/UNSUB) or room (SEARCH), empty for chat
+    int remote;                 // Non-zero if relayed in from a peer server
 } message_t;
 
 // Protocol message formats (all newline-terminated):
 // AUTH:username, MSG:username:content, NOTIFY:text, ERROR:text, DISCONNECT:username
+// Server-to-server: PEER:node_id:key (link hello, sent by both ends),
+// MESH:count:digest (the sender's view of the cluster: how many nodes it is
+// linked with, itself included, and a hash of their sorted ids) and
+// HIST:room:username:content (scrollback handed to a room's new owner)
+// Gateway-to-core: GATEWAY:gateway_id:key (link hello), then CH:channel:frame in
+// both directions - channel 0 from the core means every user on the gateway,
+// an empty frame closes the channel
+// Topics: SUB:pattern, UNSUB:pattern, PUB:topic:username:content - topics are
+// dot-separated segments; in patterns * matches one segment and a trailing #
+// matches any remaining segments
+// Search: SEARCH:room:words, answered by up to SEARCH_LIMIT RESULT:username:content
+// frames (oldest first) and a NOTIFY with the match count
+// Unix socket only: SHM requests a shared-memory ring, answered by SHM_OK with
+// the ring memfd and its eventfd attached (SCM_RIGHTS)
+
+// Tables generated from PROTOCOL_TYPES, indexed by message_kind_t
+#define PROTOCOL_NAME(kind, name, c0, c1, f1, f2, f3) name,
+#define PROTOCOL_FIELDS(kind, name, c0, c1, f1, f2, f3) { f1, f2, f3 },
+static const char *const message_type_names[] = { PROTOCOL_TYPES(PROTOCOL_NAME) "" };
+static const uint8_t message_fields[][3] = { PROTOCOL_TYPES(PROTOCOL_FIELDS) { 0, 0, 0 } };
+#undef PROTOCOL_NAME
+#undef PROTOCOL_FIELDS
+
+// Perfect hash of a type name's first two bytes, collision-free over the
+// table; a new type that collides is a duplicate initializer below, which
+// -Wextra (-Woverride-init) reports
+#define TYPE_HASH(c0, c1) ((((unsigned)(c0) << 1) ^ (unsigned)(c1)) & 63)
+#define PROTOCOL_SLOT(kind, name, c0, c1, f1, f2, f3) [TYPE_HASH(c0, c1)] = TYPE_##kind + 1,
+static const uint8_t message_kind_by_hash[64] = { PROTOCOL_TYPES(PROTOCOL_SLOT) };
+#undef PROTOCOL_SLOT
+
+// Look up a type name: one table probe and one string compare
+static inline message_kind_t message_kind_of(const char *type) {
+    if (type[0] == '\0') return TYPE_UNKNOWN;
+
+    int slot = message_kind_by_hash[TYPE_HASH((unsigned char)type[0], (unsigned char)type[1])];
+    if (slot == 0 || strcmp(type, message_type_names[slot - 1]) != 0) return TYPE_UNKNOWN;
+    return (message_kind_t)(slot - 1);
+}
+
+// Format any table message -> NAME[:field...]\n, fields given in wire order
+static inline int format_frame(char *buffer, message_kind_t kind, const char *first,
+                               const char *second, const char *third) {
+    const char *name = message_type_names[kind];
+    if (message_fields[kind][0] == FIELD_NONE) {
+        return snprintf(buffer, BUFFER_SIZE, "%s\n", name);
+    }
+    if (message_fields[kind][1] == FIELD_NONE) {
+        return snprintf(buffer, BUFFER_SIZE, "%s:%s\n", name, first);
+    }
+    if (message_fields[kind][2] == FIELD_NONE) {
+        return snprintf(buffer, BUFFER_SIZE, "%s:%s:%s\n", name, first, second);
+    }
+    return snprintf(buffer, BUFFER_SIZE, "%s:%s:%s:%s\n", name, first, second, third);
+}
 
 // Format auth message -> AUTH:username\n
 static inline int format_auth_message(char *buffer, const char *username) {
-    return snprintf(buffer, BUFFER_SIZE, "AUTH:%s\n", username);
+    return format_frame(buffer, TYPE_AUTH, username, NULL, NULL);
+}
+
+// Format a gateway's re-login after its core link came back -> AUTH:username:RESUME\n
+// Parses as a plain AUTH (the mark follows the sender); a core honours the
+// mark only on gateway links, and skips the scrollback replay and join notice
+#define AUTH_RESUME_MARK "RESUME"
+static inline int format_resume_message(char *buffer, const char *username) {
+    return snprintf(buffer, BUFFER_SIZE, "AUTH:%s:" AUTH_RESUME_MARK "\n", username);
+}
+
+// Whether an AUTH frame (newline stripped) carries the resume mark
+static inline int is_resume_auth(const char *frame) {
+    const char *mark = strchr(frame, ':');
+    if (mark == NULL) return 0;
+    mark = strchr(mark + 1, ':');
+    return mark != NULL && strcmp(mark + 1, AUTH_RESUME_MARK) == 0;
 }
 
 // Format chat message -> MSG:sender:content\n
 static inline int format_chat_message(char *buffer, const char *sender, const char *content) {
-    return snprintf(buffer, BUFFER_SIZE, "MSG:%s:%s\n", sender, content);
+    return format_frame(buffer, TYPE_MSG, sender, content, NULL);
 }
 
 // Format notification message -> NOTIFY:notification\n
 static inline int format_notification(char *buffer, const char *notification) {
-    return snprintf(buffer, BUFFER_SIZE, "NOTIFY:%s\n", notification);
+    return format_frame(buffer, TYPE_NOTIFY, notification, NULL, NULL);
 }
 
 // Format error message -> ERROR:error description\n
 static inline int format_error_message(char *buffer, const char *error) {
-    return snprintf(buffer, BUFFER_SIZE, "ERROR:%s\n", error);
+    return format_frame(buffer, TYPE_ERROR, error, NULL, NULL);
 }
 
 // Format disconnect message -> DISCONNECT:username\n
 static inline int format_disconnect_message(char *buffer, const char *username) {
-    return snprintf(buffer, BUFFER_SIZE, "DISCONNECT:%s\n", username);
+    return format_frame(buffer, TYPE_DISCONNECT, username, NULL, NULL);
+}
+
+// Format topic subscription -> SUB:pattern\n
+static inline int format_subscribe(char *buffer, const char *pattern) {
+    return format_frame(buffer, TYPE_SUB, pattern, NULL, NULL);
+}
+
+// Format topic unsubscription -> UNSUB:pattern\n
+static inline int format_unsubscribe(char *buffer, const char *pattern) {
+    return format_frame(buffer, TYPE_UNSUB, pattern, NULL, NULL);
+}
+
+// Format topic publication -> PUB:topic:sender:content\n
+static inline int format_publish(char *buffer, const char *topic, const char *sender,
+                                 const char *content) {
+    return format_frame(buffer, TYPE_PUB, topic, sender, content);
+}
+
+// Format search request -> SEARCH:room:query\n
+static inline int format_search(char *buffer, const char *room, const char *query) {
+    return format_frame(buffer, TYPE_SEARCH, room, query, NULL);
+}
+
+// Format search hit -> RESULT:sender:content\n
+static inline int format_search_result(char *buffer, const char *sender, const char *content) {
+    return format_frame(buffer, TYPE_RESULT, sender, content, NULL);
+}
+
+// Format peer link hello -> PEER:node_id:key\n
+static inline int format_peer_hello(char *buffer, const char *node_id, const char *key) {
+    return format_frame(buffer, TYPE_PEER, node_id, key, NULL);
+}
+
+// Format cluster view announcement -> MESH:count:digest\n (digest in hex)
+static inline int format_mesh(char *buffer, int count, uint32_t digest) {
+    char count_text[16], digest_text[16];
+    snprintf(count_text, sizeof(count_text), "%d", count);
+    snprintf(digest_text, sizeof(digest_text), "%08x", (unsigned)digest);
+    return format_frame(buffer, TYPE_MESH, count_text, digest_text, NULL);
+}
+
+// Format handed-over scrollback entry -> HIST:room:sender:content\n
+static inline int format_history_entry(char *buffer, const char *room, const char *sender,
+                                       const char *content) {
+    return format_frame(buffer, TYPE_HIST, room, sender, content);
+}
+
+// Format gateway link hello -> GATEWAY:gateway_id:key\n
+static inline int format_gateway_hello(char *buffer, const char *gateway_id, const char *key) {
+    return format_frame(buffer, TYPE_GATEWAY, gateway_id, key, NULL);
+}
+
+// Wrap a frame for a gateway channel -> CH:channel:frame\n
+// The frame's own trailing newline, if any, is dropped
+static inline int format_channel_frame(char *buffer, int channel, const char *frame) {
+    size_t len = strlen(frame);
+    if (len > 0 && frame[len - 1] == '\n') len--;
+    return snprintf(buffer, BUFFER_SIZE, "CH:%d:%.*s\n", channel, (int)len, frame);
+}
+
+// Split CH:channel:frame (newline already stripped) into channel and frame
+// The frame points into line and may be empty (channel closed)
+static inline int parse_channel_frame(const char *line, int *channel, const char **frame) {
+    if (strncmp(line, "CH:", 3) != 0) return -1;
+
+    const char *p = line + 3;
+    int value = 0;
+    if (*p < '0' || *p > '9') return -1;
+    while (*p >= '0' && *p <= '9') {
+        value = value * 10 + (*p - '0');
+        if (value > 1000000000) return -1;
+        p++;
+    }
+    if (*p != ':') return -1;
+
+    *channel = value;
+    *frame = p + 1;
+    return 0;
+}
+
+// 32-bit FNV-1a hash with a murmur3 finalizer for better bit dispersion
+static inline uint32_t hash_bytes(const char *data, size_t len) {
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < len; i++) {
+        hash ^= (uint8_t)data[i];
+        hash *= 16777619u;
+    }
+    hash ^= hash >> 16;
+    hash *= 0x85ebca6bu;
+    hash ^= hash >> 13;
+    hash *= 0xc2b2ae35u;
+    hash ^= hash >> 16;
+    return hash;
 }
 
 // Parse raw message into message_t structure
@@ -87,66 +372,85 @@ static inline int parse_message(const char *raw_message, message_t *msg) {
     }
 
     // Extract message type
-    char *token = strtok(buffer, ":");
+    char *save = NULL;
+    char *token = strtok_r(buffer, ":", &save);
     if (token == NULL) return -1;
     strncpy(msg->type, token, sizeof(msg->type) - 1);
-
-    // Parse based on message type
-    if (strcmp(msg->type, "AUTH") == 0) {
-        // AUTH:username
-        token = strtok(NULL, ":");
-        if (token == NULL) return -1;
-        strncpy(msg->sender, token, sizeof(msg->sender) - 1);
-
-    } else if (strcmp(msg->type, "MSG") == 0) {
-        // MSG:sender:content
-        token = strtok(NULL, ":");
-        if (token == NULL) return -1;
-        strncpy(msg->sender, token, sizeof(msg->sender) - 1);
-
-        // Get the rest as content (may contain ':')
-        token = strtok(NULL, "");
+    msg->kind = message_kind_of(msg->type);
+    if (msg->kind == TYPE_UNKNOWN) return 0;
+
+    // Fill the fields the table lists for this type; a sender always ends at
+    // the next ':', any other last field takes the rest of the line
+    const uint8_t *fields = message_fields[msg->kind];
+    for (int i = 0; i < 3 && fields[i] != FIELD_NONE; i++) {
+        int rest = fields[i] != FIELD_SENDER && (i == 2 || fields[i + 1] == FIELD_NONE);
+        token = strtok_r(NULL, rest ? "" : ":", &save);
         if (token == NULL) return -1;
-        strncpy(msg->content, token, sizeof(msg->content) - 1);
 
-    } else if (strcmp(msg->type, "NOTIFY") == 0) {
-        // NOTIFY:content
-        token = strtok(NULL, "");
-        if (token == NULL) return -1;
-        strncpy(msg->content, token, sizeof(msg->content) - 1);
-
-    } else if (strcmp(msg->type, "ERROR") == 0) {
-        // ERROR:content
-        token = strtok(NULL, "");
-        if (token == NULL) return -1;
-        strncpy(msg->content, token, sizeof(msg->content) - 1);
-
-    } else if (strcmp(msg->type, "DISCONNECT") == 0) {
-        // DISCONNECT:username
-        token = strtok(NULL, ":");
-        if (token == NULL) return -1;
-        strncpy(msg->sender, token, sizeof(msg->sender) - 1);
+        if (fields[i] == FIELD_SENDER) {
+            strncpy(msg->sender, token, sizeof(msg->sender) - 1);
+        } else if (fields[i] == FIELD_TOPIC) {
+            strncpy(msg->topic, token, sizeof(msg->topic) - 1);
+        } else {
+            strncpy(msg->content, token, sizeof(msg->content) - 1);
+        }
     }
 
     return 0;
 }
 
+// Characters allowed in usernames, as a 256-bit set indexed by byte value:
+// '0'-'9' (bits 48-57), 'A'-'Z' (65-90), '_' (95) and 'a'-'z' (97-122)
+static const uint64_t username_charset[4] = {
+    0x03FF000000000000ULL, 0x07FFFFFE87FFFFFEULL, 0, 0
+};
+
 // Validate username (alphanumeric and underscores only, length check)
 static inline int validate_username(const char *username) {
     if (username == NULL) return 0;
 
-    size_t len = strlen(username);
+    // One table lookup per byte; the terminator is not in the set, so the
+    // scan stops there or at the first invalid character
+    const unsigned char *p = (const unsigned char *)username;
+    size_t len = 0;
+    while (len < MAX_USERNAME && (username_charset[p[len] >> 6] >> (p[len] & 63)) & 1) {
+        len++;
+    }
 
-    // Check length (must be between 1 and MAX_USERNAME-1)
-    if (len == 0 || len >= MAX_USERNAME) return 0;
+    // Must be between 1 and MAX_USERNAME-1 characters, all of them valid
+    return len > 0 && len < MAX_USERNAME && p[len] == '\0';
+}
 
-    // Check for invalid characters (only alphanumeric and underscore allowed)
-    for (size_t i = 0; i < len; i++) {
-        char c = username[i];
-        if (!((c >= 'a' && c <= 'z') ||
-              (c >= 'A' && c <= 'Z') ||
-              (c >= '0' && c <= '9') ||
-              c == '_')) {
+// Validate a topic (or a pattern when wildcards is set)
+// Segments are non-empty runs of alphanumerics, '_' and '-' separated by '.';
+// patterns may use * for a whole segment and # as the last segment
+static inline int validate_topic(const char *topic, int wildcards) {
+    if (topic == NULL) return 0;
+
+    size_t len = strlen(topic);
+    if (len == 0 || len >= MAX_TOPIC) return 0;
+
+    int depth = 1;
+    size_t segment_start = 0;
+    for (size_t i = 0; i <= len; i++) {
+        char c = topic[i];
+        if (c == '.' || c == '\0') {
+            size_t segment_len = i - segment_start;
+            if (segment_len == 0) return 0;
+
+            char first = topic[segment_start];
+            if (first == '*' || first == '#') {
+                if (!wildcards || segment_len != 1) return 0;
+                if (first == '#' && c != '\0') return 0;  // # must be last
+            }
+            if (c == '.' && ++depth > MAX_TOPIC_DEPTH) return 0;
+            segment_start = i + 1;
+        } else if (c == '*' || c == '#') {
+            if (i != segment_start) return 0;  // Wildcards fill a whole segment
+        } else if (!((c >= 'a' && c <= 'z') ||
+                     (c >= 'A' && c <= 'Z') ||
+                     (c >= '0' && c <= '9') ||
+                     c == '_' || c == '-')) {
             return 0;
         }
     }
@@ -166,17 +470,167 @@ static inline int validate_message_content(const char *content) {
     return 1;
 }
 
+// Nonzero if any of the 8 bytes in word is outside printable ASCII
+// (>= 0x80, < 0x20 or DEL). Word-at-a-time: the subtraction borrows into a
+// byte's top bit exactly when that byte is below the constant
+static inline uint64_t text_word_needs_check(uint64_t word) {
+    const uint64_t ones = 0x0101010101010101ULL;
+    const uint64_t highs = 0x8080808080808080ULL;
+    uint64_t del = word ^ (0x7f * ones);
+
+    return (word | ((word - 0x20 * ones) & ~word) | ((del - ones) & ~del)) & highs;
+}
+
+// Length of the well-formed UTF-8 sequence at s, or 0 if it is malformed
+// (stray continuation, overlong form, surrogate, above U+10FFFF or truncated)
+static inline size_t utf8_sequence_length(const unsigned char *s, size_t avail) {
+    unsigned char c = s[0];
+    if (c < 0x80) return 1;
+    if (c < 0xC2 || c > 0xF4) return 0;
+
+    size_t len = c < 0xE0 ? 2 : c < 0xF0 ? 3 : 4;
+    if (avail < len) return 0;
+    for (size_t i = 1; i < len; i++) {
+        if ((s[i] & 0xC0) != 0x80) return 0;
+    }
+
+    if ((c == 0xE0 && s[1] < 0xA0) ||   // Overlong 3-byte form
+        (c == 0xED && s[1] >= 0xA0) ||  // UTF-16 surrogate
+        (c == 0xF0 && s[1] < 0x90) ||   // Overlong 4-byte form
+        (c == 0xF4 && s[1] >= 0x90)) {  // Above U+10FFFF
+        return 0;
+    }
+    return len;
+}
+
+// Make message content safe to print on another user's terminal, in place:
+// malformed UTF-8 and C0/C1 control characters (escape sequences start with
+// ESC or CSI) become '?'. Printable ASCII is skipped 8 bytes at a time.
+// Returns the number of bytes replaced
+static inline size_t scrub_message_content(char *content) {
+    unsigned char *s = (unsigned char *)content;
+    size_t len = strlen(content);
+    size_t replaced = 0;
+    size_t i = 0;
+
+    while (i < len) {
+        if (len - i >= 8) {
+            uint64_t word;
+            memcpy(&word, s + i, sizeof(word));
+            if (!text_word_needs_check(word)) {
+                i += 8;
+                continue;
+            }
+        }
+
+        size_t n = utf8_sequence_length(s + i, len - i);
+        int control = (n == 1 && (s[i] < 0x20 || s[i] == 0x7f)) ||
+                      (n == 2 && s[i] == 0xC2 && s[i + 1] < 0xA0);
+        if (n == 0 || control) {
+            if (n == 0) n = 1;
+            memset(s + i, '?', n);
+            replaced += n;
+        }
+        i += n;
+    }
+
+    return replaced;
+}
+
+// Shared-memory ring for co-located clients (single producer: the server,
+// single consumer: the client). Carries the same newline-terminated frames as
+// the socket, so the consumer splits lines exactly as it would after read().
+// Positions only grow; index = position & (SHM_RING_SIZE - 1)
+#define SHM_RING_SIZE (1 << 16)
+typedef struct {
+    uint64_t head;                  // Bytes written (producer)
+    char pad_head[56];              // Keep producer and consumer on separate cache lines
+    uint64_t tail;                  // Bytes consumed (consumer)
+    char pad_tail[56];
+    uint32_t consumer_waiting;      // Consumer is (about to be) blocked on the eventfd
+    uint32_t closed;                // Producer detached; consumer falls back to the socket
+    uint64_t dropped;               // Frames dropped because the ring was full
+    char data[SHM_RING_SIZE];
+} shm_ring_t;
+
+// Copy a frame into the ring
+// Returns 1 if the consumer must be woken, 0 if not, -1 if the ring is full
+static inline int shm_ring_write(shm_ring_t *ring, const char *frame, size_t len) {
+    uint64_t head = ring->head;
+    uint64_t tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+
+    if (len > SHM_RING_SIZE - (head - tail)) {
+        __atomic_add_fetch(&ring->dropped, 1, __ATOMIC_RELAXED);
+        return -1;
+    }
+
+    size_t offset = head & (SHM_RING_SIZE - 1);
+    size_t first = len < SHM_RING_SIZE - offset ? len : SHM_RING_SIZE - offset;
+    memcpy(ring->data + offset, frame, first);
+    memcpy(ring->data, frame + first, len - first);
+
+    __atomic_store_n(&ring->head, head + len, __ATOMIC_RELEASE);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    return __atomic_load_n(&ring->consumer_waiting, __ATOMIC_ACQUIRE) != 0;
+}
+
+// Copy up to size bytes out of the ring; returns the number of bytes read
+static inline size_t shm_ring_read(shm_ring_t *ring, char *out, size_t size) {
+    uint64_t tail = ring->tail;
+    uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+
+    size_t len = (size_t)(head - tail);
+    if (len > size) len = size;
+
+    size_t offset = tail & (SHM_RING_SIZE - 1);
+    size_t first = len < SHM_RING_SIZE - offset ? len : SHM_RING_SIZE - offset;
+    memcpy(out, ring->data + offset, first);
+    memcpy(out + first, ring->data, len - first);
+
+    __atomic_store_n(&ring->tail, tail + len, __ATOMIC_RELEASE);
+    return len;
+}
+
 // Client information structure
 typedef struct {
     int socket_fd;                  // Client socket file descriptor
-    char username[MAX_USERNAME];    // Authenticated username
+    uint32_t user_id;               // Authenticated username, interned by the server
     int authenticated;              // Authentication status (0 or 1)
+    pthread_t handler_thread;       // Thread reading from this client
+    shm_ring_t *ring;               // Shared-memory ring for broadcasts, or NULL
+    int ring_event_fd;              // Wakes the ring consumer (-1 without a ring)
+    int channel;                    // Gateway channel id, 0 for a direct connection
+    int zerocopy;                   // MSG_ZEROCOPY enabled on this socket
+    uint32_t zc_next;               // Kernel sequence number of the next zerocopy send
+    uint32_t zc_tail;               // Oldest zerocopy send not yet completed
+    struct zc_buffer *zc_pending[ZEROCOPY_PENDING]; // Buffers in flight, by seq % ZEROCOPY_PENDING
+    size_t zc_bytes;                // Bytes of the batches those in-flight sends still pin
+    int shed;                       // Disconnected as a slow consumer, awaiting its reader's cleanup
+    uint64_t replayed_seq;          // Last scrollback message its join replay sent
 } client_info_t;
 
+// Peer server link structure (federation)
+typedef struct {
+    int socket_fd;                  // Peer link socket file descriptor
+    char node_id[MAX_USERNAME];     // Node id announced in the PEER hello
+    int stalled;                    // Send buffer overflowed; the link is being dropped
+    int mesh_size;                  // Nodes in the peer's announced view, 0 until MESH
+    uint32_t mesh_digest;           // Hash of the ids in that view
+    pthread_t reader_thread;        // Thread reading from this link
+} peer_info_t;
+
+// Queued broadcast: the sender travels as an interned id, and the entry
+// holds a reference on it until the broadcast thread has sent it
+typedef struct {
+    uint32_t sender_id;             // Interned username of the sender
+    int remote;                     // Non-zero if relayed in from a peer server
+    char topic[MAX_TOPIC];          // Topic for a publish, empty for chat
+    char content[MAX_MESSAGE];      // Message content
+} queued_message_t;
+
 // Message queue structure (circular buffer for thread-safe messaging)
-#define QUEUE_SIZE 100
 typedef struct {
-    message_t messages[QUEUE_SIZE]; // Circular buffer
+    queued_message_t messages[QUEUE_SIZE]; // Circular buffer
     int head;                       // Write position
     int tail;                       // Read position
     int count;                      // Number of messages in queue
@@ -200,25 +654,245 @@ static inline int is_queue_full(message_queue_t *queue) {
 }
 
 // Enqueue message into the queue
-static inline int enqueue_message(message_queue_t *queue, const message_t *msg) {
+static inline int enqueue_message(message_queue_t *queue, const queued_message_t *msg) {
     if (is_queue_full(queue)) return -1;
 
     queue->messages[queue->head] = *msg;
-    queue->head = (queue->head + 1) % QUEUE_SIZE;
+    queue->head = (queue->head + 1) & QUEUE_MASK;
     queue->count++;
 
     return 0;
 }
 
 // Dequeue message from the queue
-static inline int dequeue_message(message_queue_t *queue, message_t *msg) {
+static inline int dequeue_message(message_queue_t *queue, queued_message_t *msg) {
     if (is_queue_empty(queue)) return -1;
 
     *msg = queue->messages[queue->tail];
-    queue->tail = (queue->tail + 1) % QUEUE_SIZE;
+    queue->tail = (queue->tail + 1) & QUEUE_MASK;
     queue->count--;
 
     return 0;
 }
 
+// Signals as file descriptor events
+// open_signal_fd() blocks the given signals in the calling thread, and so in
+// every thread it starts afterwards, and returns an fd that becomes readable
+// when one arrives; next_signal() then reads them one at a time, so shutdown
+// and reload run from a poll() loop instead of inside a signal handler. Linux
+// uses signalfd; elsewhere, or if that fails, a handler writes each signal
+// number into a non-blocking self-pipe
+static int signal_pipe[2] = { -1, -1 };
+
+// Self-pipe handler: write() is async-signal-safe; a full pipe already wakes the reader
+static void signal_pipe_handler(int sig) {
+    int saved_errno = errno;
+    unsigned char byte = (unsigned char)sig;
+    ssize_t written = write(signal_pipe[1], &byte, 1);
+    (void)written;
+    errno = saved_errno;
+}
+
+// Route signals[0..count) to a readable fd; returns the fd or -1
+static inline int open_signal_fd(const int *signals, int count) {
+    sigset_t mask;
+    sigemptyset(&mask);
+    for (int i = 0; i < count; i++) sigaddset(&mask, signals[i]);
+
+#ifdef __linux__
+    if (pthread_sigmask(SIG_BLOCK, &mask, NULL) == 0) {
+        int fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+        if (fd >= 0) return fd;
+        pthread_sigmask(SIG_UNBLOCK, &mask, NULL);
+    }
+#endif
+
+    if (pipe(signal_pipe) != 0) return -1;
+    for (int i = 0; i < 2; i++) {
+        fcntl(signal_pipe[i], F_SETFL, fcntl(signal_pipe[i], F_GETFL) | O_NONBLOCK);
+        fcntl(signal_pipe[i], F_SETFD, FD_CLOEXEC);
+    }
+
+    // SA_RESTART: the handler only queues the signal, so nobody should see EINTR
+    struct sigaction action = {0};
+    action.sa_handler = signal_pipe_handler;
+    sigemptyset(&action.sa_mask);
+    action.sa_flags = SA_RESTART;
+    for (int i = 0; i < count; i++) sigaction(signals[i], &action, NULL);
+    return signal_pipe[0];
+}
+
+// Read the next pending signal from an open_signal_fd() fd; 0 if none is pending
+static inline int next_signal(int fd) {
+#ifdef __linux__
+    if (signal_pipe[0] < 0) {
+        struct signalfd_siginfo info;
+        if (read(fd, &info, sizeof(info)) != (ssize_t)sizeof(info)) return 0;
+        return (int)info.ssi_signo;
+    }
+#endif
+    unsigned char byte;
+    if (read(fd, &byte, 1) != 1) return 0;
+    return byte;
+}
+
+#ifdef CHAT_TLS
+// TLS transport (build with -DCHAT_TLS, link -lssl -lcrypto)
+// The handshake runs in OpenSSL; the session keys are then handed to kernel TLS
+// so the socket carries plaintext send()/recv() like any other connection.
+// Without kTLS, a pump thread bridges SSL to one end of a socketpair and the
+// caller uses the other end, so the rest of the code never sees SSL either way
+#include <stdlib.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <openssl/ssl.h>
+
+#define TLS_RECORD_BYTE 0x16        // First byte of a TLS ClientHello
+
+typedef struct {
+    SSL *ssl;
+    int net_fd;                     // TCP socket carrying TLS records
+    int app_fd;                     // Plaintext end handed to the caller's peer
+} tls_pump_t;
+
+// Both directions offloaded to the kernel after the handshake
+static inline int tls_kernel_offloaded(SSL *ssl) {
+    return BIO_get_ktls_send(SSL_get_wbio(ssl)) && BIO_get_ktls_recv(SSL_get_rbio(ssl));
+}
+
+// Copy plaintext between an SSL session and its socketpair end until either
+// closes. Both fds are non-blocking and each direction keeps its own buffer,
+// so a side that stops reading never stalls the other direction; poll waits
+// only for what each pending operation needs (SSL may want POLLOUT to read)
+static inline void *tls_pump_thread(void *arg) {
+    tls_pump_t pump = *(tls_pump_t *)arg;
+    free(arg);
+
+    char to_app[BUFFER_SIZE];
+    char to_net[BUFFER_SIZE];
+    size_t app_len = 0, app_off = 0;    // Decrypted, not yet passed to app_fd
+    size_t net_len = 0;                 // Read from app_fd, not yet taken by SSL_write
+    int running = 1;
+    while (running) {
+        short net_events = 0, app_events = 0;
+        int progress = 0;
+
+        // Network to application
+        if (app_len == 0) {
+            int n = SSL_read(pump.ssl, to_app, sizeof(to_app));
+            if (n > 0) {
+                app_len = (size_t)n;
+                app_off = 0;
+                progress = 1;
+            } else {
+                int error = SSL_get_error(pump.ssl, n);
+                if (error == SSL_ERROR_WANT_READ) net_events |= POLLIN;
+                else if (error == SSL_ERROR_WANT_WRITE) net_events |= POLLOUT;
+                else running = 0;
+            }
+        }
+        if (app_len > 0) {
+            ssize_t n = send(pump.app_fd, to_app + app_off, app_len - app_off, MSG_NOSIGNAL);
+            if (n > 0) {
+                app_off += (size_t)n;
+                if (app_off == app_len) app_len = 0;
+                progress = 1;
+            } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                app_events |= POLLOUT;
+            } else if (errno == EINTR) {
+                progress = 1;
+            } else {
+                running = 0;
+            }
+        }
+
+        // Application to network
+        if (net_len == 0) {
+            ssize_t n = recv(pump.app_fd, to_net, sizeof(to_net), 0);
+            if (n > 0) {
+                net_len = (size_t)n;
+                progress = 1;
+            } else if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                app_events |= POLLIN;
+            } else if (n < 0 && errno == EINTR) {
+                progress = 1;
+            } else {
+                running = 0;
+            }
+        }
+        if (net_len > 0) {
+            // A retry after WANT_* passes the same bytes, as SSL_write requires
+            int n = SSL_write(pump.ssl, to_net, (int)net_len);
+            if (n > 0) {
+                memmove(to_net, to_net + n, net_len - (size_t)n);
+                net_len -= (size_t)n;
+                progress = 1;
+            } else {
+                int error = SSL_get_error(pump.ssl, n);
+                if (error == SSL_ERROR_WANT_READ) net_events |= POLLIN;
+                else if (error == SSL_ERROR_WANT_WRITE) net_events |= POLLOUT;
+                else running = 0;
+            }
+        }
+
+        if (running && !progress) {
+            // An fd with nothing to wait for is left out, so its hangup can't spin us
+            struct pollfd fds[2] = {
+                { .fd = net_events ? pump.net_fd : -1, .events = net_events },
+                { .fd = app_events ? pump.app_fd : -1, .events = app_events },
+            };
+            if (poll(fds, 2, -1) < 0 && errno != EINTR) break;
+        }
+    }
+
+    SSL_shutdown(pump.ssl);
+    SSL_free(pump.ssl);
+    close(pump.net_fd);
+    close(pump.app_fd);
+    return NULL;
+}
+
+// Finish a completed handshake: returns the fd the caller should use from now
+// on (the TCP socket itself under kTLS, a socketpair end otherwise), or -1.
+// Takes ownership of ssl and, on failure, of net_fd
+static inline int tls_finish(SSL *ssl, int net_fd) {
+    if (tls_kernel_offloaded(ssl)) {
+        // The kernel holds the keys now; the socket BIO does not close net_fd
+        SSL_free(ssl);
+        return net_fd;
+    }
+
+    int pair[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, pair) != 0) {
+        SSL_free(ssl);
+        close(net_fd);
+        return -1;
+    }
+
+    // The pump never blocks in SSL or on its socketpair end
+    SSL_set_mode(ssl, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+    fcntl(net_fd, F_SETFL, fcntl(net_fd, F_GETFL) | O_NONBLOCK);
+    fcntl(pair[1], F_SETFL, fcntl(pair[1], F_GETFL) | O_NONBLOCK);
+
+    tls_pump_t *pump = malloc(sizeof(tls_pump_t));
+    pthread_t pump_tid;
+    if (pump != NULL) {
+        pump->ssl = ssl;
+        pump->net_fd = net_fd;
+        pump->app_fd = pair[1];
+    }
+    if (pump == NULL || pthread_create(&pump_tid, NULL, tls_pump_thread, pump) != 0) {
+        free(pump);
+        SSL_free(ssl);
+        close(net_fd);
+        close(pair[0]);
+        close(pair[1]);
+        return -1;
+    }
+    pthread_detach(pump_tid);
+    return pair[0];
+}
+#endif // CHAT_TLS
+
 #endif // PROTOCOL_H